@@ -2,22 +2,18 @@
 #include "mqtt.h"
 #include "tera_internal.h"
 
-MQTT_Decode_Result mqtt_ack_read(Tera_Context *ctx, const Client_Data *cdata, uint16 *mid)
+MQTT_Decode_Result mqtt_ack_read(Tera_Context *ctx, const Client_Data *cdata, MQTT_Frame *frame,
+                                 uint16 *mid)
 {
-    Buffer *buf         = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    Fixed_Header header = {0};
-    uint8 rc            = 0;
+    (void)ctx;
+    (void)cdata;
 
-    isize result        = mqtt_fixed_header_read(buf, &header);
-    if (result < 0)
+    if (buffer_read_u16(&frame->payload, mid) != sizeof(uint16))
         return MQTT_DECODE_ERROR;
 
-    // TODO properties
+    // TODO reason code and properties, only present in MQTT v5 past the packet id
 
-    result = MQTT_DECODE_SUCCESS;
-    buffer_read_struct(buf, "HB", mid, &rc);
-
-    switch (header.bits.type) {
+    switch (frame->header.bits.type) {
     case PUBACK:
         log_info("recv: PUBACK mid: %d rc: 0x00", *mid);
         break;
@@ -32,36 +28,35 @@ MQTT_Decode_Result mqtt_ack_read(Tera_Context *ctx, const Client_Data *cdata, ui
         break;
     }
 
-    return result;
+    return MQTT_DECODE_SUCCESS;
 }
 
-#define DEFAULT_PUBACK_BYTE  0x40
-#define DEFAULT_PUBREC_BYTE  0x50
-#define DEFAULT_PUBREL_BYTE  0x62
-#define DEFAULT_PUBCOMP_BYTE 0x70
-
 void mqtt_ack_write(Tera_Context *ctx, const Client_Data *cdata, Packet_Type ack_type, uint16 id)
 {
-    Buffer *buf         = &ctx->connection_data[cdata->conn_id].send_buffer;
-    // remaining length of 2 means success by default
-    Fixed_Header header = {.remaining_length = 2};
+    Send_Queue *queue = connection_send_queue(ctx, cdata->conn_id);
+    // All the acks share the same layout, remaining length of 2 means success by default
+    Buffer *buf       = send_queue_scratch_begin(queue, mqtt_puback_size());
+    if (!buf) {
+        log_warning(">>>>: Send queue full, ack dropped");
+        return;
+    }
 
     // TODO handle reason codes, 0x00 is success
     switch (ack_type) {
     case PUBACK:
-        header.byte = DEFAULT_PUBACK_BYTE;
+        mqtt_puback_encode(buf, id);
         log_info("sent: PUBACK mid: %d rc: 0x00", id);
         break;
     case PUBREC:
-        header.byte = DEFAULT_PUBREC_BYTE;
+        mqtt_pubrec_encode(buf, id);
         log_info("sent: PUBREC mid: %d rc: 0x00", id);
         break;
     case PUBREL:
-        header.byte = DEFAULT_PUBREL_BYTE;
+        mqtt_pubrel_encode(buf, id);
         log_info("sent: PUBREL mid: %d rc: 0x00", id);
         break;
     case PUBCOMP:
-        header.byte = DEFAULT_PUBCOMP_BYTE;
+        mqtt_pubcomp_encode(buf, id);
         log_info("sent: PUBCOMP mid: %d rc: 0x00", id);
         break;
     default:
@@ -69,6 +64,5 @@ void mqtt_ack_write(Tera_Context *ctx, const Client_Data *cdata, Packet_Type ack
         break;
     }
 
-    mqtt_fixed_header_write(buf, &header);
-    buffer_write_struct(buf, "H", id);
+    send_queue_scratch_commit(queue);
 }
@@ -56,6 +56,12 @@ void arena_reset(Arena *a)
     a->prev_offset = 0;
 }
 
+void arena_rewind(Arena *a, uint32 offset)
+{
+    a->curr_offset = offset;
+    a->prev_offset = offset;
+}
+
 void arena_dump(const Arena *a)
 {
     for (int i = 0; i < a->curr_offset; ++i) {
@@ -15,5 +15,7 @@ void arena_init(Arena *a, void *buffer, uint32 buffer_size);
 void *arena_alloc(Arena *a, uint32 size);
 void *arena_at(const Arena *a, uintptr_t offset);
 void arena_reset(Arena *a);
+// Drop everything allocated from offset onwards
+void arena_rewind(Arena *a, uint32 offset);
 uintptr_t arena_current_offset(const Arena *a);
 void arena_dump(const Arena *a);
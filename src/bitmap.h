@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+/*
+ * Occupancy bitmap of a fixed size table, one bit per slot set while the slot
+ * is in use. Free slots are found a word at a time and the used ones visited
+ * with ctz, skipping 64 empty slots per word:
+ *
+ *   slots   [ used | free | free | used | used | free ... ]
+ *   word    ... 0 1 1 0 0 1
+ *
+ * A table a few percent full costs a read per 64 slots to walk instead of one
+ * per slot. The walk goes over a copy of each word, the bits of the slots it
+ * frees can be cleared as it goes:
+ *
+ *   for (usize w = 0; w < BITMAP_WORDS(n); ++w)
+ *       for (uint64 bits = map[w]; bits; bits &= bits - 1)
+ *           visit(w * 64 + __builtin_ctzll(bits));
+ */
+#define BITMAP_WORDS(bits) (((bits) + 63) / 64)
+
+static inline void bitmap_set(uint64 *words, usize bit)
+{
+    words[bit / 64] |= (uint64)1 << (bit % 64);
+}
+
+static inline void bitmap_clear(uint64 *words, usize bit)
+{
+    words[bit / 64] &= ~((uint64)1 << (bit % 64));
+}
+
+static inline bool bitmap_test(const uint64 *words, usize bit)
+{
+    return (words[bit / 64] >> (bit % 64)) & 1;
+}
+
+// First clear bit out of bits, -1 if all of them are set. The unused tail of
+// the last word reads as clear, a hit there means the table is full
+static inline int32 bitmap_find_clear(const uint64 *words, usize bits)
+{
+    for (usize i = 0; i < BITMAP_WORDS(bits); ++i) {
+        if (~words[i]) {
+            usize bit = i * 64 + __builtin_ctzll(~words[i]);
+            return bit < bits ? (int32)bit : -1;
+        }
+    }
+
+    return -1;
+}
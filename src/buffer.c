@@ -1,6 +1,7 @@
 #include "buffer.h"
 #include "bin.h"
 #include "net.h"
+#include "utf8.h"
 #include <ctype.h>
 #include <errno.h>
 #include <stdarg.h>
@@ -19,6 +20,15 @@ void buffer_reset(Buffer *buffer)
     buffer->write_pos = 0;
 }
 
+void buffer_compact(Buffer *buffer)
+{
+    uint32 available = buffer_available(buffer);
+
+    memmove(buffer->data, buffer->data + buffer->read_pos, available);
+    buffer->read_pos  = 0;
+    buffer->write_pos = available;
+}
+
 int buffer_write(Buffer *buffer, const void *data, uint32 length)
 {
     if (!buffer || !data)
@@ -81,7 +91,8 @@ isize buffer_net_recv(Buffer *buffer, int fd)
     if (!buffer || fd < 0)
         return -1;
 
-    isize bytes_read = net_recv_nonblocking(fd, buffer->data + buffer->write_pos, buffer->size);
+    isize bytes_read = net_recv_nonblocking(fd, buffer->data + buffer->write_pos,
+                                            buffer->size - buffer->write_pos);
     if (bytes_read < 0) {
         // No data available right now
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -422,6 +433,19 @@ uint32 buffer_read_binary(void *dst, Buffer *buf, uint32 len)
     return len;
 }
 
+uint32 buffer_read_utf8(void *dst, Buffer *buf, uint32 len)
+{
+    if (buf->read_pos + len > buf->size)
+        return 0;
+
+    if (!utf8_copy(dst, buf->data + buf->read_pos, len))
+        return 0;
+
+    buf->read_pos += len;
+
+    return len;
+}
+
 uint32 buffer_write_binary(Buffer *buf, const void *src, uint32 len)
 {
     if (buf->write_pos + len > buf->size)
@@ -434,7 +458,13 @@ uint32 buffer_write_binary(Buffer *buf, const void *src, uint32 len)
 
 uint32 buffer_write_utf8_string(Buffer *buf, const void *src, uint32 len)
 {
-    return buffer_write_struct(buf, "H", len) + buffer_write_binary(buf, src, len);
+    uint8 *dst = buffer_reserve(buf, sizeof(uint16) + len);
+    if (!dst)
+        return 0;
+
+    dst += buffer_store_u16(dst, len);
+    memcpy(dst, src, len);
+    return sizeof(uint16) + len;
 }
 
 void buffer_dump(const Buffer *buf)
@@ -12,6 +12,8 @@ typedef struct buffer {
 
 void buffer_init(Buffer *buffer, void *back_buffer, uint32 size);
 void buffer_reset(Buffer *buffer);
+// Move the unread bytes to the start, making room for more after them
+void buffer_compact(Buffer *buffer);
 
 int buffer_write(Buffer *buffer, const void *data, uint32 length);
 int buffer_read(Buffer *buffer, void *out, uint32 length);
@@ -20,6 +22,99 @@ int buffer_skip(Buffer *buffer, uint32 length);
 uint32 buffer_available(const Buffer *buffer);
 bool buffer_is_empty(const Buffer *buffer);
 
+/*
+ * Fixed width codecs for the hot paths, big endian as on the wire. Each one
+ * checks the bounds once and returns the number of bytes moved, 0 if they
+ * don't fit, so results can be summed or compared against sizeof like the
+ * format string based buffer_read_struct and buffer_write_struct, without
+ * interpreting a format or going through varargs.
+ */
+static inline uint32 buffer_read_u8(Buffer *buf, uint8 *out)
+{
+    if (buf->read_pos + sizeof(uint8) > buf->size)
+        return 0;
+
+    *out = buf->data[buf->read_pos++];
+    return sizeof(uint8);
+}
+
+static inline uint32 buffer_read_u16(Buffer *buf, uint16 *out)
+{
+    if (buf->read_pos + sizeof(uint16) > buf->size)
+        return 0;
+
+    const uint8 *src = buf->data + buf->read_pos;
+    *out             = (uint16)(src[0] << 8 | src[1]);
+    buf->read_pos += sizeof(uint16);
+    return sizeof(uint16);
+}
+
+static inline uint32 buffer_read_u32(Buffer *buf, uint32 *out)
+{
+    if (buf->read_pos + sizeof(uint32) > buf->size)
+        return 0;
+
+    const uint8 *src = buf->data + buf->read_pos;
+    *out = (uint32)src[0] << 24 | (uint32)src[1] << 16 | (uint32)src[2] << 8 | src[3];
+    buf->read_pos += sizeof(uint32);
+    return sizeof(uint32);
+}
+
+/*
+ * Unchecked stores, for encoders that reserved the room of a whole frame
+ * upfront with buffer_reserve. They return the bytes stored to move a cursor.
+ */
+static inline uint32 buffer_store_u8(uint8 *dst, uint8 value)
+{
+    dst[0] = value;
+    return sizeof(uint8);
+}
+
+static inline uint32 buffer_store_u16(uint8 *dst, uint16 value)
+{
+    dst[0] = value >> 8;
+    dst[1] = value;
+    return sizeof(uint16);
+}
+
+static inline uint32 buffer_store_u32(uint8 *dst, uint32 value)
+{
+    dst[0] = value >> 24;
+    dst[1] = value >> 16;
+    dst[2] = value >> 8;
+    dst[3] = value;
+    return sizeof(uint32);
+}
+
+// Claim length bytes at the write position, NULL if they don't fit
+static inline uint8 *buffer_reserve(Buffer *buf, uint32 length)
+{
+    if (buf->write_pos + length > buf->size)
+        return NULL;
+
+    uint8 *dst = buf->data + buf->write_pos;
+    buf->write_pos += length;
+    return dst;
+}
+
+static inline uint32 buffer_write_u8(Buffer *buf, uint8 value)
+{
+    uint8 *dst = buffer_reserve(buf, sizeof(uint8));
+    return dst ? buffer_store_u8(dst, value) : 0;
+}
+
+static inline uint32 buffer_write_u16(Buffer *buf, uint16 value)
+{
+    uint8 *dst = buffer_reserve(buf, sizeof(uint16));
+    return dst ? buffer_store_u16(dst, value) : 0;
+}
+
+static inline uint32 buffer_write_u32(Buffer *buf, uint32 value)
+{
+    uint8 *dst = buffer_reserve(buf, sizeof(uint32));
+    return dst ? buffer_store_u32(dst, value) : 0;
+}
+
 // Network utilities
 isize buffer_net_recv(Buffer *buffer, int fd);
 isize buffer_net_send(Buffer *buffer, int fd);
@@ -28,6 +123,8 @@ isize buffer_net_send(Buffer *buffer, int fd);
 uint32 buffer_read_struct(Buffer *buffer, const char *fmt, ...);
 uint32 buffer_write_struct(Buffer *buffer, const char *fmt, ...);
 uint32 buffer_read_binary(void *dst, Buffer *buf, uint32 len);
+// Same as buffer_read_binary for an MQTT UTF-8 string, 0 if it's not well-formed
+uint32 buffer_read_utf8(void *dst, Buffer *buf, uint32 len);
 uint32 buffer_write_binary(Buffer *buf, const void *src, uint32 len);
 uint32 buffer_write_utf8_string(Buffer *buf, const void *src, uint32 len);
 
@@ -0,0 +1,41 @@
+#include "buffer_pool.h"
+#include <string.h>
+
+void buffer_pool_init(Buffer_Pool *pool, void *buffer, uint32 block_size, uint32 block_count)
+{
+    pool->buf         = buffer;
+    pool->block_size  = block_size;
+    pool->block_count = block_count;
+    pool->bump        = 0;
+    pool->free_head   = -1;
+    pool->in_use      = 0;
+}
+
+void *buffer_pool_acquire(Buffer_Pool *pool)
+{
+    int32 index = pool->free_head;
+
+    if (index != -1) {
+        memcpy(&pool->free_head, pool->buf + index * pool->block_size, sizeof(int32));
+    } else {
+        if (pool->bump == pool->block_count)
+            return NULL;
+        index = pool->bump++;
+    }
+
+    pool->in_use++;
+
+    return pool->buf + index * pool->block_size;
+}
+
+void buffer_pool_release(Buffer_Pool *pool, void *block)
+{
+    if (!block)
+        return;
+
+    int32 index = ((uint8 *)block - pool->buf) / pool->block_size;
+
+    memcpy(block, &pool->free_head, sizeof(int32));
+    pool->free_head = index;
+    pool->in_use--;
+}
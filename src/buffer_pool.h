@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+/*
+ * Pool of fixed size blocks over a fixed buffer, backing the per connection
+ * receive and scratch buffers. Connections only hold a block while they have
+ * bytes in flight, an idle one gives them back:
+ *
+ *   blocks  [ conn 3 | free | conn 9 | conn 3 | free | untouched ... ]
+ *   free    -> 4 -> 1
+ *
+ * Released blocks are chained through their first bytes and handed out again
+ * first, blocks past the bump index were never used, so a fleet of mostly
+ * idle clients keeps reusing the same few blocks and the rest of the buffer
+ * is never touched.
+ */
+typedef struct buffer_pool {
+    uint8 *buf;
+    uint32 block_size;
+    uint32 block_count;
+    uint32 bump;     // Blocks from here on were never handed out
+    int32 free_head; // Last released block, -1 if none
+    uint32 in_use;
+} Buffer_Pool;
+
+// block_size must be able to hold an int32
+void buffer_pool_init(Buffer_Pool *pool, void *buffer, uint32 block_size, uint32 block_count);
+
+// Returns NULL if all the blocks are in use
+void *buffer_pool_acquire(Buffer_Pool *pool);
+void buffer_pool_release(Buffer_Pool *pool, void *block);
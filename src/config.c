@@ -90,6 +90,8 @@ void config_set(const char *key, const char *value)
     strncpy(entry->value, value, MAX_VALUE_SIZE);
 
     if (config_map[index] && strncmp(config_map[index]->key, key, MAX_KEY_SIZE) == 0) {
+        // Keep the rest of the bucket chained behind the new value
+        entry->next       = config_map[index]->next;
         config_map[index] = entry;
     } else {
         entry->next       = config_map[index];
@@ -101,6 +103,14 @@ void config_set_default(void)
 {
     // TODO
     config_set("log_verbosity", "debug");
+    // iomux (epoll/kqueue/select) or uring
+    config_set("io_backend", "iomux");
+    // Number of sharded reactors, each on its own thread and listener
+    config_set("workers", "1");
+    // Receive pipeline, packet (one at a time) or batch (grouped by type)
+    config_set("pipeline", "packet");
+    // Seconds between two pipeline counters reports, 0 to disable
+    config_set("pipeline_stats", "0");
 }
 
 const char *config_get(const char *key)
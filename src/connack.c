@@ -2,8 +2,6 @@
 #include "mqtt.h"
 #include "tera_internal.h"
 
-#define DEFAULT_CONNACK_BYTE 0x20
-
 /*
  * According to MQTT v5.0 spec, CONNACK packet format is:
  *
@@ -22,31 +20,30 @@
  */
 void mqtt_connack_write(Tera_Context *ctx, const Client_Data *cdata, CONNACK_Reason_Code rc)
 {
-    Buffer *buf             = &ctx->connection_data[cdata->conn_id].send_buffer;
+    Send_Queue *queue       = connection_send_queue(ctx, cdata->conn_id);
     uint8 session_present   = 0;
     uint8 properties_length = 0;
+    bool v5                 = cdata->mqtt_version == MQTT_V5;
 
     // TODO clean session logic
 
     uint8 connect_ack_flags = session_present & 0x01;
-    buffer_reset(buf);
-
-    // Fixed Header
-    isize bytes_written    = buffer_write_struct(buf, "B", DEFAULT_CONNACK_BYTE);
 
-    // Remaining length = flags + rc
-    uint8 remaining_length = sizeof(uint8) * 2;
-    if (cdata->mqtt_version == MQTT_V5)
-        // + properties if MQTT v5
-        remaining_length += sizeof(uint8) + properties_length;
+    // Remaining length = flags + rc, + properties if MQTT v5
+    uint32 frame_size = v5 ? mqtt_connack_v5_size() : mqtt_connack_size();
+    Buffer *buf       = send_queue_scratch_begin(queue, frame_size);
+    if (!buf) {
+        log_warning(">>>>: Send queue full, CONNACK dropped");
+        return;
+    }
 
-    bytes_written += mqtt_variable_length_write(buf, remaining_length);
-    bytes_written +=
-        cdata->mqtt_version == MQTT_V5
-            ? buffer_write_struct(buf, "BBB", connect_ack_flags, (uint8)rc, properties_length)
-            : buffer_write_struct(buf, "BB", connect_ack_flags, (uint8)rc);
+    uint32 bytes_written = v5 ? mqtt_connack_v5_encode(buf, connect_ack_flags, rc,
+                                                       properties_length)
+                              : mqtt_connack_encode(buf, connect_ack_flags, rc);
 
     // TODO properties if present
 
-    log_info("sent: CONNACK %zd bytes, sp: %d rc: 0x%02X", bytes_written, session_present, rc);
+    send_queue_scratch_commit(queue);
+
+    log_info("sent: CONNACK %u bytes, sp: %d rc: 0x%02X", bytes_written, session_present, rc);
 }
@@ -4,7 +4,18 @@
 
 #define PROTOCOL_NAME_BYTES_LEN 6
 
-MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
+// Length prefix of a byte string, Client_Data keeps the sizes in a single byte
+static inline bool connect_string_size_read(Buffer *buf, uint8 *size)
+{
+    uint16 length = 0;
+    if (buffer_read_u16(buf, &length) != sizeof(uint16) || length > UINT8_MAX)
+        return false;
+
+    *size = length;
+    return true;
+}
+
+MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata, MQTT_Frame *frame)
 {
     if (ctx->connection_data[cdata->conn_id].connected) {
         /*
@@ -15,43 +26,19 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
         return MQTT_DECODE_INVALID;
     }
 
-    Buffer *buf     = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    usize start_pos = buf->read_pos;
+    Buffer *buf         = &frame->payload;
+    usize packet_length = frame->header.remaining_length;
 
-    // Read packet type and flags
-    if (buffer_read_struct(buf, "B", &(uint8){0}) != sizeof(uint8)) {
-        log_error(">>>>: Failed to read packet header");
-        buf->read_pos = start_pos; // Restore position
+    // Each connection slot owns MAX_CLIENT_SIZE bytes of the client arena for
+    // the strings of its CONNECT, reused by the next connection on the slot.
+    // Offsets are relative to the slot.
+    if (packet_length > MAX_CLIENT_SIZE) {
+        log_error(">>>>: CONNECT exceeds the client data size");
         return MQTT_DECODE_ERROR;
     }
 
-    // Read remaining length
-    usize packet_length = 0;
-    int length_bytes    = mqtt_variable_length_read(buf, &packet_length);
-    if (length_bytes < 0) {
-        log_error(">>>>: Invalid variable length encoding");
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
-
-    // Validate we have enough data for the complete packet
-    usize total_packet_size =
-        sizeof(uint8) + length_bytes + packet_length; // header + length + payload
-    if (start_pos + total_packet_size > buf->size) {
-        log_debug(">>>>: Incomplete packet - need %zu more bytes",
-                  (start_pos + total_packet_size) - buf->size);
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
-
-    usize memory_offset = arena_current_offset(ctx->client_arena);
-    uint8 *ptr          = arena_alloc(ctx->client_arena, packet_length);
-    if (!ptr) {
-        // TODO handle case
-        log_critical("bump arena OOM");
-    }
-
-    cdata->client_id_size = memory_offset;
+    usize memory_offset = 0;
+    uint8 *ptr          = arena_at(ctx->client_arena, cdata->conn_id * MAX_CLIENT_SIZE);
 
     // === VARIABLE HEADER ===
 
@@ -61,7 +48,7 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
 
     // 2. Protocol Version
     uint8 protocol_version;
-    if (buffer_read_struct(buf, "B", &protocol_version) != sizeof(uint8))
+    if (buffer_read_u8(buf, &protocol_version) != sizeof(uint8))
         return MQTT_DECODE_ERROR;
 
     if (protocol_version != 0x05 && protocol_version != 0x04) {
@@ -74,15 +61,15 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
 
     // Read variable header byte flags, followed by keepalive MSB and LSB
     // (2 bytes word) and the client ID length (2 bytes here again)
-    if (buffer_read_struct(buf, "BH", &cdata->connect_flags, &cdata->keepalive) !=
-        sizeof(uint8) + sizeof(uint16))
+    if (buffer_read_u8(buf, &cdata->connect_flags) != sizeof(uint8) ||
+        buffer_read_u16(buf, &cdata->keepalive) != sizeof(uint16))
         return MQTT_DECODE_ERROR;
 
     if (cdata->mqtt_version == MQTT_V5) {
         // 4. Properties Length + Properties
         usize properties_length = 0;
         int prop_length_bytes   = mqtt_variable_length_read(buf, &properties_length);
-        if (prop_length_bytes < 0)
+        if (prop_length_bytes == 0)
             return MQTT_DECODE_ERROR;
 
         // Skip Properties for now (should be parsed in full implementation)
@@ -96,8 +83,8 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
     // === PAYLOAD ===
 
     // 1. Client Identifier
-    uint16 client_id_size = 0;
-    if (buffer_read_struct(buf, "H", &client_id_size) != sizeof(uint16))
+    uint8 client_id_size = 0;
+    if (!connect_string_size_read(buf, &client_id_size))
         return MQTT_DECODE_ERROR;
 
     if (mqtt_clean_session_get(cdata->connect_flags) && client_id_size == 0)
@@ -106,10 +93,10 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
     cdata->client_id_size   = client_id_size;
     cdata->client_id_offset = memory_offset;
 
-    // Read the client ID
+    // Read the client ID, a string that isn't valid UTF-8 makes the packet malformed
     if (cdata->client_id_size > 0) {
-        if (buffer_read_binary(ptr, buf, cdata->client_id_size) != cdata->client_id_size)
-            return MQTT_DECODE_ERROR;
+        if (buffer_read_utf8(ptr, buf, cdata->client_id_size) != cdata->client_id_size)
+            return MQTT_DECODE_INVALID;
         ptr += cdata->client_id_size;
         memory_offset += cdata->client_id_size;
     }
@@ -119,7 +106,7 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
         if (cdata->mqtt_version == MQTT_V5) {
             usize will_properties_length = 0;
             int will_prop_bytes          = mqtt_variable_length_read(buf, &will_properties_length);
-            if (will_prop_bytes < 0) {
+            if (will_prop_bytes == 0) {
                 return MQTT_DECODE_ERROR;
             }
 
@@ -130,18 +117,18 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
         }
 
         // Topic
-        if (buffer_read_struct(buf, "H", &cdata->will_topic_size) != sizeof(uint16))
+        if (!connect_string_size_read(buf, &cdata->will_topic_size))
             return MQTT_DECODE_ERROR;
 
         cdata->will_topic_offset = memory_offset;
-        if (buffer_read_binary(ptr, buf, cdata->will_topic_size) != cdata->will_topic_size)
-            return MQTT_DECODE_ERROR;
+        if (buffer_read_utf8(ptr, buf, cdata->will_topic_size) != cdata->will_topic_size)
+            return MQTT_DECODE_INVALID;
 
         ptr += cdata->will_topic_size;
         memory_offset += cdata->will_topic_size;
 
         // Message
-        if (buffer_read_struct(buf, "H", &cdata->will_message_size) != sizeof(uint16))
+        if (!connect_string_size_read(buf, &cdata->will_message_size))
             return MQTT_DECODE_ERROR;
 
         cdata->will_message_offset = memory_offset;
@@ -154,12 +141,12 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
 
     // Read the username if username flag is set
     if (mqtt_username_get(cdata->connect_flags)) {
-        if (buffer_read_struct(buf, "H", &cdata->username_size) != sizeof(uint16))
+        if (!connect_string_size_read(buf, &cdata->username_size))
             return MQTT_DECODE_ERROR;
 
         cdata->username_offset = memory_offset;
-        if (buffer_read_binary(ptr, buf, cdata->username_size) != cdata->username_size)
-            return MQTT_DECODE_ERROR;
+        if (buffer_read_utf8(ptr, buf, cdata->username_size) != cdata->username_size)
+            return MQTT_DECODE_INVALID;
 
         ptr += cdata->username_size;
         memory_offset += cdata->username_size;
@@ -167,7 +154,7 @@ MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata)
 
     // Read the password if password flag is set
     if (mqtt_password_get(cdata->connect_flags)) {
-        if (buffer_read_struct(buf, "H", &cdata->password_size) != sizeof(uint16))
+        if (!connect_string_size_read(buf, &cdata->password_size))
             return MQTT_DECODE_ERROR;
 
         cdata->password_offset = memory_offset;
@@ -0,0 +1,106 @@
+#include "connection.h"
+#include "tera_internal.h"
+
+static inline uint32 fd_slot_home(int fd)
+{
+    // Fibonacci hashing, consecutive descriptors land far apart
+    return ((uint32)fd * 2654435761u) & (MAX_FD_SLOTS - 1);
+}
+
+static int32 fd_slot_find(const Tera_Context *ctx, int fd)
+{
+    uint32 mask = MAX_FD_SLOTS - 1;
+    uint32 slot = fd_slot_home(fd);
+
+    for (usize probes = 0; probes < MAX_FD_SLOTS; ++probes) {
+        if (ctx->fd_slots[slot].fd == -1)
+            return -1;
+        if (ctx->fd_slots[slot].fd == fd)
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+// Backward shift deletion, same as the exact subscriptions index
+static void fd_slot_delete(Tera_Context *ctx, uint32 slot)
+{
+    uint32 mask = MAX_FD_SLOTS - 1;
+    uint32 hole = slot;
+    uint32 next = (slot + 1) & mask;
+
+    while (ctx->fd_slots[next].fd != -1) {
+        uint32 home = fd_slot_home(ctx->fd_slots[next].fd);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            ctx->fd_slots[hole] = ctx->fd_slots[next];
+            hole                = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    ctx->fd_slots[hole].fd = -1;
+}
+
+void connection_table_init(Tera_Context *ctx)
+{
+    ctx->connection_count      = 0;
+    ctx->connection_generation = 0;
+
+    for (usize i = 0; i < MAX_CLIENTS; ++i) {
+        ctx->connection_ids[i]                = i;
+        ctx->connection_data[i].socket_fd     = -1;
+        ctx->connection_data[i].connected     = false;
+        ctx->connection_data[i].generation    = 0;
+        ctx->connection_data[i].live_position = i;
+    }
+
+    for (usize i = 0; i < MAX_FD_SLOTS; ++i)
+        ctx->fd_slots[i] = (Fd_Slot){.fd = -1, .conn_id = 0};
+}
+
+int32 connection_open(Tera_Context *ctx, int fd)
+{
+    if (ctx->connection_count == MAX_CLIENTS)
+        return -1;
+
+    // Twice as many entries as connections, there's always an empty one
+    uint32 mask = MAX_FD_SLOTS - 1;
+    uint32 slot = fd_slot_home(fd);
+    while (ctx->fd_slots[slot].fd != -1)
+        slot = (slot + 1) & mask;
+
+    uint16 conn_id      = ctx->connection_ids[ctx->connection_count++];
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+
+    cd->socket_fd       = fd;
+    cd->generation      = ++ctx->connection_generation;
+    ctx->fd_slots[slot] = (Fd_Slot){.fd = fd, .conn_id = conn_id};
+
+    return conn_id;
+}
+
+void connection_close(Tera_Context *ctx, uint16 conn_id)
+{
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+    int32 slot          = fd_slot_find(ctx, cd->socket_fd);
+
+    if (slot >= 0)
+        fd_slot_delete(ctx, slot);
+
+    // The last live slot takes the place of the closed one
+    uint16 last                                = ctx->connection_ids[--ctx->connection_count];
+    ctx->connection_ids[cd->live_position]     = last;
+    ctx->connection_data[last].live_position   = cd->live_position;
+    ctx->connection_ids[ctx->connection_count] = conn_id;
+    cd->live_position                          = ctx->connection_count;
+
+    cd->socket_fd                              = -1;
+    cd->connected                              = false;
+}
+
+int32 connection_lookup(const Tera_Context *ctx, int fd)
+{
+    int32 slot = fd_slot_find(ctx, fd);
+    return slot < 0 ? -1 : ctx->fd_slots[slot].conn_id;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.h"
+
+typedef struct tera_context Tera_Context;
+
+/*
+ * Connection slot map, connections are identified by a slot index into the
+ * Connection_Data and Client_Data arrays, independent from the socket
+ * descriptor:
+ *
+ *   connection_ids  [ 7 | 2 | 9 | 0 ][ 1 | 3 | 4 | ... ]
+ *                    live, packed     free slots
+ *
+ * The first connection_count entries are the live slots, opening a connection
+ * takes the first free one and closing it swaps its slot with the last live
+ * one, so both are O(1) and a sweep over the connections only visits the live
+ * ones. Each slot carries a generation, taken from a counter of the context on
+ * every reuse so that it never repeats even across slots, records holding a
+ * connection id along with its generation (deliveries, io_uring requests)
+ * detect a stale connection with a single compare.
+ *
+ * Events coming from the I/O multiplexers carry the descriptor, which is
+ * resolved to the slot through an open addressing table.
+ */
+typedef struct fd_slot {
+    int32 fd; // -1 if the entry is empty
+    uint16 conn_id;
+} Fd_Slot;
+
+void connection_table_init(Tera_Context *ctx);
+
+// Take a free slot for a new socket, returns its id or -1 if all are in use
+int32 connection_open(Tera_Context *ctx, int fd);
+void connection_close(Tera_Context *ctx, uint16 conn_id);
+
+// Returns the id of the connection on a descriptor, -1 if there's none
+int32 connection_lookup(const Tera_Context *ctx, int fd);
@@ -38,8 +38,11 @@ int iomux_add(IO_Mux *mux, int fd, IO_Mux_Event events)
         filter |= EVFILT_READ;
     if (events & IOMUX_WRITE)
         filter |= EVFILT_WRITE;
+    unsigned short flags = EV_ADD;
+    if (events & IOMUX_EDGE)
+        flags |= EV_CLEAR;
     struct kevent ev;
-    EV_SET(&ev, fd, filter, EV_ADD, 0, 0, NULL);
+    EV_SET(&ev, fd, filter, flags, 0, 0, NULL);
     return kevent(mux->kq, &ev, 1, NULL, 0, NULL);
 }
 
@@ -50,6 +53,21 @@ int iomux_del(IO_Mux *mux, int fd)
     return kevent(mux->kq, &ev, 1, NULL, 0, NULL);
 }
 
+int iomux_mod(IO_Mux *mux, int fd, IO_Mux_Event events)
+{
+    // Read and write are separate filters, adding a disabled one works
+    // whether it's already registered or not
+    unsigned short flags = EV_ADD;
+    if (events & IOMUX_EDGE)
+        flags |= EV_CLEAR;
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, flags | (events & IOMUX_READ ? EV_ENABLE : EV_DISABLE), 0,
+           0, NULL);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, flags | (events & IOMUX_WRITE ? EV_ENABLE : EV_DISABLE), 0,
+           0, NULL);
+    return kevent(mux->kq, ev, 2, NULL, 0, NULL);
+}
+
 int iomux_wait(IO_Mux *mux, time_t timeout_ms)
 {
     struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
@@ -70,19 +88,111 @@ IO_Mux_Event iomux_get_event_flags(IO_Mux *mux, int index)
     return mask;
 }
 
+#elif defined(__linux__)
+
+#include <sys/epoll.h>
+
+#define NUM_EVENTS 1024
+
+/*
+ * epoll backend, the kernel keeps the interest list so there's no per-wait
+ * rebuild and no FD_SETSIZE cap on the number of registered descriptors.
+ * iomux_wait returns only the ready fds, each one carried in its own
+ * epoll_event slot.
+ */
+struct iomux {
+    int epfd;
+    struct epoll_event events[NUM_EVENTS];
+    int nevents;
+};
+
+static uint32_t epoll_mask(IO_Mux_Event events)
+{
+    uint32_t mask = 0;
+    if (events & IOMUX_READ)
+        mask |= EPOLLIN;
+    if (events & IOMUX_WRITE)
+        mask |= EPOLLOUT;
+    if (events & IOMUX_EDGE)
+        mask |= EPOLLET;
+    return mask;
+}
+
+IO_Mux *iomux_create(void)
+{
+    IO_Mux *mux = malloc(sizeof(IO_Mux));
+    if (!mux)
+        return NULL;
+    mux->epfd    = epoll_create1(EPOLL_CLOEXEC);
+    mux->nevents = 0;
+    return mux->epfd >= 0 ? mux : (free(mux), NULL);
+}
+
+void iomux_free(IO_Mux *mux)
+{
+    close(mux->epfd);
+    free(mux);
+}
+
+int iomux_add(IO_Mux *mux, int fd, IO_Mux_Event events)
+{
+    struct epoll_event ev = {.events = epoll_mask(events), .data.fd = fd};
+    return epoll_ctl(mux->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int iomux_del(IO_Mux *mux, int fd) { return epoll_ctl(mux->epfd, EPOLL_CTL_DEL, fd, NULL); }
+
+int iomux_mod(IO_Mux *mux, int fd, IO_Mux_Event events)
+{
+    struct epoll_event ev = {.events = epoll_mask(events), .data.fd = fd};
+    return epoll_ctl(mux->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int iomux_wait(IO_Mux *mux, time_t timeout_ms)
+{
+    int timeout  = timeout_ms >= 0 ? (int)timeout_ms : -1;
+    mux->nevents = epoll_wait(mux->epfd, mux->events, NUM_EVENTS, timeout);
+    return mux->nevents;
+}
+
+int iomux_get_event_fd(IO_Mux *mux, int index) { return mux->events[index].data.fd; }
+
+IO_Mux_Event iomux_get_event_flags(IO_Mux *mux, int index)
+{
+    IO_Mux_Event mask = 0;
+    uint32_t events   = mux->events[index].events;
+    // Errors and hang-ups are reported as readable, the following read will
+    // surface the actual condition (EOF or errno) to the caller
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        mask |= IOMUX_READ;
+    if (events & EPOLLOUT)
+        mask |= IOMUX_WRITE;
+    return mask;
+}
+
 #else
 
 #include <string.h>
 #include <sys/select.h>
 
-#define NUM_EVENTS 1024
+#define NUM_EVENTS FD_SETSIZE
 
+/*
+ * Portable fallback, level-triggered only (IOMUX_EDGE is ignored) and capped
+ * at FD_SETSIZE descriptors. The master sets are kept up to date by add/del,
+ * iomux_wait works on copies and collects the ready fds into a dense array
+ * so that event indexes map to descriptors that are actually ready.
+ */
 struct iomux {
     fd_set readfds;
     fd_set writefds;
+    fd_set ready_readfds;
+    fd_set ready_writefds;
     int maxfd;
     int fds[NUM_EVENTS];
     int nfds;
+    int ready[NUM_EVENTS];
+    int nready;
 };
 
 IO_Mux *iomux_create(void)
@@ -92,8 +202,11 @@ IO_Mux *iomux_create(void)
         return NULL;
     FD_ZERO(&mux->readfds);
     FD_ZERO(&mux->writefds);
-    mux->maxfd = -1;
-    mux->nfds  = 0;
+    FD_ZERO(&mux->ready_readfds);
+    FD_ZERO(&mux->ready_writefds);
+    mux->maxfd  = -1;
+    mux->nfds   = 0;
+    mux->nready = 0;
     for (int i = 0; i < NUM_EVENTS; ++i)
         mux->fds[i] = -1;
     return mux;
@@ -103,7 +216,7 @@ void iomux_free(IO_Mux *mux) { free(mux); }
 
 int iomux_add(IO_Mux *mux, int fd, IO_Mux_Event events)
 {
-    if (mux->nfds >= NUM_EVENTS)
+    if (mux->nfds >= NUM_EVENTS || fd >= FD_SETSIZE)
         return -1;
     if (events & IOMUX_READ)
         FD_SET(fd, &mux->readfds);
@@ -132,32 +245,51 @@ int iomux_del(IO_Mux *mux, int fd)
     return 0;
 }
 
-int iomux_wait(IO_Mux *mux, time_t timeout_ms)
+int iomux_mod(IO_Mux *mux, int fd, IO_Mux_Event events)
 {
-    FD_ZERO(&mux->readfds);
-    for (int i = 0; i < mux->nfds; ++i) {
-        if (mux->fds[i] == -1)
-            continue;
-        FD_SET(mux->fds[i], &mux->readfds);
-    }
-    struct timeval tv = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-    fd_set rfds       = mux->readfds;
-    fd_set wfds       = mux->writefds;
-    return select(mux->maxfd + 1, &rfds, &wfds, NULL, timeout_ms >= 0 ? &tv : NULL);
+    if (fd >= FD_SETSIZE)
+        return -1;
+    if (events & IOMUX_READ)
+        FD_SET(fd, &mux->readfds);
+    else
+        FD_CLR(fd, &mux->readfds);
+    if (events & IOMUX_WRITE)
+        FD_SET(fd, &mux->writefds);
+    else
+        FD_CLR(fd, &mux->writefds);
+    return 0;
 }
 
-int iomux_get_event_fd(IO_Mux *mux, int index)
+int iomux_wait(IO_Mux *mux, time_t timeout_ms)
 {
-    return mux->fds[index]; // Simplified handling
+    struct timeval tv   = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
+    mux->ready_readfds  = mux->readfds;
+    mux->ready_writefds = mux->writefds;
+    mux->nready         = 0;
+
+    int n = select(mux->maxfd + 1, &mux->ready_readfds, &mux->ready_writefds, NULL,
+                   timeout_ms >= 0 ? &tv : NULL);
+    if (n <= 0)
+        return n;
+
+    for (int i = 0; i < mux->nfds && mux->nready < n; ++i) {
+        int fd = mux->fds[i];
+        if (FD_ISSET(fd, &mux->ready_readfds) || FD_ISSET(fd, &mux->ready_writefds))
+            mux->ready[mux->nready++] = fd;
+    }
+
+    return mux->nready;
 }
 
+int iomux_get_event_fd(IO_Mux *mux, int index) { return mux->ready[index]; }
+
 IO_Mux_Event iomux_get_event_flags(IO_Mux *mux, int index)
 {
     int fd            = iomux_get_event_fd(mux, index);
     IO_Mux_Event mask = 0;
-    if (FD_ISSET(fd, &mux->readfds))
+    if (FD_ISSET(fd, &mux->ready_readfds))
         mask |= IOMUX_READ;
-    if (FD_ISSET(fd, &mux->writefds))
+    if (FD_ISSET(fd, &mux->ready_writefds))
         mask |= IOMUX_WRITE;
     return mask;
 }
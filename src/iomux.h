@@ -5,6 +5,7 @@ typedef struct iomux IO_Mux;
 typedef enum iomux_event {
     IOMUX_READ  = 1 << 0, // 0x01
     IOMUX_WRITE = 1 << 1, // 0x02
+    IOMUX_EDGE  = 1 << 2, // 0x04 edge-triggered, the caller must drain until EAGAIN
 } IO_Mux_Event;
 
 IO_Mux *iomux_create(void);
@@ -12,6 +13,8 @@ void iomux_free(IO_Mux *mux);
 
 int iomux_add(IO_Mux *mux, int fd, IO_Mux_Event events);
 int iomux_del(IO_Mux *mux, int fd);
+// Replace the events of an already registered descriptor
+int iomux_mod(IO_Mux *mux, int fd, IO_Mux_Event events);
 int iomux_wait(IO_Mux *mux, time_t timeout_ms);
 
 int iomux_get_event_fd(IO_Mux *mux, int index);
@@ -2,79 +2,40 @@
 #include "tera_internal.h"
 #include <string.h>
 
-static int mqtt_read_variable_byte_integer(Buffer *buf, uint32 *value)
+MQTT_Decode_Result mqtt_frame_next(Buffer *buf, MQTT_Frame *frame)
 {
-    uint8_t byte;
-    uint32_t result     = 0;
-    uint32_t multiplier = 1;
-    int bytes_read      = 0;
-
-    *value              = 0;
-
-    do {
-        // Check buffer bounds
-        if (buf->read_pos >= buf->size) {
-            return -1;
-        }
-
-        // Check MQTT specification limit (max 4 bytes)
-        if (bytes_read >= 4) {
-            return -1;
-        }
-
-        byte = buf->data[buf->read_pos];
-        buf->read_pos++;
-        bytes_read++;
-
-        result += (byte & 0x7F) * multiplier;
-
-        // Check for overflow before next iteration
-        if (multiplier > (UINT32_MAX / 128)) {
-            return -1;
-        }
-
-        multiplier *= 128;
-
-    } while ((byte & 0x80) != 0);
-
-    // Validate minimum encoding (optional but recommended)
-    // This ensures the value couldn't be encoded in fewer bytes
-    if (bytes_read > 1) {
-        uint32_t min_value_for_bytes = 1;
-        for (int i = 1; i < bytes_read; i++) {
-            min_value_for_bytes *= 128;
-        }
-        if (result < min_value_for_bytes) {
-            return -1; // Not minimum encoding
-        }
-    }
-
-    *value = result;
-    return bytes_read;
-}
-
-/*
- *
- * Decode Remaining Length comprised of Variable Header and Payload if
- * present. It does not take into account the bytes for storing length.
- *
- * - Maximum of 4 bytes length
- * - Each byte encodes 7 bits of data + 1 continuation bit
- * - Maximum value is 268 435 455
- * - Uses the minimum amount of bytes necessary to represent
- */
-isize mqtt_variable_length_read(Buffer *buf, usize *len)
-{
-    uint32_t value;
-    int result = mqtt_read_variable_byte_integer(buf, &value);
-
-    if (result < 0) {
-        *len = 0;
-        return 0; // Error - could also return -1 to indicate error
-    }
-
-    *len = (usize)value;
-    return (isize)result;
+    const uint8 *data = buf->data + buf->read_pos;
+    uint32 available  = buffer_available(buf);
+    uint32 remaining  = 0;
+    int length_bytes  = 0;
+
+    frame->size       = 0;
+
+    if (available < sizeof(uint8) + 1)
+        return MQTT_DECODE_INCOMPLETE;
+
+    // The first byte is followed by 1 to 4 bytes of remaining length
+    length_bytes = mqtt_variable_length_decode(data + sizeof(uint8), available - sizeof(uint8),
+                                               &remaining);
+    if (length_bytes < 0)
+        return MQTT_DECODE_ERROR;
+    if (length_bytes == 0)
+        return MQTT_DECODE_INCOMPLETE;
+
+    frame->size = sizeof(uint8) + length_bytes + remaining;
+    if (frame->size > buf->size)
+        return MQTT_DECODE_OUT_OF_BOUNDS;
+    if (frame->size > available)
+        return MQTT_DECODE_INCOMPLETE;
+
+    frame->header.byte             = data[0];
+    frame->header.remaining_length = remaining;
+    buffer_init(&frame->payload, (uint8 *)data + sizeof(uint8) + length_bytes, remaining);
+    frame->payload.write_pos = remaining;
+
+    buf->read_pos += frame->size;
+
+    return MQTT_DECODE_SUCCESS;
 }
 
 /*
@@ -89,41 +50,35 @@ isize mqtt_variable_length_read(Buffer *buf, usize *len)
  */
 isize mqtt_variable_length_write(Buffer *buf, usize len)
 {
-    isize bytes    = 0;
-    uint16 encoded = 0;
-
-    do {
-        if ((buf->write_pos - buf->read_pos) + 1 > MAX_VARIABLE_LENGTH_BYTES)
-            return bytes;
+    // Most lengths fit a single byte, skip the sizing
+    if (len < 128)
+        return buffer_write_u8(buf, len) ? 1 : -1;
 
-        // Check buffer bounds
-        if (buf->write_pos >= buf->size) {
-            return -1;
-        }
+    if (len > MAX_VARIABLE_LENGTH)
+        return -1;
 
-        encoded = len % 128;
-        len /= 128;
+    uint8 *dst = buffer_reserve(buf, mqtt_variable_length_encoded_length(len));
+    if (!dst)
+        return -1;
 
-        /* if there are more digits to encode, set the top bit of this digit
-         */
-        if (len > 0)
-            encoded |= 128;
+    return mqtt_variable_length_store(dst, len);
+}
 
-        *(buf->data + buf->write_pos) = encoded;
-        buf->write_pos++;
-        bytes++;
-    } while (len > 0);
+static inline uint32 delivery_key(uint16 client_id, uint16 mid)
+{
+    return (uint32)client_id << 16 | mid;
+}
 
-    return bytes;
+// Fibonacci hashing, the top bits of the product spread sequential packet ids
+static inline uint32 delivery_home_slot(uint32 key)
+{
+    return (key * 2654435761U) >> (32 - __builtin_ctz(MAX_DELIVERY_SLOTS));
 }
 
-// Simplest key generation function to combine a client ID and message ID, providing a
-// reasanoble low collision chance.
-static inline uint32 make_key(uint16 client_id, uint16 mid)
+void mqtt_message_delivery_index_init(Tera_Context *ctx)
 {
-    uint32 hash_key = (client_id << 16) | mid;
-    uint32 index    = (hash_key * 2654435761U) >> 19;
-    return index;
+    for (usize i = 0; i < MAX_DELIVERY_SLOTS; ++i)
+        ctx->message_delivery_index[i] = (Delivery_Slot){.key = 0, .delivery = -1, .distance = 0};
 }
 
 Message_Delivery *mqtt_message_delivery_find_free(Tera_Context *ctx, uint16 *delivery_id)
@@ -143,16 +98,26 @@ Message_Delivery *mqtt_message_delivery_find_free(Tera_Context *ctx, uint16 *del
 Message_Delivery *mqtt_message_delivery_find_existing(Tera_Context *ctx, uint16 client_id,
                                                       uint16 mid)
 {
-    int16 key              = make_key(client_id, mid);
-    Delivery_Bucket bucket = ctx->message_delivery_lookup_table[key];
-    if (bucket.count == 0)
-        return NULL;
+    uint32 key  = delivery_key(client_id, mid);
+    uint32 mask = MAX_DELIVERY_SLOTS - 1;
+    uint32 slot = delivery_home_slot(key);
+
+    for (uint16 distance = 0; distance < MAX_DELIVERY_SLOTS; ++distance) {
+        const Delivery_Slot *entry = &ctx->message_delivery_index[slot];
 
-    for (int8 i = 0; i < bucket.count; ++i) {
-        Message_Delivery *delivery = &ctx->message_deliveries[bucket.indexes[i]];
+        // Past this point the key would have displaced the entries, it's not in the table
+        if (entry->delivery == -1 || entry->distance < distance)
+            return NULL;
 
-        if (delivery->client_id == client_id && delivery->message_id == mid)
-            return delivery;
+        if (entry->key == key) {
+            Message_Delivery *delivery = &ctx->message_deliveries[entry->delivery];
+
+            // Left behind by a previous connection on the same slot
+            if (delivery->client_generation == ctx->connection_data[client_id].generation)
+                return delivery;
+        }
+
+        slot = (slot + 1) & mask;
     }
 
     return NULL;
@@ -160,42 +125,71 @@ Message_Delivery *mqtt_message_delivery_find_existing(Tera_Context *ctx, uint16
 
 void mqtt_message_delivery_add(Tera_Context *ctx, uint16 client_id, uint16 mid, uint16 index)
 {
-    int16 key                        = make_key(client_id, mid);
-    Delivery_Bucket *bucket          = &ctx->message_delivery_lookup_table[key];
+    Delivery_Slot item = {.key = delivery_key(client_id, mid), .delivery = index, .distance = 0};
+    uint32 mask        = MAX_DELIVERY_SLOTS - 1;
+    uint32 slot        = delivery_home_slot(item.key);
+
+    // There are twice the slots as deliveries, an empty one is always found
+    for (;;) {
+        Delivery_Slot *entry = &ctx->message_delivery_index[slot];
+        if (entry->delivery == -1) {
+            *entry = item;
+            return;
+        }
+
+        // Take the slot from an entry closer to its home, it moves on in our place
+        if (entry->distance < item.distance) {
+            Delivery_Slot displaced = *entry;
+            *entry                  = item;
+            item                    = displaced;
+        }
 
-    bucket->indexes[bucket->count++] = index;
+        slot = (slot + 1) & mask;
+        item.distance++;
+    }
 }
 
-void mqtt_message_delivery_free(Tera_Context *ctx, uint16 client_id, uint16 mid)
+static void message_delivery_unindex(Tera_Context *ctx, const Message_Delivery *delivery,
+                                     uint16 delivery_id)
 {
-    int16 key               = make_key(client_id, mid);
-    Delivery_Bucket *bucket = &ctx->message_delivery_lookup_table[key];
-
-    int8 index              = 0;
-    for (int8 i = 0; i < bucket->count; ++i) {
-        Message_Delivery *target = &ctx->message_deliveries[bucket->indexes[i]];
-
-        if (target->client_id == client_id && target->message_id == mid) {
-            index = i;
+    uint32 key  = delivery_key(delivery->client_id, delivery->message_id);
+    uint32 mask = MAX_DELIVERY_SLOTS - 1;
+    uint32 slot = delivery_home_slot(key);
+
+    for (uint16 distance = 0;; ++distance) {
+        const Delivery_Slot *entry = &ctx->message_delivery_index[slot];
+        if (entry->delivery == -1 || entry->distance < distance)
+            return;
+        if (entry->delivery == delivery_id)
             break;
-        }
+        slot = (slot + 1) & mask;
+    }
+
+    // Shift back the entries that are not in their home slot, up to an empty one
+    uint32 next = (slot + 1) & mask;
+    while (ctx->message_delivery_index[next].delivery != -1 &&
+           ctx->message_delivery_index[next].distance > 0) {
+        ctx->message_delivery_index[slot] = ctx->message_delivery_index[next];
+        ctx->message_delivery_index[slot].distance--;
+        slot = next;
+        next = (next + 1) & mask;
     }
 
-    int16 delivery_id = bucket->indexes[index];
+    ctx->message_delivery_index[slot] = (Delivery_Slot){.key = 0, .delivery = -1, .distance = 0};
+}
 
-    if (index < bucket->count - 1)
-        memmove(bucket->indexes + index, bucket->indexes + index + 1,
-                sizeof(int16) * (bucket->count - index));
-    else
-        bucket->indexes[index] = -1;
+void mqtt_message_delivery_free(Tera_Context *ctx, uint16 delivery_id)
+{
+    Message_Delivery *delivery = &ctx->message_deliveries[delivery_id];
 
-    bucket->count--;
+    message_delivery_unindex(ctx, delivery, delivery_id);
 
-    ctx->message_deliveries[delivery_id].active    = false;
+    delivery->active = false;
+    timer_wheel_cancel(&ctx->timer_wheel, delivery_timer_id(delivery_id));
 
     // The released slot becomes the new head of the free list
-    ctx->message_deliveries[delivery_id].next_free = ctx->message_delivery_free_list_head;
-    ctx->message_delivery_free_list_head           = delivery_id;
+    delivery->next_free                  = ctx->message_delivery_free_list_head;
+    ctx->message_delivery_free_list_head = delivery_id;
 }
 
 Publish_Properties *mqtt_publish_properties_find_free(Tera_Context *ctx, int16 *property_id)
@@ -232,12 +226,19 @@ Published_Message *mqtt_published_message_find_free(Tera_Context *ctx, uint16 *p
     int16 index                            = ctx->published_free_list_head;
     ctx->published_free_list_head          = ctx->published_messages[index].next_free;
 
-    Data_Flags flags                       = data_flags_set(false, 0, false, true);
-    ctx->published_messages[index].options = flags.value;
+    Published_Message *message = &ctx->published_messages[index];
+    Data_Flags flags           = data_flags_set(false, 0, false, true);
+    message->options           = flags.value;
+    message->property_id       = MAX_PUBLISHED_MESSAGES;
+    message->references        = 1;
+    message->topic_offset      = -1;
+    message->message_offset    = -1;
+    for (usize i = 0; i < PUBLISH_FRAME_VARIANTS; ++i)
+        message->frame_offsets[i] = -1;
 
-    *published_id                          = index;
+    *published_id = index;
 
-    return &ctx->published_messages[index];
+    return message;
 }
 
 void mqtt_published_message_free(Tera_Context *ctx, uint16 published_id)
@@ -245,18 +246,22 @@ void mqtt_published_message_free(Tera_Context *ctx, uint16 published_id)
     if (published_id >= MAX_PUBLISHED_MESSAGES)
         return;
 
-    ctx->published_messages[published_id].deliveries--;
+    Published_Message *message = &ctx->published_messages[published_id];
+    if (--message->references > 0)
+        return;
+
+    message->options = data_flags_active_set(message->options, 0);
 
-    if (ctx->published_messages[published_id].deliveries == 0) {
-        ctx->published_messages[published_id].options =
-            data_flags_active_set(ctx->published_messages[published_id].options, 0);
+    mqtt_publish_properties_free(ctx, message->property_id);
 
-        mqtt_publish_properties_free(ctx, ctx->published_messages[published_id].property_id);
+    slab_free(ctx->message_slab, message->topic_offset);
+    slab_free(ctx->message_slab, message->message_offset);
+    for (usize i = 0; i < PUBLISH_FRAME_VARIANTS; ++i)
+        slab_free(ctx->message_slab, message->frame_offsets[i]);
 
-        // The released slot becomes the new head of the free list
-        ctx->published_messages[published_id].next_free = ctx->published_free_list_head;
-        ctx->published_free_list_head                   = published_id;
-    }
+    // The released slot becomes the new head of the free list
+    message->next_free            = ctx->published_free_list_head;
+    ctx->published_free_list_head = published_id;
 }
 
 void mqtt_message_dump(const Buffer *buf, bool read)
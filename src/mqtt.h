@@ -3,9 +3,11 @@
 #include "arena.h"
 #include "buffer.h"
 #include "logger.h"
+#include "topic_scan.h"
 #include "types.h"
 
 #define MAX_VARIABLE_LENGTH_BYTES 4
+#define MAX_VARIABLE_LENGTH       268435455
 
 typedef enum mqtt_version { MQTT_V311 = 0x04, MQTT_V5 = 0x05 } MQTT_Version;
 
@@ -116,6 +118,7 @@ static inline uint8 mqtt_type_set(uint8 byte, uint8 value)
 
 typedef struct client_data Client_Data;
 typedef struct tera_context Tera_Context;
+typedef struct shard_message Shard_Message;
 
 typedef enum topic_filter_type {
     TFT_WILDCARD_NONE,
@@ -123,20 +126,33 @@ typedef enum topic_filter_type {
     TFT_WILDCARD_HASH
 } Topic_Filter_Type;
 
+/*
+ * Subscriptions are split in two parallel arrays by how often the fields are
+ * read. Subscription_Data holds what the fanout and the index chains go
+ * through for each match, in 12 bytes, five to a cache line. Subscription_Filter
+ * holds the filter itself and where it's indexed, read only to subscribe,
+ * unsubscribe, disconnect and compare a filter. Slots in use are tracked apart,
+ * in the subscription bitmap of the context.
+ */
 typedef struct subscription_data {
-    // Subscription metadata
     uint16 client_id; // Index of the subscribing client in Client_Data array
-    uint16 topic_offset;
-    uint16 topic_size;
     uint16 mid;
     int16 id;
+    int16 trie_next;  // Next subscription on the same trie node
+    int16 exact_next; // Next subscription to the same exact filter
+    uint8 options;
+} Subscription_Data;
+
+typedef struct subscription_filter {
+    uint32 topic_offset; // TOPIC_FILTER_NONE until the filter is stored
+    uint32 topic_hash;   // Exact filters only, hash of the filter bytes
+    uint16 topic_size;
+    int16 trie_node;   // Topic trie node the filter ends on
+    int16 client_next; // Next subscription of the same client, see Client_Data
     // Wildcard handling info
     uint8 prefix_levels;
     Topic_Filter_Type type : 3;
-    // General management for reusability
-    uint8 options;
-    bool active;
-} Subscription_Data;
+} Subscription_Filter;
 
 // Message_Delivery flags for retransmission states
 typedef enum delivery_state {
@@ -151,14 +167,14 @@ typedef enum delivery_state {
 
 typedef struct message_delivery {
     // Retransmission fields
-    uint32 last_sent_at;  // Last transmission timestamp
-    uint32 next_retry_at; // When to retry (0 = don't retry)
+    uint32 last_sent_at; // Last transmission timestamp, the retry is armed in the timer wheel
 
     // Message metadata for topic, payload
-    uint16 client_id;        // Target client (subscriber)
-    uint16 published_msg_id; // Points to a Published_Message
-    uint16 message_id;       // MQTT packet ID for client
-    uint16 published_index;  // Published_Message index in memory
+    uint32 client_generation; // Connection generation of the client, see connection.h
+    uint16 client_id;         // Target client (subscriber)
+    uint16 published_msg_id;  // Points to a Published_Message
+    uint16 message_id;        // MQTT packet ID for client
+    uint16 published_index;   // Published_Message index in memory
     int16 next_free;
     uint8 retry_count;        // Number of retries attempted
     Delivery_State state : 4; // Current delivery state
@@ -166,21 +182,44 @@ typedef struct message_delivery {
     bool active : 1;          // Wether the delivery is free to be used
 } Message_Delivery;
 
+void mqtt_message_delivery_index_init(Tera_Context *ctx);
 Message_Delivery *mqtt_message_delivery_find_free(Tera_Context *ctx, uint16 *delivery_id);
 Message_Delivery *mqtt_message_delivery_find_existing(Tera_Context *ctx, uint16 client_id,
                                                       uint16 mid);
 void mqtt_message_delivery_add(Tera_Context *ctx, uint16 client_id, uint16 mid, uint16 index);
-void mqtt_message_delivery_free(Tera_Context *ctx, uint16 client_id, uint16 mid);
+void mqtt_message_delivery_free(Tera_Context *ctx, uint16 delivery_id);
+
+/*
+ * A PUBLISH is serialized once for each (QoS, MQTT version) pair it is
+ * delivered with, all the subscribers sharing the same pair get a copy of the
+ * same frame with only the packet identifier patched in.
+ */
+#define PUBLISH_FRAME_VARIANTS 6
+
+typedef struct publish_frame {
+    uint16 size;
+    uint16 packet_id_offset; // 0 for QoS 0 frames, there's no packet identifier
+    uint8 data[];
+} Publish_Frame;
+
+static inline uint8 publish_frame_variant(uint8 qos, MQTT_Version version)
+{
+    return qos * 2 + (version == MQTT_V5);
+}
 
 typedef struct published_message {
-    // Message metadata for topic, payload
+    // Message metadata for topic, payload, offsets in the message slab, -1 if
+    // not allocated
+    int32 topic_offset;
+    int32 message_offset;
+    // Encoded frames in the message slab, indexed by publish_frame_variant, -1 if not
+    // encoded yet. They live as long as the message itself.
+    int32 frame_offsets[PUBLISH_FRAME_VARIANTS];
     uint16 id;
-    uint16 property_id;
+    uint16 property_id; // MAX_PUBLISHED_MESSAGES if the message has no properties
     uint16 topic_size;
-    uint16 topic_offset;
     uint16 message_size;
-    uint16 message_offset;
-    uint16 deliveries; // How many acrtive deliveries
+    uint16 references; // Active deliveries, frames queued to clients and the fanout in progress
     int16 next_free;   // Next free published message pointer
     uint8 options;
 } Published_Message;
@@ -188,19 +227,21 @@ typedef struct published_message {
 /**
  * When a PUBLISH message is received, we first need to find a metadata
  * slot in the published messages table, then we can proceed at decoding
- * it from the raw binary payload.
+ * it from the raw binary payload. The caller holds the first reference.
  */
 Published_Message *mqtt_published_message_find_free(Tera_Context *ctx, uint16 *published_id);
 
 /**
- * Once a published message have concluded its lifecycle, e.g.
+ * Drop a reference to a published message, once it has concluded its
+ * lifecycle, e.g.
  * - A PUBLISH message that must be acknowledged by the publisher
  * - A PUBLISH message that must be akcnowledged by 1 or more subscribers,
  *   depending on the QoS level
+ * - Every frame referencing it has been written out to the clients
  *
  * It's memory slot for metadata will be free to be re-used by another
- * incoming message. This function sets the message slot as free using
- * the message ID to find the position in the array.
+ * incoming message, its topic, payload and frames are given back to the
+ * message slab.
  */
 void mqtt_published_message_free(Tera_Context *ctx, uint16 published_id);
 
@@ -224,6 +265,96 @@ static inline usize mqtt_variable_length_encoded_length(usize value)
     return 4;
 }
 
+/*
+ * Variable byte integer codec, shared by the remaining length of the fixed
+ * header, the properties length and the subscription identifiers.
+ *
+ * Each byte carries 7 bits of the value, least significant first, and the
+ * continuation flag in its top bit, up to 4 bytes and 268 435 455. Encodings
+ * must be minimal, i.e. a multi byte one can't end with a zero byte.
+ *
+ * Decodes the integer at src, given the bytes available there. Returns the
+ * bytes it takes, 0 if more are needed to tell, -1 if it's malformed.
+ *
+ * One and two bytes values, nearly all of the real traffic, take a fast path,
+ * longer ones are decoded at once from a 4 bytes word after a single bounds
+ * check: the first clear top bit marks the end, the 7 bits groups are then
+ * squeezed together with shifts and masks, no loop and no branch per byte.
+ */
+static inline int mqtt_variable_length_decode(const uint8 *src, uint32 available, uint32 *value)
+{
+    if (available > 0 && !(src[0] & 0x80)) {
+        *value = src[0];
+        return 1;
+    }
+
+    if (available > 1 && !(src[1] & 0x80)) {
+        if (src[1] == 0)
+            return -1;
+        *value = (src[0] & 0x7F) | (uint32)src[1] << 7;
+        return 2;
+    }
+
+    // Close to the end of the bytes received, too few for the word
+    if (available < MAX_VARIABLE_LENGTH_BYTES) {
+        uint32 result = 0;
+        for (uint32 i = 0; i < available; ++i) {
+            result |= (uint32)(src[i] & 0x7F) << (7 * i);
+            if (!(src[i] & 0x80)) {
+                if (src[i] == 0)
+                    return -1;
+                *value = result;
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+
+    uint32 word =
+        (uint32)src[0] | (uint32)src[1] << 8 | (uint32)src[2] << 16 | (uint32)src[3] << 24;
+    uint32 ends = ~word & 0x80808080;
+    if (ends == 0)
+        return -1;
+
+    int length = (__builtin_ctz(ends) >> 3) + 1;
+    if (length < MAX_VARIABLE_LENGTH_BYTES)
+        word &= (1u << (length * 8)) - 1;
+
+    // The last byte being zero means a shorter encoding was possible
+    if ((word >> ((length - 1) * 8)) == 0)
+        return -1;
+
+    *value = (word & 0x7F) | (word >> 1 & 0x3F80) | (word >> 2 & 0x1FC000) |
+             (word >> 3 & 0xFE00000);
+    return length;
+}
+
+/*
+ * Store value at dst with no bounds check, the room for it must have been
+ * reserved with mqtt_variable_length_encoded_length. Returns the bytes taken.
+ */
+static inline uint32 mqtt_variable_length_store(uint8 *dst, uint32 value)
+{
+    if (value < 128) {
+        dst[0] = value;
+        return 1;
+    }
+
+    if (value < 16384) {
+        dst[0] = value | 0x80;
+        dst[1] = value >> 7;
+        return 2;
+    }
+
+    uint32 length = 0;
+    do {
+        dst[length++] = (value & 0x7F) | (value >= 128 ? 0x80 : 0);
+        value >>= 7;
+    } while (value > 0);
+
+    return length;
+}
+
 /*
  *
  * Decode Remaining Length comprised of Variable Header and Payload if
@@ -233,8 +364,40 @@ static inline usize mqtt_variable_length_encoded_length(usize value)
  * - Each byte encodes 7 bits of data + 1 continuation bit
  * - Maximum value is 268 435 455
  * - Uses the minimum amount of bytes necessary to represent
+ *
+ * Returns the number of bytes read, 0 if truncated or malformed.
+ *
+ * Inline so the one and two bytes checks, most of the lengths on the wire,
+ * land in the caller with no call made, the rest go through the decoder.
  */
-isize mqtt_variable_length_read(Buffer *buf, usize *len);
+static inline isize mqtt_variable_length_read(Buffer *buf, usize *len)
+{
+    const uint8 *src = buf->data + buf->read_pos;
+    usize available  = buf->size - buf->read_pos;
+
+    if (available > 0 && !(src[0] & 0x80)) {
+        buf->read_pos += 1;
+        *len = src[0];
+        return 1;
+    }
+
+    if (available > 1 && !(src[1] & 0x80) && src[1] != 0) {
+        buf->read_pos += 2;
+        *len = (src[0] & 0x7F) | (usize)src[1] << 7;
+        return 2;
+    }
+
+    uint32 value = 0;
+    int result   = mqtt_variable_length_decode(src, available, &value);
+    if (result <= 0) {
+        *len = 0;
+        return 0;
+    }
+
+    buf->read_pos += result;
+    *len = value;
+    return result;
+}
 
 /*
  * Encoding packet length function, follows the OASIS specs, encode the total
@@ -244,7 +407,8 @@ isize mqtt_variable_length_read(Buffer *buf, usize *len);
  * Using the first 7 bits of a byte we can store values till 127 and use the
  * last bit as a switch to notify if the subsequent byte is used to store
  * remaining length or not.
- * Returns the number of bytes used to store the value passed.
+ * Returns the number of bytes used to store the value passed, -1 if it's too
+ * big or doesn't fit in the buffer.
  */
 isize mqtt_variable_length_write(Buffer *buf, usize len);
 
@@ -281,46 +445,36 @@ typedef struct fixed_header {
     usize remaining_length;
 } Fixed_Header;
 
-// TODO consider returning the amount of read bytes
-static inline isize mqtt_fixed_header_read(Buffer *buf, Fixed_Header *header)
-{
-    isize read_bytes = 0;
-    usize start_pos  = buf->read_pos;
-
-    // Read packet type and flags
-    if (buffer_read_struct(buf, "B", &header->byte) != sizeof(uint8)) {
-        log_error(">>>>: Failed to read packet header");
-        return MQTT_DECODE_INCOMPLETE;
-    }
-    read_bytes       = sizeof(uint8);
-
-    // Read remaining length
-    int length_bytes = mqtt_variable_length_read(buf, &header->remaining_length);
-    if (length_bytes < 0) {
-        log_error(">>>>: Invalid variable length encoding");
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
-    read_bytes += length_bytes;
-
-    // Validate we have enough data for the complete packet
-    usize total_packet_size =
-        sizeof(uint8) + length_bytes + header->remaining_length; // header + length + payload
-    if (start_pos + total_packet_size > buf->size) {
-        log_debug(">>>>: Fixed header - incomplete packet, need %zu more bytes",
-                  (start_pos + total_packet_size) - buf->size);
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
+/*
+ * A complete control packet sitting in a receive buffer. The payload is a
+ * view over its variable header and payload, exactly remaining_length bytes
+ * long, so decoders never look past the packet nor re-parse the fixed header.
+ */
+typedef struct mqtt_frame {
+    Fixed_Header header;
+    uint32 size; // Whole packet, fixed header included, 0 until the remaining length is in
+    Buffer payload;
+} MQTT_Frame;
 
-    return read_bytes;
-}
+/*
+ * Framing layer, extract the next packet from the unread bytes of a receive
+ * buffer, moving its read position past it. Returns:
+ *
+ * - MQTT_DECODE_INCOMPLETE if it's not fully received yet, nothing is consumed
+ * - MQTT_DECODE_ERROR if the remaining length is malformed
+ * - MQTT_DECODE_OUT_OF_BOUNDS if it can never fit in the buffer
+ *
+ * Several pipelined packets are extracted one after the other out of a single
+ * read, a packet split across reads is picked up again from its first byte
+ * once the rest is in.
+ */
+MQTT_Decode_Result mqtt_frame_next(Buffer *buf, MQTT_Frame *frame);
 
 static inline isize mqtt_fixed_header_write(Buffer *buf, Fixed_Header *header)
 {
     isize written_bytes = 0;
 
-    if (buffer_write_struct(buf, "B", header->byte) != sizeof(uint8)) {
+    if (buffer_write_u8(buf, header->byte) != sizeof(uint8)) {
         log_error(">>>>: Fixed Header - failed to write packet header");
         return MQTT_DECODE_ERROR;
     }
@@ -331,6 +485,61 @@ static inline isize mqtt_fixed_header_write(Buffer *buf, Fixed_Header *header)
     return written_bytes;
 }
 
+/*
+ * Packets with a fixed layout, small enough for a single byte of remaining
+ * length. Their encoders are generated from the list of fields, the size of
+ * the frame is a compile time constant, the room for it is checked once and
+ * the fields are then stored with no further checks:
+ *
+ *   X(name, first byte of the fixed header, fields)
+ *
+ * generates mqtt_<name>_size() and mqtt_<name>_encode(buf, fields...), the
+ * latter returns the bytes written, 0 if the frame doesn't fit.
+ */
+#define MQTT_NO_FIELDS(F)
+#define MQTT_ACK_FIELDS(F)        F(u16, packet_id)
+#define MQTT_CONNACK_FIELDS(F)    F(u8, flags) F(u8, reason_code)
+#define MQTT_CONNACK_V5_FIELDS(F) F(u8, flags) F(u8, reason_code) F(u8, properties_length)
+
+#define MQTT_FIXED_PACKETS(X)                                                                      \
+    X(puback, 0x40, MQTT_ACK_FIELDS)                                                               \
+    X(pubrec, 0x50, MQTT_ACK_FIELDS)                                                               \
+    X(pubrel, 0x62, MQTT_ACK_FIELDS)                                                               \
+    X(pubcomp, 0x70, MQTT_ACK_FIELDS)                                                              \
+    X(pingresp, 0xD0, MQTT_NO_FIELDS)                                                              \
+    X(connack, 0x20, MQTT_CONNACK_FIELDS)                                                          \
+    X(connack_v5, 0x20, MQTT_CONNACK_V5_FIELDS)
+
+#define MQTT_FIELD_TYPE_u8  uint8
+#define MQTT_FIELD_TYPE_u16 uint16
+#define MQTT_FIELD_TYPE_u32 uint32
+
+#define MQTT_FIELD_PARAM(codec, name) , MQTT_FIELD_TYPE_##codec name
+#define MQTT_FIELD_SIZE(codec, name)  +sizeof(MQTT_FIELD_TYPE_##codec)
+#define MQTT_FIELD_STORE(codec, name) dst += buffer_store_##codec(dst, name);
+
+#define MQTT_FIXED_PACKET_ENCODER(name, first_byte, FIELDS)                                        \
+    static inline uint32 mqtt_##name##_size(void)                                                  \
+    {                                                                                              \
+        return sizeof(uint8) * 2 FIELDS(MQTT_FIELD_SIZE);                                          \
+    }                                                                                              \
+                                                                                                   \
+    static inline uint32 mqtt_##name##_encode(Buffer *buf FIELDS(MQTT_FIELD_PARAM))                \
+    {                                                                                              \
+        _Static_assert(0 FIELDS(MQTT_FIELD_SIZE) < 128, "single byte remaining length");           \
+                                                                                                   \
+        uint8 *dst = buffer_reserve(buf, mqtt_##name##_size());                                    \
+        if (!dst)                                                                                  \
+            return 0;                                                                              \
+                                                                                                   \
+        dst += buffer_store_u8(dst, first_byte);                                                   \
+        dst += buffer_store_u8(dst, 0 FIELDS(MQTT_FIELD_SIZE));                                    \
+        FIELDS(MQTT_FIELD_STORE)                                                                   \
+        return mqtt_##name##_size();                                                               \
+    }
+
+MQTT_FIXED_PACKETS(MQTT_FIXED_PACKET_ENCODER)
+
 /*
  * MQTT Connect packet unpack function, it's the first mandatory packet that
  * a new client must send after the socket connection went ok. As described in
@@ -389,9 +598,10 @@ static inline isize mqtt_fixed_header_write(Buffer *buf, Fixed_Header *header)
  * unpack from the Variable Header position to the end of the packet as stated
  * by the total length expected.
  */
-MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata);
+MQTT_Decode_Result mqtt_connect_read(Tera_Context *ctx, Client_Data *cdata, MQTT_Frame *frame);
 
-MQTT_Decode_Result mqtt_disconnect_read(Tera_Context *ctx, const Client_Data *cdata);
+MQTT_Decode_Result mqtt_disconnect_read(Tera_Context *ctx, const Client_Data *cdata,
+                                        MQTT_Frame *frame);
 
 // Debugging utilities
 void mqtt_message_dump(const Buffer *buf, bool read);
@@ -509,9 +719,14 @@ void mqtt_publish_properties_free(Tera_Context *ctx, int16 property_id);
  * The functions accepts a pointer to a Published_Message, this is pointing to
  * a position in the published messages table, not in use by any previous message,
  * to be properly filled in with the metadata of the incoming PUBLISH.
+ *
+ * The topic name is scanned once here, its levels are handed over to the fanout
+ * and shared by all the filter comparisons. A topic name with wildcards is
+ * rejected with MQTT_DECODE_INVALID.
  */
 MQTT_Decode_Result mqtt_publish_read(Tera_Context *ctx, const Client_Data *cdata,
-                                     Published_Message *message);
+                                     MQTT_Frame *frame, Published_Message *message,
+                                     Topic_Levels *levels);
 
 // Maximum topic filters per SUBSCRIBE packet (reasonable limit)
 #define MAX_TOPIC_FILTERS_PER_SUBSCRIBE 50
@@ -525,14 +740,16 @@ typedef struct {
 } Subscribe_Result;
 
 MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cdata,
-                                       Subscribe_Result *r);
+                                       MQTT_Frame *frame, Subscribe_Result *r);
 
 MQTT_Decode_Result mqtt_unsubscribe_read(Tera_Context *ctx, const Client_Data *cdata,
-                                         Subscribe_Result *r);
+                                         MQTT_Frame *frame, Subscribe_Result *r);
 
-MQTT_Decode_Result mqtt_pingreq_read(Tera_Context *ctx, const Client_Data *cdata);
+MQTT_Decode_Result mqtt_pingreq_read(Tera_Context *ctx, const Client_Data *cdata,
+                                     MQTT_Frame *frame);
 
-MQTT_Decode_Result mqtt_ack_read(Tera_Context *ctx, const Client_Data *cdata, uint16 *mid);
+MQTT_Decode_Result mqtt_ack_read(Tera_Context *ctx, const Client_Data *cdata, MQTT_Frame *frame,
+                                 uint16 *mid);
 
 /**
  * MQTT 5.0 CONNACK Reason Codes
@@ -563,6 +780,14 @@ typedef enum {
 
 void mqtt_suback_write(Tera_Context *ctx, const Client_Data *cdata, const Subscribe_Result *r);
 
+typedef enum {
+    UNSUBACK_SUCCESS                 = 0x00,
+    UNSUBACK_NO_SUBSCRIPTION_EXISTED = 0x11,
+    UNSUBACK_UNSPECIFIED_ERROR       = 0x80,
+    UNSUBACK_TOPIC_FILTER_INVALID    = 0x8F
+} UNSUBACK_Reason_Code;
+
+// Reason codes are only sent to MQTT 5 clients, a 3.1.1 UNSUBACK is the packet id alone
 void mqtt_unsuback_write(Tera_Context *ctx, const Client_Data *cdata, const Subscribe_Result *r);
 
 /**
@@ -573,7 +798,15 @@ void mqtt_unsuback_write(Tera_Context *ctx, const Client_Data *cdata, const Subs
  * to be properly filled in with the metadata of the incoming PUBLISH.
  */
 void mqtt_publish_fanout_write(Tera_Context *ctx, const Client_Data *cdata,
-                               Published_Message *pub_msg, uint16 index);
+                               Published_Message *pub_msg, uint16 index,
+                               const Topic_Levels *levels);
+
+/**
+ * Counterpart of mqtt_publish_fanout_write for a PUBLISH forwarded by another
+ * shard, the message is copied in the local tables and delivered to the
+ * matching subscriptions of this shard only.
+ */
+void mqtt_publish_fanout_shard(Tera_Context *ctx, const Shard_Message *msg);
 
 /**
  * This function is meant to be used when a retry is attempted, so it assumes
@@ -587,3 +820,21 @@ void mqtt_pingresp_write(Tera_Context *ctx, const Client_Data *cdata);
 void mqtt_ack_write(Tera_Context *ctx, const Client_Data *cdata, Packet_Type ack_type, uint16 id);
 
 uint16 mqtt_subscription_next_mid(Subscription_Data *subscription_data);
+
+/*
+ * Release a subscription slot, unlinking it from the topic index
+ */
+void mqtt_subscription_free(Tera_Context *ctx, uint16 subscription_index);
+
+/*
+ * Release the subscriptions of a client to a filter, found through the list
+ * of its own subscriptions. Returns how many there were.
+ */
+usize mqtt_subscription_remove(Tera_Context *ctx, uint16 client_id, const char *filter,
+                               uint16 filter_size);
+
+/*
+ * Wildcards alone in their level and '#' only as the last one, on the levels
+ * found by topic_scan
+ */
+bool topic_filter_is_valid(const char *filter, usize filter_size, const Topic_Levels *levels);
@@ -33,8 +33,12 @@ int net_tcp_accept(int server_fd, int nonblocking)
     socklen_t addrlen = sizeof(addr);
 
     fd                = accept(server_fd, (struct sockaddr *)&addr, &addrlen);
-    if (fd <= 0)
+    if (fd < 0) {
+        // Backlog drained, not an error for a non-blocking listener
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -1;
         goto err;
+    }
 
     if (nonblocking && set_nonblocking(fd) < 0)
         goto err;
@@ -46,7 +50,7 @@ err:
     return -1;
 }
 
-int net_tcp_listen(const char *host, int port, int nonblocking)
+int net_tcp_listen(const char *host, int port, int nonblocking, int reuseport)
 {
     int listen_fd               = -1;
     const struct addrinfo hints = {
@@ -67,6 +71,12 @@ int net_tcp_listen(const char *host, int port, int nonblocking)
         if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int)) < 0)
             return -1;
 
+        // Multiple listeners on the same address, the kernel balances the
+        // incoming connections across them
+        if (reuseport &&
+            setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &(int){1}, sizeof(int)) < 0)
+            return -1;
+
         /* Bind it to the addr:port opened on the network interface */
         if (bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0)
             break; // successful bind
@@ -160,6 +170,26 @@ err:
     return -1;
 }
 
+isize net_sendv_nonblocking(int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {.msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt};
+    isize n           = 0;
+
+    do {
+        n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        fprintf(stderr, "sendmsg(2) - error sending data: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return n;
+}
+
 isize net_recv_nonblocking(int fd, void *ptr, usize len)
 {
     char *buf   = ptr;
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "types.h"
+#include <sys/uio.h>
 
 int net_tcp_accept(int server_fd, int nonblocking);
-int net_tcp_listen(const char *host, int port, int nonblocking);
+int net_tcp_listen(const char *host, int port, int nonblocking, int reuseport);
 int net_tcp_connect(const char *host, int port, int nonblocking);
 isize net_send_nonblocking(int fd, const void *ptr, size_t len);
+// Single vectored send, returns 0 if the socket is not writable
+isize net_sendv_nonblocking(int fd, const struct iovec *iov, int iovcnt);
 isize net_recv_nonblocking(int fd, void *ptr, size_t len);
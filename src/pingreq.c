@@ -2,17 +2,16 @@
 #include "mqtt.h"
 #include "tera_internal.h"
 
-MQTT_Decode_Result mqtt_pingreq_read(Tera_Context *ctx, const Client_Data *cdata)
+MQTT_Decode_Result mqtt_pingreq_read(Tera_Context *ctx, const Client_Data *cdata,
+                                     MQTT_Frame *frame)
 {
-    Buffer *buf         = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    Fixed_Header header = {0};
+    (void)ctx;
+    (void)cdata;
 
-    isize result        = mqtt_fixed_header_read(buf, &header);
-
-    if (result < 0)
+    if (frame->header.remaining_length != 0)
         return MQTT_DECODE_ERROR;
 
     log_info("recv: PINGREQ");
 
-    return result;
+    return MQTT_DECODE_SUCCESS;
 }
@@ -1,14 +1,18 @@
+#include "logger.h"
 #include "mqtt.h"
 #include "tera_internal.h"
 
-#define DEFAULT_PINGRESP_BYTE 0xD0
-
 void mqtt_pingresp_write(Tera_Context *ctx, const Client_Data *cdata)
 {
-    Buffer *buf         = &ctx->connection_data[cdata->conn_id].send_buffer;
-    Fixed_Header header = {.byte = DEFAULT_PINGRESP_BYTE, .remaining_length = 0};
+    Send_Queue *queue = connection_send_queue(ctx, cdata->conn_id);
+    Buffer *buf       = send_queue_scratch_begin(queue, mqtt_pingresp_size());
+    if (!buf) {
+        log_warning(">>>>: Send queue full, PINGRESP dropped");
+        return;
+    }
 
-    isize written_bytes = mqtt_fixed_header_write(buf, &header);
+    uint32 written_bytes = mqtt_pingresp_encode(buf);
+    send_queue_scratch_commit(queue);
 
-    log_info("send: PINGRESP %ld bytes", written_bytes);
+    log_info("send: PINGRESP %u bytes", written_bytes);
 }
@@ -1,12 +1,25 @@
 #include "logger.h"
 #include "mqtt.h"
+#include "shard.h"
 #include "tera_internal.h"
 #include <string.h>
 
-static uint32 calculate_publish_properties_length(const Publish_Properties *props)
+/*
+ * Properties of an outgoing PUBLISH, props may be NULL. The subscription
+ * identifiers received from the publisher are never forwarded, subscription_id
+ * is the one of the receiving subscription or <= 0 if it has none.
+ */
+static uint32 calculate_publish_properties_length(const Publish_Properties *props,
+                                                  int16 subscription_id)
 {
     uint32 length = 0;
 
+    if (subscription_id > 0)
+        length += sizeof(uint8) + mqtt_variable_length_encoded_length(subscription_id);
+
+    if (!props)
+        return length;
+
     if (props->has_payload_format) {
         length += sizeof(uint8) * 2; // Property ID + 1 byte value
     }
@@ -34,12 +47,6 @@ static uint32 calculate_publish_properties_length(const Publish_Properties *prop
         length += sizeof(uint8) + sizeof(uint16); // Property ID + 2 byte value
     }
 
-    // Subscription Identifiers (multiple allowed!)
-    for (int i = 0; i < props->subscription_id_count; i++) {
-        length += sizeof(uint8); // Property ID
-        length += mqtt_variable_length_encoded_length(props->subscription_ids[i]);
-    }
-
     return length;
 }
 
@@ -53,14 +60,14 @@ static MQTT_Decode_Result mqtt_publish_properties_read(Buffer *buf, Publish_Prop
 
     while (bytes_consumed < length) {
         uint8 property_id;
-        if (buffer_read_struct(buf, "B", &property_id) != sizeof(uint8)) {
+        if (buffer_read_u8(buf, &property_id) != sizeof(uint8)) {
             return MQTT_DECODE_ERROR;
         }
         bytes_consumed += sizeof(uint8);
 
         switch (property_id) {
         case PUBLISH_PROP_PAYLOAD_FORMAT_INDICATOR:
-            if (buffer_read_struct(buf, "B", &props->payload_format_indicator) != sizeof(uint8)) {
+            if (buffer_read_u8(buf, &props->payload_format_indicator) != sizeof(uint8)) {
                 return MQTT_DECODE_ERROR;
             }
             props->has_payload_format = true;
@@ -68,7 +75,7 @@ static MQTT_Decode_Result mqtt_publish_properties_read(Buffer *buf, Publish_Prop
             break;
 
         case PUBLISH_PROP_MESSAGE_EXPIRY_INTERVAL:
-            if (buffer_read_struct(buf, "I", &props->message_expiry_interval) != sizeof(uint32)) {
+            if (buffer_read_u32(buf, &props->message_expiry_interval) != sizeof(uint32)) {
                 return MQTT_DECODE_ERROR;
             }
             props->has_message_expiry = true;
@@ -83,7 +90,7 @@ static MQTT_Decode_Result mqtt_publish_properties_read(Buffer *buf, Publish_Prop
 
             usize sub_id;
             int sub_id_bytes = mqtt_variable_length_read(buf, &sub_id);
-            if (sub_id_bytes < 0) {
+            if (sub_id_bytes == 0) {
                 return MQTT_DECODE_ERROR;
             }
 
@@ -96,7 +103,7 @@ static MQTT_Decode_Result mqtt_publish_properties_read(Buffer *buf, Publish_Prop
         }
 
         case PUBLISH_PROP_TOPIC_ALIAS:
-            if (buffer_read_struct(buf, "H", &props->topic_alias) != sizeof(uint16)) {
+            if (buffer_read_u16(buf, &props->topic_alias) != sizeof(uint16)) {
                 return MQTT_DECODE_ERROR;
             }
             props->has_topic_alias = true;
@@ -116,41 +123,42 @@ static MQTT_Decode_Result mqtt_publish_properties_read(Buffer *buf, Publish_Prop
 }
 
 MQTT_Decode_Result mqtt_publish_read(Tera_Context *ctx, const Client_Data *cdata,
-                                     Published_Message *message)
+                                     MQTT_Frame *frame, Published_Message *message,
+                                     Topic_Levels *levels)
 {
-    Buffer *buf            = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    usize consumed         = 0;
-    Fixed_Header header    = {0};
-
-    isize fixed_header_len = mqtt_fixed_header_read(buf, &header);
-    if (fixed_header_len < 0)
-        return fixed_header_len;
-
-    if (header.remaining_length > MAX_PACKET_SIZE)
-        return MQTT_DECODE_OUT_OF_BOUNDS;
+    Buffer *buf         = &frame->payload;
+    Fixed_Header header = frame->header;
+    usize consumed      = 0;
 
     Data_Flags flags = data_flags_set(header.bits.retain, header.bits.qos, header.bits.dup, true);
     message->options = flags.value;
 
-    message->topic_offset = arena_current_offset(ctx->message_arena);
-    if (buffer_read_struct(buf, "H", &message->topic_size) != sizeof(uint16))
+    if (buffer_read_u16(buf, &message->topic_size) != sizeof(uint16))
         return MQTT_DECODE_ERROR;
 
     consumed += sizeof(uint16);
 
-    uint8 *topic_ptr = arena_alloc(ctx->message_arena, message->topic_size);
-    if (!topic_ptr) {
-        // TODO handle case
-        log_critical(">>>>: bump arena OOM");
+    message->topic_offset = slab_alloc(ctx->message_slab, message->topic_size);
+    if (message->topic_offset < 0) {
+        log_warning(">>>>: Message storage full, PUBLISH dropped");
+        return MQTT_DECODE_OUT_OF_BOUNDS;
     }
 
-    if (buffer_read_binary(topic_ptr, buf, message->topic_size) != message->topic_size)
-        return MQTT_DECODE_ERROR;
+    // A topic name that isn't valid UTF-8 makes the whole packet malformed
+    uint8 *topic_ptr = slab_at(ctx->message_slab, message->topic_offset);
+    if (buffer_read_utf8(topic_ptr, buf, message->topic_size) != message->topic_size)
+        return MQTT_DECODE_INVALID;
+
+    topic_scan((const char *)topic_ptr, message->topic_size, levels);
+    if (levels->plus > 0 || levels->hash > 0) {
+        log_warning(">>>>: Wildcards in PUBLISH topic name, PUBLISH dropped");
+        return MQTT_DECODE_INVALID;
+    }
 
     consumed += message->topic_size;
 
     if (header.bits.qos > AT_MOST_ONCE) {
-        if (buffer_read_struct(buf, "H", &message->id) != sizeof(uint16))
+        if (buffer_read_u16(buf, &message->id) != sizeof(uint16))
             return MQTT_DECODE_ERROR;
         consumed += sizeof(uint16);
     }
@@ -158,29 +166,34 @@ MQTT_Decode_Result mqtt_publish_read(Tera_Context *ctx, const Client_Data *cdata
     if (cdata->mqtt_version == MQTT_V5) {
         usize properties_length = 0;
         int prop_bytes          = mqtt_variable_length_read(buf, &properties_length);
-        if (prop_bytes < 0)
+        if (prop_bytes == 0)
             return MQTT_DECODE_ERROR;
         consumed += prop_bytes;
 
         // Properties
         int16 property_id         = 0;
         Publish_Properties *props = mqtt_publish_properties_find_free(ctx, &property_id);
+        if (!props) {
+            log_warning(">>>>: No free properties slot, PUBLISH dropped");
+            return MQTT_DECODE_OUT_OF_BOUNDS;
+        }
+
+        message->property_id = property_id;
         if (mqtt_publish_properties_read(buf, props, properties_length) != MQTT_DECODE_SUCCESS)
             return MQTT_DECODE_ERROR;
 
         consumed += properties_length;
-        message->property_id = property_id;
     }
 
-    message->message_offset = arena_current_offset(ctx->message_arena);
-    message->message_size   = header.remaining_length - consumed;
+    message->message_size = header.remaining_length - consumed;
 
-    uint8 *message_ptr      = arena_alloc(ctx->message_arena, message->message_size);
-    if (!message_ptr) {
-        // TODO handle case
-        log_critical(">>>>: bump arena OOM");
+    message->message_offset = slab_alloc(ctx->message_slab, message->message_size);
+    if (message->message_offset < 0) {
+        log_warning(">>>>: Message storage full, PUBLISH dropped");
+        return MQTT_DECODE_OUT_OF_BOUNDS;
     }
 
+    uint8 *message_ptr = slab_at(ctx->message_slab, message->message_offset);
     if (message->message_size > 0) {
         if (buffer_read_binary(message_ptr, buf, message->message_size) != message->message_size)
             return MQTT_DECODE_ERROR;
@@ -201,324 +214,365 @@ MQTT_Decode_Result mqtt_publish_read(Tera_Context *ctx, const Client_Data *cdata
 }
 
 // Write properties to buffer
-static isize mqtt_publish_properties_write(Buffer *buf, const Publish_Properties *props)
+static isize mqtt_publish_properties_write(Buffer *buf, const Publish_Properties *props,
+                                           int16 subscription_id)
 {
     isize bytes_written = 0;
 
+    if (subscription_id > 0) {
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_SUBSCRIPTION_IDENTIFIER);
+        bytes_written += mqtt_variable_length_write(buf, subscription_id);
+    }
+
+    if (!props)
+        return bytes_written;
+
     if (props->has_payload_format) {
-        bytes_written += buffer_write_struct(buf, "BB", PUBLISH_PROP_PAYLOAD_FORMAT_INDICATOR,
-                                             props->payload_format_indicator);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_PAYLOAD_FORMAT_INDICATOR);
+        bytes_written += buffer_write_u8(buf, props->payload_format_indicator);
     }
 
     if (props->has_message_expiry) {
-        bytes_written += buffer_write_struct(buf, "BI", PUBLISH_PROP_MESSAGE_EXPIRY_INTERVAL,
-                                             props->message_expiry_interval);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_MESSAGE_EXPIRY_INTERVAL);
+        bytes_written += buffer_write_u32(buf, props->message_expiry_interval);
     }
 
     if (props->has_content_type) {
-        bytes_written += buffer_write_struct(buf, "B", PUBLISH_PROP_CONTENT_TYPE);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_CONTENT_TYPE);
         bytes_written +=
             buffer_write_utf8_string(buf, props->content_type, props->content_type_len);
     }
 
     if (props->has_response_topic) {
-        bytes_written += buffer_write_struct(buf, "B", PUBLISH_PROP_RESPONSE_TOPIC);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_RESPONSE_TOPIC);
         bytes_written +=
             buffer_write_utf8_string(buf, props->response_topic, props->response_topic_len);
     }
 
     if (props->has_correlation_data) {
-        bytes_written += buffer_write_struct(buf, "B", PUBLISH_PROP_CORRELATION_DATA);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_CORRELATION_DATA);
         bytes_written +=
             buffer_write_utf8_string(buf, props->correlation_data, props->correlation_data_len);
     }
 
     if (props->has_topic_alias) {
-        bytes_written +=
-            buffer_write_struct(buf, "BH", PUBLISH_PROP_TOPIC_ALIAS, props->topic_alias);
-    }
-
-    if (props->subscription_id_count == 0)
-        bytes_written += buffer_write_struct(buf, "B", 0);
-
-    // Write Subscription Identifiers
-    for (int i = 0; i < props->subscription_id_count; i++) {
-        bytes_written += buffer_write_struct(buf, "B", PUBLISH_PROP_SUBSCRIPTION_IDENTIFIER);
-        bytes_written += mqtt_variable_length_write(buf, props->subscription_ids[i]);
+        bytes_written += buffer_write_u8(buf, PUBLISH_PROP_TOPIC_ALIAS);
+        bytes_written += buffer_write_u16(buf, props->topic_alias);
     }
 
     return bytes_written;
 }
 
-static int publish_properties_add_subscription(Publish_Properties *props, int16 subscription_id)
+static const Publish_Properties *publish_properties_get(const Tera_Context *ctx,
+                                                        const Published_Message *pub_msg)
 {
-    if (subscription_id < 0)
-        return 0;
-    if (props->subscription_id_count >= MAX_SUBSCRIPTION_IDS)
-        return -1;
-    for (int i = 0; i < props->subscription_id_count; i++)
-        if (props->subscription_ids[i] == subscription_id)
-            return 0;
+    if (pub_msg->property_id >= MAX_PUBLISHED_MESSAGES)
+        return NULL;
 
-    props->subscription_ids[props->subscription_id_count++] = subscription_id;
-    return 0;
+    return &ctx->properties_data[pub_msg->property_id];
 }
 
-/**
- * MQTT Topic Wildcard Matching Implementation
- *
- * MQTT wildcards:
- * - '+' matches exactly one topic level (single-level wildcard)
- * - '#' matches zero or more topic levels (multi-level wildcard, must be last)
- *
- * Examples:
- * - "sensor/+/temperature" matches "sensor/kitchen/temperature"
- * - "sensor/#" matches "sensor/kitchen/temperature" and "sensor/kitchen"
- * - "sensor/+/+/data" matches "sensor/room1/temp/data"
- */
-static bool topic_level_matches(const char *pattern, usize pattern_len, const char *topic,
-                                usize topic_len)
+// Remaining length of a PUBLISH delivered with the given QoS and MQTT version
+static usize publish_remaining_length(const Tera_Context *ctx, const Published_Message *pub_msg,
+                                      uint8 qos, MQTT_Version version, int16 subscription_id)
 {
-    if (pattern_len == 1 && pattern[0] == '+')
-        return true;
+    // - len of topic uint16
+    // - topic size in bytes
+    // - packet id uint16
+    // - properties length and properties
+    // - message size in bytes
+    usize length = sizeof(uint16) + pub_msg->topic_size + pub_msg->message_size;
+
+    if (qos > AT_MOST_ONCE)
+        length += sizeof(uint16);
 
-    return (pattern_len == topic_len && strncmp(pattern, topic, topic_len) == 0);
+    if (version == MQTT_V5) {
+        uint32 properties_length = calculate_publish_properties_length(
+            publish_properties_get(ctx, pub_msg), subscription_id);
+        length += mqtt_variable_length_encoded_length(properties_length) + properties_length;
+    }
+
+    return length;
 }
 
-static bool topic_matches(const Tera_Context *ctx, const char *topic, usize topic_size,
-                          const Subscription_Data *subdata)
+static inline usize publish_frame_size(usize remaining_length)
 {
-    const char *pattern = (const char *)arena_at(ctx->topic_arena, subdata->topic_offset);
-    usize pattern_size  = subdata->topic_size;
-
-    if (topic_size == pattern_size && strncmp(topic, pattern, topic_size) == 0)
-        return true;
-
-    if (pattern_size >= 1 && pattern[pattern_size - 1] == '#') {
-        // '#' must be the only character preceeded by '/'
-        if (pattern_size == 1)
-            return true;
-
-        if (pattern_size >= 2 && pattern[pattern_size - 2] == '/') {
-            usize prefix_len = pattern_size - 2;
-            if (topic_size >= prefix_len && strncmp(topic, pattern, prefix_len) == 0) {
-                return (topic_size == prefix_len ||
-                        (topic_size > prefix_len && topic[prefix_len] == '/'));
-            }
-        }
+    return sizeof(uint8) + mqtt_variable_length_encoded_length(remaining_length) +
+           remaining_length;
+}
 
-        return false;
+/*
+ * Serialize a whole PUBLISH packet with a zeroed packet identifier, returns
+ * the offset of the packet identifier from the start of the packet, 0 for
+ * QoS 0. The buffer must have room for publish_frame_size bytes.
+ */
+static uint16 publish_encode(Buffer *buf, const Tera_Context *ctx,
+                             const Published_Message *pub_msg, uint8 qos, MQTT_Version version,
+                             int16 subscription_id)
+{
+    const Publish_Properties *props = publish_properties_get(ctx, pub_msg);
+    const uint8 *payload            = slab_at(ctx->message_slab, pub_msg->message_offset);
+    const char *publish_topic       = slab_at(ctx->message_slab, pub_msg->topic_offset);
+    uint32 properties_length        = calculate_publish_properties_length(props, subscription_id);
+
+    usize start             = buf->write_pos;
+    uint16 packet_id_offset = 0;
+    usize remaining_length  = publish_remaining_length(ctx, pub_msg, qos, version, subscription_id);
+    Fixed_Header header     = {.bits.dup         = 0,
+                               .bits.retain      = 0,
+                               .bits.qos         = qos,
+                               .bits.type        = PUBLISH,
+                               .remaining_length = remaining_length};
+
+    mqtt_fixed_header_write(buf, &header);
+
+    // Topic Name
+    buffer_write_utf8_string(buf, publish_topic, pub_msg->topic_size);
+
+    // Packet identifier
+    if (qos > AT_MOST_ONCE) {
+        packet_id_offset = buf->write_pos - start;
+        buffer_write_u16(buf, 0);
     }
 
-    const char *pattern_pos = pattern;
-    const char *pattern_end = pattern + pattern_size;
-    const char *topic_pos   = topic;
-    const char *topic_end   = topic + topic_size;
+    // Properties
+    if (version == MQTT_V5) {
+        mqtt_variable_length_write(buf, properties_length);
+        mqtt_publish_properties_write(buf, props, subscription_id);
+    }
 
-    while (pattern_pos < pattern_end && topic_pos < topic_end) {
-        // Find next level separator or end
-        const char *pattern_level_end = pattern_pos;
-        while (pattern_level_end < pattern_end && *pattern_level_end != '/')
-            pattern_level_end++;
+    // Payload
+    if (pub_msg->message_size > 0)
+        buffer_write_binary(buf, payload, pub_msg->message_size);
 
-        const char *topic_level_end = topic_pos;
-        while (topic_level_end < topic_end && *topic_level_end != '/')
-            topic_level_end++;
+    return packet_id_offset;
+}
 
-        usize pattern_level_len = pattern_level_end - pattern_pos;
-        usize topic_level_len   = topic_level_end - topic_pos;
+static void publish_frame_patch(uint8 *packet, uint16 packet_id_offset, uint16 packet_id, bool dup)
+{
+    if (packet_id_offset > 0) {
+        packet[packet_id_offset]     = packet_id >> 8;
+        packet[packet_id_offset + 1] = packet_id & 0xFF;
+    }
 
-        if (!topic_level_matches(pattern_pos, pattern_level_len, topic_pos, topic_level_len))
-            return false;
+    // DUP flag, bit 3 of the fixed header
+    if (dup)
+        packet[0] |= 0x08;
+}
 
-        pattern_pos = pattern_level_end;
-        topic_pos   = topic_level_end;
+/*
+ * Return the shared frame of a message for a (QoS, MQTT version) pair,
+ * encoding it in the message slab the first time it's requested, NULL if
+ * there's no room left.
+ */
+static const Publish_Frame *publish_frame_get(Tera_Context *ctx, Published_Message *pub_msg,
+                                              uint8 qos, MQTT_Version version)
+{
+    uint8 variant = publish_frame_variant(qos, version);
+    if (pub_msg->frame_offsets[variant] >= 0)
+        return slab_at(ctx->message_slab, pub_msg->frame_offsets[variant]);
 
-        if (pattern_pos < pattern_end && *pattern_pos == '/')
-            pattern_pos++;
-        if (topic_pos < topic_end && *topic_pos == '/')
-            topic_pos++;
-    }
+    usize size   = publish_frame_size(publish_remaining_length(ctx, pub_msg, qos, version, -1));
+    int32 offset = slab_alloc(ctx->message_slab, sizeof(Publish_Frame) + size);
+    if (offset < 0)
+        return NULL;
 
-    return (pattern_pos == pattern_end && topic_pos == topic_end);
+    pub_msg->frame_offsets[variant] = offset;
+
+    Publish_Frame *frame            = slab_at(ctx->message_slab, offset);
+    Buffer frame_buf                = {0};
+    buffer_init(&frame_buf, frame->data, size);
+
+    frame->size             = size;
+    frame->packet_id_offset = publish_encode(&frame_buf, ctx, pub_msg, qos, version, -1);
+
+    return frame;
 }
 
-static bool topic_is_match(const Tera_Context *ctx, const Subscription_Data *subdata,
-                           const char *publish_topic, uint16 topic_size)
+/*
+ * Queue a PUBLISH for a single delivery to a client, referencing the shared
+ * frame for its QoS and MQTT version. MQTT v5 subscriptions with an identifier
+ * carry it in the properties, those are the only ones requiring a dedicated
+ * encoding.
+ */
+static isize publish_delivery_write(Tera_Context *ctx, Published_Message *pub_msg,
+                                    uint16 client_id, uint8 qos, uint16 packet_id,
+                                    int16 subscription_id, bool dup)
 {
-    bool is_match = false;
-    switch (subdata->type) {
-    case TFT_WILDCARD_NONE:
-        // The simplest case, no wildcards, just straight comparison of the topics
-        if (topic_size == subdata->topic_size) {
-            const char *sub_topic = (const char *)arena_at(ctx->topic_arena, subdata->topic_offset);
-            is_match              = (strncmp(publish_topic, sub_topic, topic_size) == 0);
-        }
-        break;
-
-    case TFT_WILDCARD_HASH: {
-        // '#' wildcard, we expect it to be a suffix last char
-        // e.g.
-        //
-        //   temperatures/#
-        //
-        // Should match:
-        //
-        //   temperatures/morning
-        //   temperatures/evening
-        //
-        // The simplest way to ensure it is to check that the prefix of the topics inclusive
-        // of  the '/'  match
-        const char *sub_topic = (const char *)arena_at(ctx->topic_arena, subdata->topic_offset);
-        if (subdata->topic_size == 1) {
-            is_match = true;
-        } else {
-            usize prefix_len = subdata->topic_size - 2;
-            if (topic_size >= prefix_len && strncmp(publish_topic, sub_topic, prefix_len) == 0) {
-                is_match = (topic_size == prefix_len ||
-                            (topic_size > prefix_len && publish_topic[prefix_len] == '/'));
-            }
-        }
-        break;
-    }
-    case TFT_WILDCARD_PLUS:
-        // '+' wildcard, this can be present in the middle of the filter
-        // e.g.
-        //
-        //   temperatures/+/celsius
-        //
-        // Should match:
-        //
-        //   temperatures/morning/celsius
-        //   temperatures/evening/celsius
-        //
-        // But not:
-        //
-        //   temperatures/morning/kelvin
-        //   temperatures/morning/farenheit
-        //
-        // In this case it's a little trickier as both prefix and suffix must match, with anything
-        // allowed in the middle
-        is_match = topic_matches(ctx, publish_topic, topic_size, subdata);
-        break;
+    MQTT_Version version = ctx->client_data[client_id].mqtt_version;
+    Send_Queue *queue    = connection_send_queue(ctx, client_id);
+
+    if (version == MQTT_V5 && subscription_id > 0) {
+        usize size = publish_frame_size(
+            publish_remaining_length(ctx, pub_msg, qos, version, subscription_id));
+        Buffer *buf = send_queue_scratch_begin(queue, size);
+        if (!buf)
+            return -1;
+
+        uint8 *packet           = buf->data + buf->write_pos;
+        uint16 packet_id_offset = publish_encode(buf, ctx, pub_msg, qos, version, subscription_id);
+        publish_frame_patch(packet, packet_id_offset, packet_id, dup);
+        send_queue_scratch_commit(queue);
+        return size;
     }
 
-    return is_match;
+    // The message stays around until the frame is written out
+    int16 owner                = pub_msg - ctx->published_messages;
+    const Publish_Frame *frame = publish_frame_get(ctx, pub_msg, qos, version);
+    if (!frame)
+        return -1;
+
+    if (send_queue_push(queue, frame->data, frame->size, frame->packet_id_offset, packet_id, dup,
+                        owner) < 0)
+        return -1;
+
+    pub_msg->references++;
+
+    return frame->size;
 }
 
-void mqtt_publish_fanout_write(Tera_Context *ctx, const Client_Data *cdata,
-                               Published_Message *pub_msg, uint16 index)
+// Deliver a PUBLISH to all the matching subscriptions owned by this shard
+static void publish_fanout_local(Tera_Context *ctx, Published_Message *pub_msg, uint16 index,
+                                 const Topic_Levels *levels)
 {
-    const char *publish_topic  = (const char *)arena_at(ctx->message_arena, pub_msg->topic_offset);
+    const char *publish_topic  = slab_at(ctx->message_slab, pub_msg->topic_offset);
     isize written_bytes        = 0;
     uint16 delivery_index      = 0;
-    Publish_Properties *props  = &ctx->properties_data[pub_msg->property_id];
-    const uint8 *payload       = arena_at(ctx->message_arena, pub_msg->message_offset);
-    Buffer *buf                = NULL;
     Data_Flags message_flags   = data_flags_get(pub_msg->options);
     uint32 current_time_millis = current_millis_relative();
 
-    // Remaining Variable Length
-    // - len of topic uint16
-    // - packet id uint16
-    // - properties length
-    // - topic size in bytes
-    // - message size in bytes
-    Fixed_Header header        = {.bits.dup    = 0,
-                                  .bits.retain = 0,
-                                  .bits.type   = PUBLISH,
-                                  .remaining_length =
-                                      sizeof(uint16) + pub_msg->topic_size + pub_msg->message_size};
-
-    for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
-        if (!ctx->subscription_data[i].active)
-            continue;
-
-        Subscription_Data *subdata = &ctx->subscription_data[i];
-        if (!topic_is_match(ctx, subdata, publish_topic, pub_msg->topic_size))
-            continue;
-
-        // Create delivery record for this subscription
-        Message_Delivery *delivery = mqtt_message_delivery_find_free(ctx, &delivery_index);
-        if (!delivery)
-            continue;
-
-        delivery->published_msg_id = pub_msg->id;
-        delivery->client_id        = subdata->client_id;
-        delivery->message_id       = mqtt_subscription_next_mid(subdata);
-        delivery->published_index  = index;
+    // Cached matches of a recent topic, or the exact subscribers with a single probe followed
+    // by the wildcard filters
+    int16 matches[MAX_SUBSCRIPTIONS];
+    uint32 hash        = topic_hash(publish_topic, pub_msg->topic_size);
+    int32 cached_count = match_cache_lookup(ctx, publish_topic, pub_msg->topic_size, hash, matches);
+    usize match_count  = cached_count;
+
+    if (cached_count < 0) {
+        match_count = exact_index_match(ctx, publish_topic, pub_msg->topic_size, hash, matches, 0,
+                                        MAX_SUBSCRIPTIONS);
+        match_count += topic_trie_match(ctx, publish_topic, levels, matches + match_count,
+                                        MAX_SUBSCRIPTIONS - match_count);
+        match_cache_store(ctx, publish_topic, pub_msg->topic_size, hash, matches, match_count);
+    }
 
-        mqtt_message_delivery_add(ctx, subdata->client_id, delivery->message_id, delivery_index);
+    for (usize i = 0; i < match_count; ++i) {
+        Subscription_Data *subdata = &ctx->subscription_data[matches[i]];
 
         /*
          * Update QoS according to subscriber's one, following MQTT
          * rules: The min between the original QoS and the subscriber
          * QoS
          */
-        uint8 granted_qos = subdata->options & 0x03;
-        delivery->delivery_qos =
-            message_flags.bits.qos >= granted_qos ? granted_qos : message_flags.bits.qos;
-        delivery->state         = (delivery->delivery_qos == AT_MOST_ONCE)    ? MSG_ACKNOWLEDGED
-                                  : (delivery->delivery_qos == AT_LEAST_ONCE) ? MSG_AWAITING_PUBACK
-                                                                              : MSG_AWAITING_PUBREC;
-        delivery->last_sent_at  = current_time_millis;
-        delivery->next_retry_at = (delivery->delivery_qos > AT_MOST_ONCE)
-                                      ? delivery->last_sent_at + MQTT_RETRY_TIMEOUT_MS
-                                      : 0;
-        delivery->retry_count   = 0;
-        delivery->active        = (delivery->delivery_qos != AT_MOST_ONCE);
-
-        header.bits.qos         = delivery->delivery_qos;
-        if (header.bits.qos > AT_MOST_ONCE)
-            header.remaining_length += sizeof(uint16);
-
-        // Write to subscription buffer
-
-        buf = &ctx->connection_data[subdata->client_id].send_buffer;
-        buffer_reset(buf);
-
-        publish_properties_add_subscription(props, subdata->id);
-        uint32 properties_length = 0;
-
-        if (cdata->mqtt_version == MQTT_V5) {
-            properties_length = calculate_publish_properties_length(props);
-            header.remaining_length += mqtt_variable_length_encoded_length(properties_length);
-            header.remaining_length += properties_length;
+        uint8 granted_qos  = subdata->options & 0x03;
+        uint8 delivery_qos = message_flags.bits.qos >= granted_qos ? granted_qos
+                                                                   : message_flags.bits.qos;
+        uint16 packet_id   = 0;
+
+        // QoS 0 is fire and forget, only QoS 1 and 2 need a delivery record to track acks
+        if (delivery_qos > AT_MOST_ONCE) {
+            Message_Delivery *delivery = mqtt_message_delivery_find_free(ctx, &delivery_index);
+            if (!delivery)
+                continue;
+
+            delivery->published_msg_id  = pub_msg->id;
+            delivery->client_id         = subdata->client_id;
+            delivery->client_generation = ctx->connection_data[subdata->client_id].generation;
+            delivery->message_id        = mqtt_subscription_next_mid(subdata);
+            delivery->published_index   = index;
+
+            mqtt_message_delivery_add(ctx, subdata->client_id, delivery->message_id,
+                                      delivery_index);
+
+            delivery->delivery_qos  = delivery_qos;
+            delivery->state         = delivery_qos == AT_LEAST_ONCE ? MSG_AWAITING_PUBACK
+                                                                    : MSG_AWAITING_PUBREC;
+            delivery->last_sent_at  = current_time_millis;
+            delivery->retry_count   = 0;
+            delivery->active        = true;
+
+            timer_wheel_schedule(&ctx->timer_wheel, delivery_timer_id(delivery_index),
+                                 MQTT_RETRY_TIMEOUT_MS);
+
+            packet_id               = delivery->message_id;
+            pub_msg->references++;
         }
 
-        isize fixed_header_len = mqtt_fixed_header_write(buf, &header);
-        if (fixed_header_len < 0) {
-            log_error(">>>>: Failed to write packet header");
-        } else {
-            written_bytes += fixed_header_len;
-
-            // Topic Name
-            written_bytes += buffer_write_utf8_string(buf, publish_topic, pub_msg->topic_size);
+        written_bytes = publish_delivery_write(ctx, pub_msg, subdata->client_id, delivery_qos,
+                                               packet_id, subdata->id, false);
+        if (written_bytes < 0) {
+            log_warning(">>>>: Send queue or message storage full, PUBLISH dropped");
+            continue;
+        }
 
-            // Packet identifier
-            if (header.bits.qos > AT_MOST_ONCE) {
-                written_bytes += buffer_write_struct(buf, "H", delivery->message_id);
-            }
+        log_info("sent: PUBLISH id: %d cid: %d sid: %d qos: %d (%li bytes)", packet_id,
+                 subdata->client_id, subdata->id, delivery_qos, written_bytes);
+    }
+}
 
-            // Properties
-            if (cdata->mqtt_version == MQTT_V5) {
-                written_bytes += mqtt_variable_length_write(buf, properties_length);
-                written_bytes += mqtt_publish_properties_write(buf, props);
-            }
+/*
+ * Copy the PUBLISH to every other shard with at least an active subscription,
+ * they will run their own local fanout once they drain the ring.
+ */
+static void publish_forward_to_shards(Tera_Context *ctx, const Published_Message *pub_msg)
+{
+    Shard_Router *router = ctx->router;
+    if (!router)
+        return;
 
-            // Payload
-            if (pub_msg->message_size > 0)
-                written_bytes += buffer_write_binary(buf, payload, pub_msg->message_size);
+    const uint8 *topic              = slab_at(ctx->message_slab, pub_msg->topic_offset);
+    const uint8 *payload            = slab_at(ctx->message_slab, pub_msg->message_offset);
+    const Publish_Properties *props = publish_properties_get(ctx, pub_msg);
 
-            pub_msg->deliveries++;
+    for (uint16 shard = 0; shard < router->shard_count; ++shard) {
+        if (shard == ctx->shard_id || !shard_has_subscriptions(router, shard))
+            continue;
 
-            log_info("sent: PUBLISH id: %d cid: %d sid: %d qos: %d (%li bytes)",
-                     delivery->message_id, subdata->client_id, subdata->id, delivery->delivery_qos,
-                     written_bytes);
+        Shard_Message *msg = shard_ring_reserve(router, ctx->shard_id, shard);
+        if (!msg) {
+            log_warning(">>>>: Shard %u is lagging behind, PUBLISH dropped", shard);
+            continue;
         }
 
-        written_bytes = 0;
+        msg->topic_size     = pub_msg->topic_size;
+        msg->message_size   = pub_msg->message_size;
+        msg->options        = pub_msg->options;
+        msg->has_properties = props != NULL;
+        if (msg->has_properties)
+            msg->properties = *props;
+
+        memcpy(msg->data, topic, pub_msg->topic_size);
+        memcpy(msg->data + pub_msg->topic_size, payload, pub_msg->message_size);
+
+        shard_ring_commit(router, ctx->shard_id, shard);
     }
+}
+
+void mqtt_publish_fanout_write(Tera_Context *ctx, const Client_Data *cdata,
+                               Published_Message *pub_msg, uint16 index,
+                               const Topic_Levels *levels)
+{
+    uint16 delivery_index      = 0;
+    Data_Flags message_flags   = data_flags_get(pub_msg->options);
+    Message_Delivery *delivery = NULL;
+
+    /*
+     * A QoS 2 PUBLISH needs a delivery record until its PUBREL. Taken before
+     * the fanout: with the pool exhausted the PUBLISH is not forwarded and
+     * gets no PUBREC, the client retries it later and subscribers don't get
+     * it twice.
+     */
+    if (message_flags.bits.qos == EXACTLY_ONCE) {
+        delivery = mqtt_message_delivery_find_free(ctx, &delivery_index);
+        if (!delivery) {
+            log_warning(">>>>: No free delivery slot, QoS 2 PUBLISH dropped");
+            mqtt_published_message_free(ctx, index);
+            return;
+        }
+    }
+
+    publish_forward_to_shards(ctx, pub_msg);
+    publish_fanout_local(ctx, pub_msg, index, levels);
 
     // TODO not great to do this here
     switch (message_flags.bits.qos) {
@@ -530,15 +584,13 @@ void mqtt_publish_fanout_write(Tera_Context *ctx, const Client_Data *cdata,
         pub_msg->options = data_flags_active_set(pub_msg->options, 0);
         break;
     case EXACTLY_ONCE: {
-        // Create delivery record for this subscription, check if one exists already first
-        Message_Delivery *delivery = mqtt_message_delivery_find_free(ctx, &delivery_index);
-
-        pub_msg->deliveries++;
+        pub_msg->references++;
         mqtt_ack_write(ctx, cdata, PUBREC, pub_msg->id);
 
-        delivery->published_msg_id = pub_msg->id;
-        delivery->client_id        = cdata->conn_id;
-        delivery->message_id       = pub_msg->id;
+        delivery->published_msg_id  = pub_msg->id;
+        delivery->client_id         = cdata->conn_id;
+        delivery->client_generation = ctx->connection_data[cdata->conn_id].generation;
+        delivery->message_id        = pub_msg->id;
 
         mqtt_message_delivery_add(ctx, cdata->conn_id, pub_msg->id, delivery_index);
 
@@ -550,78 +602,98 @@ void mqtt_publish_fanout_write(Tera_Context *ctx, const Client_Data *cdata,
         delivery->delivery_qos    = message_flags.bits.qos;
         delivery->state           = MSG_AWAITING_PUBREL;
         delivery->last_sent_at    = current_millis_relative();
-        delivery->next_retry_at   = delivery->last_sent_at + MQTT_RETRY_TIMEOUT_MS;
         delivery->retry_count     = 0;
         delivery->active          = true;
         delivery->published_index = index;
 
+        timer_wheel_schedule(&ctx->timer_wheel, delivery_timer_id(delivery_index),
+                             MQTT_RETRY_TIMEOUT_MS);
+
         break;
     }
     default:
         // Unreachable
         break;
     }
+
+    // Done with the fanout, from now on the message lives as long as its deliveries and frames
+    mqtt_published_message_free(ctx, index);
 }
 
-void mqtt_publish_retry(Tera_Context *ctx, Message_Delivery *delivery)
+void mqtt_publish_fanout_shard(Tera_Context *ctx, const Shard_Message *msg)
 {
-    Published_Message *pub_msg = &ctx->published_messages[delivery->published_msg_id];
-    Buffer *buf                = &ctx->connection_data[delivery->client_id].send_buffer;
-    Publish_Properties *props  = &ctx->properties_data[pub_msg->property_id];
-    const uint8 *payload       = arena_at(ctx->message_arena, pub_msg->message_offset);
-    const char *publish_topic  = (const char *)arena_at(ctx->message_arena, pub_msg->topic_offset);
-    Client_Data *cdata         = &ctx->client_data[delivery->client_id];
-    isize written_bytes        = 0;
-    buffer_reset(buf);
+    uint16 index               = 0;
+    Published_Message *pub_msg = mqtt_published_message_find_free(ctx, &index);
+    if (!pub_msg) {
+        log_warning(">>>>: No free published message slot, shard PUBLISH dropped");
+        return;
+    }
 
-    // Remaining Variable Length
-    // - len of topic uint16
-    // - packet id uint16
-    // - properties length
-    // - topic size in bytes
-    // - message size in bytes
-    Fixed_Header header = {.bits.qos    = delivery->delivery_qos,
-                           .bits.dup    = 0,
-                           .bits.retain = 0,
-                           .bits.type   = PUBLISH,
-                           .remaining_length =
-                               sizeof(uint16) + pub_msg->topic_size + pub_msg->message_size};
+    pub_msg->topic_offset   = slab_alloc(ctx->message_slab, msg->topic_size);
+    pub_msg->message_offset = slab_alloc(ctx->message_slab, msg->message_size);
+    if (pub_msg->topic_offset < 0 || pub_msg->message_offset < 0) {
+        log_warning(">>>>: Message storage full, shard PUBLISH dropped");
+        mqtt_published_message_free(ctx, index);
+        return;
+    }
 
-    if (header.bits.qos > AT_MOST_ONCE)
-        header.remaining_length += sizeof(uint16);
+    memcpy(slab_at(ctx->message_slab, pub_msg->topic_offset), msg->data, msg->topic_size);
+    memcpy(slab_at(ctx->message_slab, pub_msg->message_offset), msg->data + msg->topic_size,
+           msg->message_size);
 
-    uint32 properties_length = 0;
+    pub_msg->id             = 0;
+    pub_msg->options        = msg->options;
+    pub_msg->topic_size     = msg->topic_size;
+    pub_msg->message_size   = msg->message_size;
 
-    if (cdata->mqtt_version == MQTT_V5) {
-        properties_length = calculate_publish_properties_length(props);
-        header.remaining_length += mqtt_variable_length_encoded_length(properties_length);
-        header.remaining_length += properties_length;
+    if (msg->has_properties) {
+        int16 property_id         = 0;
+        Publish_Properties *props = mqtt_publish_properties_find_free(ctx, &property_id);
+        if (props) {
+            *props               = msg->properties;
+            props->active        = true;
+            pub_msg->property_id = property_id;
+        }
     }
 
-    isize fixed_header_len = mqtt_fixed_header_write(buf, &header);
-    if (fixed_header_len < 0) {
-        log_error(">>>>: Failed to write packet header");
-    } else {
-        written_bytes += fixed_header_len;
+    // Levels don't travel through the ring, rescanning is cheaper than copying them
+    Topic_Levels levels;
+    topic_scan((const char *)msg->data, msg->topic_size, &levels);
 
-        // Topic Name
-        written_bytes += buffer_write_utf8_string(buf, publish_topic, pub_msg->topic_size);
+    // The publisher has already been acknowledged by the shard it's connected to
+    publish_fanout_local(ctx, pub_msg, index, &levels);
+    pub_msg->options = data_flags_active_set(pub_msg->options, 0);
 
-        // Packet identifier
-        if (header.bits.qos > AT_MOST_ONCE)
-            written_bytes += buffer_write_struct(buf, "H", delivery->message_id);
+    // Done with the fanout, from now on the message lives as long as its deliveries and frames
+    mqtt_published_message_free(ctx, index);
+}
 
-        if (cdata->mqtt_version == MQTT_V5) {
-            // Properties
-            written_bytes += mqtt_variable_length_write(buf, properties_length);
-            written_bytes += mqtt_publish_properties_write(buf, props);
-        }
+void mqtt_publish_retry(Tera_Context *ctx, Message_Delivery *delivery)
+{
+    Published_Message *pub_msg = &ctx->published_messages[delivery->published_index];
+    Client_Data *cdata         = &ctx->client_data[delivery->client_id];
 
-        // Payload
-        if (pub_msg->message_size > 0)
-            written_bytes += buffer_write_binary(buf, payload, pub_msg->message_size);
+    // Inbound QoS 2 or already received PUBREC, the pending packet is an ack
+    if (delivery->state == MSG_AWAITING_PUBREL) {
+        mqtt_ack_write(ctx, cdata, PUBREC, delivery->message_id);
+        return;
+    }
 
-        log_info("sent: PUBLISH id: %d cid: %d qos: %d (%li bytes)", delivery->message_id,
-                 delivery->client_id, delivery->delivery_qos, written_bytes);
+    if (delivery->state == MSG_AWAITING_PUBCOMP) {
+        mqtt_ack_write(ctx, cdata, PUBREL, delivery->message_id);
+        return;
     }
+
+    // The subscription identifier is not tracked by the delivery, retransmissions share the
+    // plain frame
+    isize written_bytes = publish_delivery_write(ctx, pub_msg, delivery->client_id,
+                                                 delivery->delivery_qos, delivery->message_id,
+                                                 -1, true);
+    if (written_bytes < 0) {
+        log_warning(">>>>: Send queue or message storage full, PUBLISH dropped");
+        return;
+    }
+
+    log_info("sent: PUBLISH id: %d cid: %d qos: %d dup: 1 (%li bytes)", delivery->message_id,
+             delivery->client_id, delivery->delivery_qos, written_bytes);
 }
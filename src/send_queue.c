@@ -0,0 +1,198 @@
+#include "send_queue.h"
+#include "net.h"
+
+#define DUP_FLAG 0x08
+
+static inline Send_Frame *frame_at(Send_Queue *queue, uint16 position)
+{
+    return &queue->frames[(queue->head + position) & (SEND_QUEUE_SIZE - 1)];
+}
+
+static inline const Send_Frame *frame_at_const(const Send_Queue *queue, uint16 position)
+{
+    return &queue->frames[(queue->head + position) & (SEND_QUEUE_SIZE - 1)];
+}
+
+/*
+ * Split a frame in the segments to write, skipping the first skip bytes:
+ *
+ *   [header][data + 1, packet id) [packet id][after the packet id, end)
+ *
+ * Returns the number of segments written to iov.
+ */
+static int send_frame_iovecs(const Send_Frame *frame, usize skip, struct iovec *iov)
+{
+    struct iovec segments[4] = {{(void *)&frame->header, sizeof(uint8)}};
+    int count                = 1;
+
+    if (frame->packet_id_offset > 0) {
+        usize after = frame->packet_id_offset + sizeof(uint16);
+
+        segments[count++] =
+            (struct iovec){(void *)(frame->data + 1), frame->packet_id_offset - sizeof(uint8)};
+        segments[count++] = (struct iovec){(void *)frame->packet_id, sizeof(uint16)};
+        segments[count++] = (struct iovec){(void *)(frame->data + after), frame->size - after};
+    } else {
+        segments[count++] = (struct iovec){(void *)(frame->data + 1), frame->size - sizeof(uint8)};
+    }
+
+    int used = 0;
+    for (int i = 0; i < count; ++i) {
+        if (skip >= segments[i].iov_len) {
+            skip -= segments[i].iov_len;
+            continue;
+        }
+        iov[used].iov_base = (uint8 *)segments[i].iov_base + skip;
+        iov[used].iov_len  = segments[i].iov_len - skip;
+        skip               = 0;
+        used++;
+    }
+
+    return used;
+}
+
+// Nothing is referencing the scratch buffer anymore, hand it back
+static void send_queue_scratch_release(Send_Queue *queue)
+{
+    buffer_pool_release(queue->pool, queue->scratch.data);
+    buffer_init(&queue->scratch, NULL, 0);
+    queue->scratch_start = 0;
+}
+
+void send_queue_init(Send_Queue *queue, Buffer_Pool *pool)
+{
+    queue->head          = 0;
+    queue->count         = 0;
+    queue->released      = 0;
+    queue->head_sent     = 0;
+    queue->scratch_start = 0;
+    queue->pool          = pool;
+    buffer_init(&queue->scratch, NULL, 0);
+}
+
+int send_queue_push(Send_Queue *queue, const uint8 *data, uint16 size, uint16 packet_id_offset,
+                    uint16 packet_id, bool dup, int16 owner)
+{
+    if (queue->count + queue->released == SEND_QUEUE_SIZE || size == 0)
+        return -1;
+
+    Send_Frame *frame       = frame_at(queue, queue->count);
+    frame->data             = data;
+    frame->size             = size;
+    frame->packet_id_offset = packet_id_offset;
+    frame->owner            = owner;
+    frame->header           = dup ? data[0] | DUP_FLAG : data[0];
+    frame->packet_id[0]     = packet_id >> 8;
+    frame->packet_id[1]     = packet_id & 0xFF;
+
+    queue->count++;
+
+    return 0;
+}
+
+Buffer *send_queue_scratch_begin(Send_Queue *queue, usize size)
+{
+    if (queue->count + queue->released == SEND_QUEUE_SIZE)
+        return NULL;
+
+    if (!queue->scratch.data) {
+        void *block = buffer_pool_acquire(queue->pool);
+        if (!block)
+            return NULL;
+        buffer_init(&queue->scratch, block, queue->pool->block_size);
+    }
+
+    if (queue->scratch.write_pos + size > queue->scratch.size)
+        return NULL;
+
+    queue->scratch_start = queue->scratch.write_pos;
+
+    return &queue->scratch;
+}
+
+int send_queue_scratch_commit(Send_Queue *queue)
+{
+    uint32 size = queue->scratch.write_pos - queue->scratch_start;
+
+    return send_queue_push(queue, queue->scratch.data + queue->scratch_start, size, 0, 0, false,
+                           -1);
+}
+
+int send_queue_iovecs(const Send_Queue *queue, struct iovec *iov, int iov_max)
+{
+    int used   = 0;
+    usize skip = queue->head_sent;
+
+    // Stop at the first frame that may not fit entirely
+    for (uint16 i = 0; i < queue->count && used + 4 <= iov_max; ++i) {
+        used += send_frame_iovecs(frame_at_const(queue, i), skip, iov + used);
+        skip  = 0;
+    }
+
+    return used;
+}
+
+void send_queue_consume(Send_Queue *queue, usize bytes)
+{
+    while (queue->count > 0) {
+        Send_Frame *frame = frame_at(queue, 0);
+        usize left        = frame->size - queue->head_sent;
+
+        if (bytes < left) {
+            queue->head_sent += bytes;
+            return;
+        }
+
+        bytes -= left;
+        queue->head      = (queue->head + 1) & (SEND_QUEUE_SIZE - 1);
+        queue->head_sent = 0;
+        queue->count--;
+        queue->released++;
+    }
+
+    send_queue_scratch_release(queue);
+}
+
+void send_queue_discard(Send_Queue *queue)
+{
+    // Same as if all of them had been sent
+    queue->released += queue->count;
+
+    queue->head      = (queue->head + queue->count) & (SEND_QUEUE_SIZE - 1);
+    queue->count     = 0;
+    queue->head_sent = 0;
+    send_queue_scratch_release(queue);
+}
+
+int16 send_queue_next_released(Send_Queue *queue)
+{
+    while (queue->released > 0) {
+        uint16 position = (queue->head - queue->released) & (SEND_QUEUE_SIZE - 1);
+        queue->released--;
+        if (queue->frames[position].owner >= 0)
+            return queue->frames[position].owner;
+    }
+
+    return -1;
+}
+
+isize send_queue_net_flush(Send_Queue *queue, int fd)
+{
+    struct iovec iov[SEND_QUEUE_IOV_MAX];
+    isize total = 0;
+
+    // More than SEND_QUEUE_IOV_MAX segments pending take more than one round
+    while (!send_queue_is_empty(queue)) {
+        int iov_count = send_queue_iovecs(queue, iov, SEND_QUEUE_IOV_MAX);
+        isize written = net_sendv_nonblocking(fd, iov, iov_count);
+        if (written < 0)
+            return -1;
+        if (written == 0)
+            break;
+
+        send_queue_consume(queue, written);
+        total += written;
+    }
+
+    return total;
+}
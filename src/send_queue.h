@@ -0,0 +1,93 @@
+#pragma once
+
+#include "buffer.h"
+#include "buffer_pool.h"
+#include "types.h"
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define SEND_QUEUE_SIZE    64 // Must be a power of two
+// A frame takes at most 4 iovecs, a single write flushes up to 16 frames
+#define SEND_QUEUE_IOV_MAX 64
+
+/*
+ * Outbound queue of a connection, a bounded FIFO of references to encoded
+ * frames, flushed with a single vectored write.
+ *
+ * Frames shared between connections (e.g. a PUBLISH fanned out to many
+ * subscribers) are referenced in place, the header byte and the packet
+ * identifier are kept in the queue entry and spliced in while flushing, so
+ * the shared bytes are never written to. They must stay valid until the frame
+ * is fully sent: each one carries the id of its owner, handed back through
+ * send_queue_next_released once the frame is out so that the owner can drop
+ * its reference.
+ *
+ * Frames encoded for a single connection (acks, CONNACK, SUBACK...) go to a
+ * scratch buffer taken from a pool on the first one, which is only given back
+ * once the queue is drained: pending frames never move.
+ */
+typedef struct send_frame {
+    const uint8 *data;
+    uint16 size;
+    uint16 packet_id_offset; // 0 if there's no packet identifier to patch
+    int16 owner;             // -1 for frames in the scratch buffer
+    uint8 header;            // First byte of the frame, replaces data[0]
+    uint8 packet_id[2];      // Big endian
+} Send_Frame;
+
+typedef struct send_queue {
+    Send_Frame frames[SEND_QUEUE_SIZE];
+    uint16 head;
+    uint16 count;
+    uint16 released;  // Frames sent but not collected yet, right before head
+    uint32 head_sent; // Bytes of the head frame already written
+    uint32 scratch_start;
+    Buffer scratch; // No backing block while there are no scratch frames
+    Buffer_Pool *pool;
+} Send_Queue;
+
+void send_queue_init(Send_Queue *queue, Buffer_Pool *pool);
+
+static inline bool send_queue_is_empty(const Send_Queue *queue) { return queue->count == 0; }
+
+/*
+ * Enqueue a reference to a frame, the first byte gets the DUP flag if dup is
+ * set and packet_id is written at packet_id_offset if it's not 0.
+ * Returns -1 if the queue is full.
+ */
+int send_queue_push(Send_Queue *queue, const uint8 *data, uint16 size, uint16 packet_id_offset,
+                    uint16 packet_id, bool dup, int16 owner);
+
+/*
+ * Encode a frame private to the connection, begin returns the scratch buffer
+ * to write it to, or NULL if there's no room for size bytes or the queue is
+ * full. Commit enqueues everything written since begin.
+ */
+Buffer *send_queue_scratch_begin(Send_Queue *queue, usize size);
+int send_queue_scratch_commit(Send_Queue *queue);
+
+/*
+ * Fill iov with the pending bytes, up to iov_max entries, returns the number
+ * of entries used.
+ */
+int send_queue_iovecs(const Send_Queue *queue, struct iovec *iov, int iov_max);
+
+// Drop the first bytes of the queue once they've been written to the socket
+void send_queue_consume(Send_Queue *queue, usize bytes);
+
+// Drop all the pending frames without sending them, e.g. on disconnection
+void send_queue_discard(Send_Queue *queue);
+
+/*
+ * Owners of the frames fully sent or discarded since the last call, one by
+ * one, -1 once there are no more. They must be collected before pushing new
+ * frames, released frames still take room in the queue.
+ */
+int16 send_queue_next_released(Send_Queue *queue);
+
+/*
+ * Write as much as possible of the queue to a non-blocking socket, a single
+ * writev unless more than SEND_QUEUE_IOV_MAX segments are pending. Returns
+ * the bytes written or -1 on error.
+ */
+isize send_queue_net_flush(Send_Queue *queue, int fd);
@@ -5,27 +5,20 @@
 #include "logger.h"
 #include "mqtt.h"
 #include "net.h"
+#include "shard.h"
 #include "tera_internal.h"
 #include "types.h"
+#include "uring.h"
+#include "utf8.h"
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-// ============================ Globals ==============================
-
-uint8 client_data_buffer[MAX_CLIENT_DATA_BUFFER_SIZE]   = {0};
-Arena client_arena                                      = {0};
-
-uint8 message_data_buffer[MAX_MESSAGE_DATA_BUFFER_SIZE] = {0};
-Arena message_arena                                     = {0};
-
-uint8 topic_data_buffer[MAX_TOPIC_DATA_BUFFER_SIZE]     = {0};
-Arena topic_arena                                       = {0};
-
-uint8 io_buffer[MAX_MESSAGE_DATA_BUFFER_SIZE]           = {0};
-Arena io_arena                                          = {0};
-
 typedef enum {
     TRANSPORT_SUCCESS           = 0,
     TRANSPORT_EAGAIN            = 0,
@@ -33,81 +26,138 @@ typedef enum {
     TRANSPORT_INCOMPLETE_PACKET = -2,
 } Transport_Result;
 
-// Global context of the server, this will be passed around anywhere
-// the global state is accessed or mutated
-static Tera_Context context = {0};
+/*
+ * A worker is a self-contained reactor: its own listener, event loop and
+ * context, this will be passed around anywhere the state of the shard is
+ * accessed or mutated. Workers only talk to each other through the shard
+ * router.
+ */
+typedef struct tera_worker {
+    Tera_Context context;
+    Tera_Memory memory;
+    pthread_t thread;
+    int serverfd;
+} Tera_Worker;
 
 // ======================== Static helpers ===========================
 
+static void shutdown_connection(Tera_Context *ctx, uint16 conn_id);
+
+/*
+ * Frames shared with other connections hold a reference on their published
+ * message, dropped here once they've been written out or discarded.
+ */
+static void connection_release_frames(Tera_Context *ctx, Connection_Data *cd)
+{
+    int16 owner = -1;
+    while ((owner = send_queue_next_released(&cd->send_queue)) != -1)
+        mqtt_published_message_free(ctx, owner);
+}
+
+/*
+ * The receive buffer is only held while there are bytes to decode, an idle
+ * connection gives it back to the pool after each read and takes one again
+ * on the next readiness.
+ */
+static bool connection_recv_acquire(Tera_Context *ctx, Connection_Data *cd)
+{
+    if (cd->recv_buffer.data)
+        return true;
+
+    void *block = buffer_pool_acquire(ctx->io_pool);
+    if (!block) {
+        log_error(">>>>: I/O buffers exhausted");
+        return false;
+    }
+
+    buffer_init(&cd->recv_buffer, block, MAX_PACKET_SIZE);
+    return true;
+}
+
+static void connection_recv_release(Tera_Context *ctx, Connection_Data *cd)
+{
+    buffer_pool_release(ctx->io_pool, cd->recv_buffer.data);
+    buffer_init(&cd->recv_buffer, NULL, 0);
+}
+
+// Between reads, unless a partial packet is pending
+static void connection_recv_idle(Tera_Context *ctx, Connection_Data *cd)
+{
+    if (buffer_is_empty(&cd->recv_buffer))
+        connection_recv_release(ctx, cd);
+}
+
 /**
- * This function is pretty simple, just loop through all the existing
- * connected clients and ensure that the out buffer is flushed.
+ * Flush the send queues of the connections written to since the last call,
+ * all the pending frames of a client go out with a single writev. A socket
+ * that can't take them all gets IOMUX_WRITE interest until it's drained, the
+ * writable event puts it back in the dirty list.
  */
 static void process_clients_replies(Tera_Context *ctx)
 {
     Connection_Data *cd = NULL;
     isize nsent         = 0;
-    for (usize i = 0; i < MAX_CLIENTS; ++i) {
-        cd = &ctx->connection_data[i];
+    for (usize i = 0; i < ctx->dirty_count; ++i) {
+        uint16 conn_id = ctx->dirty_connections[i];
+        cd             = &ctx->connection_data[conn_id];
+        cd->dirty      = false;
         if (!cd->connected)
             continue;
-        if (buffer_is_empty(&cd->send_buffer))
-            continue;
 
-        nsent = buffer_net_send(&cd->send_buffer, cd->socket_fd);
+        nsent = send_queue_net_flush(&cd->send_queue, cd->socket_fd);
+        connection_release_frames(ctx, cd);
         if (nsent < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                continue;
-
-            cd->socket_fd = -1;
-            cd->connected = false;
-            close(cd->socket_fd);
-            log_info(">>>>: Client disconnected");
+            shutdown_connection(ctx, conn_id);
+            continue;
         }
 
-        if (buffer_is_empty(&cd->send_buffer))
-            buffer_reset(&cd->send_buffer);
+        bool pending = !send_queue_is_empty(&cd->send_queue);
+        if (pending == cd->write_interest)
+            continue;
+
+        IO_Mux_Event events = pending ? IOMUX_READ | IOMUX_WRITE : IOMUX_READ;
+        if (iomux_mod(ctx->iomux, cd->socket_fd, events) == 0)
+            cd->write_interest = pending;
+        else
+            log_error(">>>>: iomux_mod() error: %s", strerror(errno));
     }
+
+    ctx->dirty_count = 0;
 }
 
+// Each free unlinks the head of the client's list, only its own subscriptions are visited
 static void free_client_subscriptions(Tera_Context *ctx, Client_Data *client)
 {
-    for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
-        if (!ctx->subscription_data[i].active)
-            continue;
-
-        if (ctx->subscription_data[i].client_id == client->conn_id)
-            ctx->subscription_data[i].active = false;
-    }
+    while (client->subscriptions != -1)
+        mqtt_subscription_free(ctx, client->subscriptions);
 }
 
 /**
- * Iterate through the published messages to ensure that they have
- * been correctly delivered
+ * A delivery went unacknowledged for MQTT_RETRY_TIMEOUT_MS, retry it, giving
+ * up after a number of attempts
  */
-static void process_delivery_timeouts(Tera_Context *ctx, int64 current_time)
+static void process_delivery_timeout(Tera_Context *ctx, uint16 delivery_id, uint32 current_time)
 {
-    for (usize i = 0; i < MAX_DELIVERY_MESSAGES; ++i) {
-        Message_Delivery *delivery = &ctx->message_deliveries[i];
+    Message_Delivery *delivery = &ctx->message_deliveries[delivery_id];
 
-        if (delivery->state == MSG_ACKNOWLEDGED || delivery->state == MSG_EXPIRED)
-            continue;
+    if (!delivery->active)
+        return;
 
-        if (delivery->next_retry_at > 0 && current_time >= delivery->next_retry_at) {
-            if (delivery->retry_count >= MQTT_MAX_RETRY_ATTEMPTS) {
-                delivery->state  = MSG_EXPIRED;
-                delivery->active = false;
-                mqtt_message_delivery_free(ctx, delivery->client_id, delivery->message_id);
-                mqtt_published_message_free(ctx, delivery->published_index);
-            } else {
-                delivery->retry_count++;
-                delivery->last_sent_at  = current_time;
-                delivery->next_retry_at = current_time + MQTT_RETRY_TIMEOUT_MS;
-                mqtt_publish_retry(ctx, delivery);
-            }
-        }
+    // The client went away in the meantime, there's no session to resume
+    bool live = connection_is_live(ctx, delivery->client_id, delivery->client_generation);
+
+    if (!live || delivery->retry_count >= MQTT_MAX_RETRY_ATTEMPTS) {
+        delivery->state  = MSG_EXPIRED;
+        delivery->active = false;
+        mqtt_message_delivery_free(ctx, delivery_id);
+        mqtt_published_message_free(ctx, delivery->published_index);
+    } else {
+        delivery->retry_count++;
+        delivery->last_sent_at = current_time;
+        timer_wheel_schedule(&ctx->timer_wheel, delivery_timer_id(delivery_id),
+                             MQTT_RETRY_TIMEOUT_MS);
+        mqtt_publish_retry(ctx, delivery);
     }
-    process_clients_replies(ctx);
 }
 
 /**
@@ -120,21 +170,45 @@ static void update_message_delivery(Tera_Context *ctx, uint16 client_id, int16 m
 {
     // Alternative implementation
     Message_Delivery *delivery = mqtt_message_delivery_find_existing(ctx, client_id, mid);
-    delivery->state            = new_state;
+    if (!delivery)
+        return;
+
+    uint16 delivery_id = delivery - ctx->message_deliveries;
+    delivery->state    = new_state;
 
     if (new_state == MSG_ACKNOWLEDGED) {
         delivery->active = false;
-        mqtt_message_delivery_free(ctx, delivery->client_id, delivery->message_id);
+        mqtt_message_delivery_free(ctx, delivery_id);
         mqtt_published_message_free(ctx, delivery->published_index);
+    } else {
+        // Intermediate QoS 2 step, the next one gets a full timeout
+        delivery->last_sent_at = current_millis_relative();
+        timer_wheel_schedule(&ctx->timer_wheel, delivery_timer_id(delivery_id),
+                             MQTT_RETRY_TIMEOUT_MS);
     }
 }
 
-static Transport_Result process_client_packets(Tera_Context *ctx, int fd)
+/*
+ * Keepalive deadline, one and a half times the interval set on CONNECT
+ * (MQTT-3.1.2-24), pushed forward each time bytes are received
+ */
+static void connection_keepalive_refresh(Tera_Context *ctx, uint16 conn_id)
+{
+    uint16 keepalive = ctx->client_data[conn_id].keepalive;
+
+    if (keepalive > 0)
+        timer_wheel_schedule(&ctx->timer_wheel, keepalive_timer_id(conn_id), keepalive * 1500);
+}
+
+static Transport_Result process_client_buffer(Tera_Context *ctx, uint16 conn_id);
+
+static Transport_Result process_client_packets(Tera_Context *ctx, uint16 conn_id)
 {
-    Client_Data *client    = &ctx->client_data[fd];
-    Connection_Data *cdata = &ctx->connection_data[fd];
+    Connection_Data *cdata = &ctx->connection_data[conn_id];
+    if (!connection_recv_acquire(ctx, cdata))
+        return TRANSPORT_DISCONNECT;
 
-    isize nread            = buffer_net_recv(&cdata->recv_buffer, cdata->socket_fd);
+    isize nread = buffer_net_recv(&cdata->recv_buffer, cdata->socket_fd);
     if (nread < 0) {
         // No data available right now
         if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -160,278 +234,822 @@ static Transport_Result process_client_packets(Tera_Context *ctx, int fd)
     if (nread == 0)
         return TRANSPORT_DISCONNECT;
 
-    Buffer *buf = &cdata->recv_buffer;
-
-    while (!buffer_is_empty(buf)) {
-
-        MQTT_Decode_Result result = MQTT_DECODE_SUCCESS;
+    return process_client_buffer(ctx, conn_id);
+}
 
-        // Check if we have at least fixed header (2 bytes minimum)
-        if (buffer_available(buf) < 2) {
-            log_debug(">>>>: Incomplete packet - need more data");
-            return TRANSPORT_INCOMPLETE_PACKET;
-        }
+/*
+ * Handle a single complete packet, the decoders only ever look at its payload.
+ * Returns TRANSPORT_DISCONNECT if the connection has to be closed.
+ */
+static Transport_Result process_packet(Tera_Context *ctx, uint16 conn_id, MQTT_Frame *frame)
+{
+    Client_Data *client       = &ctx->client_data[conn_id];
+    MQTT_Decode_Result result = MQTT_DECODE_SUCCESS;
 
-        /*
-         * MQTT Fixed header, according to official docs it's comprised of a single
-         * byte carrying:
-         * - opcode (packet type)
-         * - dup flag
-         * - QoS
-         * - retain flag
-         * It's followed by the remaining_len of the packet, encoded onto 1 to 4
-         * bytes starting at bytes 2.
-         *
-         * |   Bit      |  7  |  6  |  5  |  4  |  3  |  2  |  1  |   0    |
-         * |------------|-----------------------|--------------------------|
-         * | Byte 1     |      MQTT type 3      | dup |    QoS    | retain |
-         * |------------|--------------------------------------------------|
-         * | Byte 2     |                                                  |
-         * |   .        |               Remaining Length                   |
-         * |   .        |                                                  |
-         * | Byte 5     |                                                  |
-         * |------------|--------------------------------------------------|
-         */
-        uint8 header = *(cdata->recv_buffer.data + cdata->recv_buffer.read_pos);
-
-        switch (mqtt_type_get(header)) {
-        case CONNECT:
-            result = mqtt_connect_read(ctx, client);
-            switch (result) {
-            case MQTT_DECODE_SUCCESS:
-                mqtt_connack_write(ctx, client, CONNACK_SUCCESS);
-                break;
-            case MQTT_AUTH_ERROR:
-                mqtt_connack_write(ctx, client, CONNACK_NOT_AUTHORIZED);
-                break;
-            case MQTT_DECODE_INCOMPLETE:
-                return TRANSPORT_INCOMPLETE_PACKET;
-            case MQTT_DECODE_INVALID:
-                return TRANSPORT_DISCONNECT;
-            default:
-                // TODO missing cases
-                break;
-            }
-            break;
-        case DISCONNECT:
-            result = mqtt_disconnect_read(ctx, client);
-            if (result == MQTT_DECODE_SUCCESS)
-                free_client_subscriptions(ctx, client);
-            return TRANSPORT_DISCONNECT;
-        case SUBSCRIBE: {
-            Subscribe_Result sub_result = {0};
-            result                      = mqtt_subscribe_read(ctx, client, &sub_result);
-            if (result == MQTT_DECODE_SUCCESS)
-                mqtt_suback_write(ctx, client, &sub_result);
-            else if (result == MQTT_DECODE_INCOMPLETE)
-                return TRANSPORT_INCOMPLETE_PACKET;
-            break;
-        }
-        case UNSUBSCRIBE:
-            Subscribe_Result unsub_result = {0};
-            result                        = mqtt_unsubscribe_read(ctx, client, &unsub_result);
-            if (result == MQTT_DECODE_SUCCESS)
-                mqtt_unsuback_write(ctx, client, &unsub_result);
+    /*
+     * MQTT Fixed header, according to official docs it's comprised of a single
+     * byte carrying:
+     * - opcode (packet type)
+     * - dup flag
+     * - QoS
+     * - retain flag
+     * It's followed by the remaining_len of the packet, encoded onto 1 to 4
+     * bytes starting at bytes 2.
+     *
+     * |   Bit      |  7  |  6  |  5  |  4  |  3  |  2  |  1  |   0    |
+     * |------------|-----------------------|--------------------------|
+     * | Byte 1     |      MQTT type 3      | dup |    QoS    | retain |
+     * |------------|--------------------------------------------------|
+     * | Byte 2     |                                                  |
+     * |   .        |               Remaining Length                   |
+     * |   .        |                                                  |
+     * | Byte 5     |                                                  |
+     * |------------|--------------------------------------------------|
+     */
+    switch (frame->header.bits.type) {
+    case CONNECT:
+        result = mqtt_connect_read(ctx, client, frame);
+        switch (result) {
+        case MQTT_DECODE_SUCCESS:
+            mqtt_connack_write(ctx, client, CONNACK_SUCCESS);
+            connection_keepalive_refresh(ctx, conn_id);
             break;
-        case PUBLISH: {
-            uint16 index           = 0;
-            Published_Message *out = mqtt_published_message_find_free(ctx, &index);
-            if (out) {
-                result = mqtt_publish_read(ctx, client, out);
-                if (result == MQTT_DECODE_SUCCESS)
-                    mqtt_publish_fanout_write(ctx, client, out, index);
-                else if (result == MQTT_DECODE_INCOMPLETE)
-                    return TRANSPORT_INCOMPLETE_PACKET;
-            }
+        case MQTT_AUTH_ERROR:
+            mqtt_connack_write(ctx, client, CONNACK_NOT_AUTHORIZED);
             break;
-        }
-        case PUBACK: {
-            uint16 mid = 0;
-            mqtt_ack_read(ctx, client, &mid);
-            update_message_delivery(ctx, client->conn_id, mid, MSG_ACKNOWLEDGED);
+        case MQTT_DECODE_INVALID:
+            return TRANSPORT_DISCONNECT;
+        default:
+            // TODO missing cases
             break;
         }
-        case PUBREC: {
-            uint16 mid = 0;
-            result     = mqtt_ack_read(ctx, client, &mid);
-            if (result == MQTT_DECODE_SUCCESS) {
-                mqtt_ack_write(ctx, client, PUBREL, mid);
-                update_message_delivery(ctx, client->conn_id, mid, MSG_AWAITING_PUBCOMP);
-            }
+        break;
+    case DISCONNECT:
+        result = mqtt_disconnect_read(ctx, client, frame);
+        if (result == MQTT_DECODE_SUCCESS)
+            free_client_subscriptions(ctx, client);
+        return TRANSPORT_DISCONNECT;
+    case SUBSCRIBE: {
+        Subscribe_Result sub_result = {0};
+        result                      = mqtt_subscribe_read(ctx, client, frame, &sub_result);
+        if (result == MQTT_DECODE_INVALID)
+            return TRANSPORT_DISCONNECT;
+        if (result == MQTT_DECODE_SUCCESS)
+            mqtt_suback_write(ctx, client, &sub_result);
+        break;
+    }
+    case UNSUBSCRIBE: {
+        Subscribe_Result unsub_result = {0};
+        result                        = mqtt_unsubscribe_read(ctx, client, frame, &unsub_result);
+        if (result == MQTT_DECODE_INVALID)
+            return TRANSPORT_DISCONNECT;
+        if (result == MQTT_DECODE_SUCCESS)
+            mqtt_unsuback_write(ctx, client, &unsub_result);
+        break;
+    }
+    case PUBLISH: {
+        uint16 index           = 0;
+        Published_Message *out = mqtt_published_message_find_free(ctx, &index);
+        if (!out) {
+            log_warning(">>>>: No free published message slot, PUBLISH dropped");
             break;
         }
-        case PUBREL: {
-            uint16 mid = 0;
-            result     = mqtt_ack_read(ctx, client, &mid);
-            if (result == MQTT_DECODE_SUCCESS) {
-                mqtt_ack_write(ctx, client, PUBCOMP, mid);
-                update_message_delivery(ctx, client->conn_id, mid, MSG_ACKNOWLEDGED);
-            }
+
+        Topic_Levels levels;
+        result = mqtt_publish_read(ctx, client, frame, out, &levels);
+        if (result == MQTT_DECODE_SUCCESS) {
+            mqtt_publish_fanout_write(ctx, client, out, index, &levels);
             break;
         }
-        case PUBCOMP: {
-            uint16 mid = 0;
-            mqtt_ack_read(ctx, client, &mid);
+
+        // Gives back whatever the partial decode got hold of
+        mqtt_published_message_free(ctx, index);
+        if (result == MQTT_DECODE_INVALID)
+            return TRANSPORT_DISCONNECT;
+        break;
+    }
+    case PUBACK: {
+        uint16 mid = 0;
+        result     = mqtt_ack_read(ctx, client, frame, &mid);
+        if (result == MQTT_DECODE_SUCCESS)
             update_message_delivery(ctx, client->conn_id, mid, MSG_ACKNOWLEDGED);
-            break;
+        break;
+    }
+    case PUBREC: {
+        uint16 mid = 0;
+        result     = mqtt_ack_read(ctx, client, frame, &mid);
+        if (result == MQTT_DECODE_SUCCESS) {
+            mqtt_ack_write(ctx, client, PUBREL, mid);
+            update_message_delivery(ctx, client->conn_id, mid, MSG_AWAITING_PUBCOMP);
         }
-        case PINGREQ:
-            result = mqtt_pingreq_read(ctx, client);
-            if (result == MQTT_DECODE_SUCCESS)
-                mqtt_pingresp_write(ctx, client);
-            break;
-        default:
-            log_error(">>>>: Unknown packet received %d (%ld)", mqtt_type_get(header), nread);
-            return TRANSPORT_INCOMPLETE_PACKET;
+        break;
+    }
+    case PUBREL: {
+        uint16 mid = 0;
+        result     = mqtt_ack_read(ctx, client, frame, &mid);
+        if (result == MQTT_DECODE_SUCCESS) {
+            mqtt_ack_write(ctx, client, PUBCOMP, mid);
+            update_message_delivery(ctx, client->conn_id, mid, MSG_ACKNOWLEDGED);
         }
+        break;
+    }
+    case PUBCOMP: {
+        uint16 mid = 0;
+        result     = mqtt_ack_read(ctx, client, frame, &mid);
+        if (result == MQTT_DECODE_SUCCESS)
+            update_message_delivery(ctx, client->conn_id, mid, MSG_ACKNOWLEDGED);
+        break;
+    }
+    case PINGREQ:
+        result = mqtt_pingreq_read(ctx, client, frame);
+        if (result == MQTT_DECODE_SUCCESS)
+            mqtt_pingresp_write(ctx, client);
+        break;
+    default:
+        log_error(">>>>: Unknown packet received %d (%u)", frame->header.bits.type,
+                  frame->size);
+        return TRANSPORT_DISCONNECT;
     }
 
     return TRANSPORT_SUCCESS;
 }
 
-static void add_connection(Tera_Context *ctx, int fd)
+// Packets whose relative order doesn't matter, handled in the grouped passes
+static inline bool packet_batchable(uint8 type)
 {
-    // Already registered
-    if (ctx->connection_data[fd].socket_fd > 0)
-        return;
+    return type == PUBLISH || type == PUBACK || type == PUBREC || type == PUBREL ||
+           type == PUBCOMP || type == PINGREQ;
+}
 
-    // TODO relying on file descriptor uniqueness is poor logic
-    //      think of a better approach
-    ctx->connection_data[fd].socket_fd = fd;
-    ctx->client_data[fd].conn_id       = fd;
+/*
+ * Run the grouped passes over the pending descriptors, acks first as they
+ * only release state, then the PUBLISH fanouts and the pings last. A client
+ * can't ack a packet it didn't receive yet, so reordering them against its
+ * PUBLISH within a read doesn't change anything it can observe.
+ */
+static Transport_Result process_packet_batch(Tera_Context *ctx)
+{
+    static const uint8 pass_types[] = {PUBACK, PUBREC, PUBREL, PUBCOMP, PUBLISH, PINGREQ};
+
+    Packet_Batch *batch     = &ctx->packet_batch;
+    Transport_Result result = TRANSPORT_SUCCESS;
+    MQTT_Frame frame        = {0};
 
-    void *read_buf                     = arena_alloc(&io_arena, MAX_PACKET_SIZE);
-    if (!read_buf)
-        log_critical(">>>>: bump arena OOM");
-    buffer_init(&ctx->connection_data[fd].recv_buffer, read_buf, MAX_PACKET_SIZE);
+    if (batch->count == 0)
+        return TRANSPORT_SUCCESS;
+
+    for (usize pass = 0; pass < sizeof(pass_types) && result == TRANSPORT_SUCCESS; ++pass) {
+        for (uint16 i = 0; i < batch->count; ++i) {
+            const Packet_Desc *desc = &batch->packets[i];
+            if (desc->header >> 4 != pass_types[pass])
+                continue;
 
-    void *write_buf = arena_alloc(&io_arena, MAX_PACKET_SIZE);
-    if (!write_buf)
-        log_critical(">>>>: bump arena OOM");
-    buffer_init(&ctx->connection_data[fd].send_buffer, write_buf, MAX_PACKET_SIZE);
+            Buffer *buf                   = &ctx->connection_data[desc->conn_id].recv_buffer;
+            frame.header.byte             = desc->header;
+            frame.header.remaining_length = desc->length;
+            buffer_init(&frame.payload, buf->data + desc->offset, desc->length);
+            frame.payload.write_pos = desc->length;
+
+            result = process_packet(ctx, desc->conn_id, &frame);
+            if (result != TRANSPORT_SUCCESS)
+                break;
+        }
+    }
+
+    Pipeline_Stats *stats = &ctx->pipeline_stats;
+    stats->batches++;
+    stats->batched += batch->count;
+    if (batch->count > stats->max_batch)
+        stats->max_batch = batch->count;
+
+    batch->count = 0;
+
+    return result;
 }
 
-static void shutdown_connection(Tera_Context *ctx, int fd)
+/*
+ * Decode and handle all the complete packets sitting in the receive buffer
+ * of a connection, regardless of how the bytes got there (readiness based
+ * recv or a completion from the io_uring backend).
+ *
+ * A partial packet left at the end stays where it is, the next bytes are
+ * appended after it. It's moved to the start of the buffer only when it
+ * couldn't complete in the room left, so most reads don't copy anything.
+ * Returns TRANSPORT_INCOMPLETE_PACKET if such a packet is pending.
+ */
+static Transport_Result process_client_buffer(Tera_Context *ctx, uint16 conn_id)
 {
-    for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
-        if (ctx->subscription_data[i].client_id == fd)
-            ctx->subscription_data[i].active = false;
+    Buffer *buf                = &ctx->connection_data[conn_id].recv_buffer;
+    Packet_Batch *batch        = &ctx->packet_batch;
+    MQTT_Frame frame           = {0};
+    MQTT_Decode_Result framing = MQTT_DECODE_SUCCESS;
+    Transport_Result result    = TRANSPORT_SUCCESS;
+    uint32 packets             = 0;
+
+    connection_keepalive_refresh(ctx, conn_id);
+
+    while (result == TRANSPORT_SUCCESS &&
+           (framing = mqtt_frame_next(buf, &frame)) == MQTT_DECODE_SUCCESS) {
+        packets++;
+
+        if (ctx->pipeline == PIPELINE_PACKET) {
+            result = process_packet(ctx, conn_id, &frame);
+            continue;
+        }
+
+        if (packet_batchable(frame.header.bits.type)) {
+            batch->packets[batch->count++] = (Packet_Desc){
+                .offset  = frame.payload.data - buf->data,
+                .length  = frame.header.remaining_length,
+                .conn_id = conn_id,
+                .header  = frame.header.byte,
+            };
+            if (batch->count == MAX_PACKET_BATCH)
+                result = process_packet_batch(ctx);
+            continue;
+        }
+
+        // Anything else may depend on the packets before it
+        result = process_packet_batch(ctx);
+        if (result == TRANSPORT_SUCCESS)
+            result = process_packet(ctx, conn_id, &frame);
+    }
+
+    // The descriptors point into the buffer, done with them before it moves
+    if (result == TRANSPORT_SUCCESS)
+        result = process_packet_batch(ctx);
+    else
+        batch->count = 0;
+
+    if (packets > 0) {
+        ctx->pipeline_stats.reads++;
+        ctx->pipeline_stats.packets += packets;
+    }
+
+    if (result != TRANSPORT_SUCCESS)
+        return result;
+
+    if (framing == MQTT_DECODE_ERROR) {
+        log_error(">>>>: Malformed remaining length");
+        return TRANSPORT_DISCONNECT;
+    } else if (framing == MQTT_DECODE_OUT_OF_BOUNDS) {
+        log_error(">>>>: Packet exceeds the receive buffer size");
+        return TRANSPORT_DISCONNECT;
+    }
+
+    if (buffer_is_empty(buf)) {
+        buffer_reset(buf);
+        return TRANSPORT_SUCCESS;
     }
-    ctx->connection_data[fd].socket_fd = -1;
-    ctx->connection_data[fd].connected = false;
+
+    // Until the remaining length is in, the fixed header is the least it needs
+    usize needed = frame.size > 0 ? frame.size : sizeof(uint8) + MAX_VARIABLE_LENGTH_BYTES;
+    if (buf->read_pos + needed > buf->size)
+        buffer_compact(buf);
+
+    return TRANSPORT_INCOMPLETE_PACKET;
+}
+
+/*
+ * Register a new socket in the first free connection slot, returns the
+ * connection id or -1 if the broker is at capacity.
+ */
+static int32 add_connection(Tera_Context *ctx, int fd)
+{
+    int32 conn_id = connection_open(ctx, fd);
+    if (conn_id < 0)
+        return -1;
+
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+    cd->send_inflight   = false;
+    cd->write_interest  = false;
+
+    ctx->client_data[conn_id].conn_id       = conn_id;
+    ctx->client_data[conn_id].keepalive     = 0;
+    ctx->client_data[conn_id].subscriptions = -1;
+
+    // Buffers are taken from the io pool on the first bytes in either direction
+    buffer_init(&cd->recv_buffer, NULL, 0);
+    send_queue_init(&cd->send_queue, ctx->io_pool);
+
+    return conn_id;
+}
+
+static void shutdown_connection(Tera_Context *ctx, uint16 conn_id)
+{
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+    int fd              = cd->socket_fd;
+
+    send_queue_discard(&cd->send_queue);
+    connection_release_frames(ctx, cd);
+    connection_recv_release(ctx, cd);
+    free_client_subscriptions(ctx, &ctx->client_data[conn_id]);
+    timer_wheel_cancel(&ctx->timer_wheel, keepalive_timer_id(conn_id));
+    connection_close(ctx, conn_id);
+    if (ctx->ring)
+        // Wakes up the armed multishot receive, late completions carry the
+        // old generation and get discarded
+        shutdown(fd, SHUT_RDWR);
+    else
+        iomux_del(ctx->iomux, fd);
     close(fd);
     log_info(">>>>: Client disconnected");
 }
 
+/*
+ * Drain the listen backlog, the listener is non-blocking so keep accepting
+ * until EAGAIN, a single readiness notification can stand for many pending
+ * connections.
+ */
+static void accept_connections(Tera_Context *ctx, int serverfd)
+{
+    Transport_Result err = 0;
+
+    while (1) {
+        int clientfd = net_tcp_accept(serverfd, 1);
+        if (clientfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error(">>>>: accept() error: %s", strerror(errno));
+            return;
+        }
+
+        if (connection_lookup(ctx, clientfd) >= 0) {
+            log_warning(">>>>: Client connecting on an open socket");
+            continue;
+        }
+
+        if (iomux_add(ctx->iomux, clientfd, IOMUX_READ) < 0) {
+            log_error(">>>>: iomux_add() error: %s", strerror(errno));
+            close(clientfd);
+            continue;
+        }
+
+        int32 conn_id = add_connection(ctx, clientfd);
+        if (conn_id < 0) {
+            log_warning(">>>>: Connection limit reached, rejecting client");
+            iomux_del(ctx->iomux, clientfd);
+            close(clientfd);
+            continue;
+        }
+
+        log_info(">>>>: New client connected");
+
+        err = process_client_packets(ctx, conn_id);
+        if (err == TRANSPORT_DISCONNECT)
+            shutdown_connection(ctx, conn_id);
+        else
+            connection_recv_idle(ctx, &ctx->connection_data[conn_id]);
+    }
+}
+
+/*
+ * Run the local fanout of all the PUBLISH forwarded by the other shards since
+ * the last wakeup.
+ */
+static void process_shard_inbox(Tera_Context *ctx)
+{
+    Shard_Router *router     = ctx->router;
+    const Shard_Message *msg = NULL;
+
+    shard_wakeup_ack(router, ctx->shard_id);
+
+    for (uint16 source = 0; source < router->shard_count; ++source) {
+        if (source == ctx->shard_id)
+            continue;
+
+        while ((msg = shard_ring_peek(router, source, ctx->shard_id))) {
+            mqtt_publish_fanout_shard(ctx, msg);
+            shard_ring_release(router, source, ctx->shard_id);
+        }
+    }
+}
+
+/*
+ * Log the receive pipeline counters of the worker, cumulative since startup
+ * so that runs in the two modes can be compared over the same traffic, and
+ * the match cache ones to size it against the topics in use.
+ */
+static void report_stats(Tera_Context *ctx)
+{
+    const Pipeline_Stats *stats    = &ctx->pipeline_stats;
+    const Match_Cache_Stats *cache = &ctx->match_cache_stats;
+    uint64 lookups                 = cache->hits + cache->misses;
+
+    if (stats->reads > 0) {
+        log_info(">>>>: Pipeline %s shard %u: %llu packets in %llu reads (%.2f per read), "
+                 "%llu batched in %llu passes (%.2f per batch, max %u)",
+                 ctx->pipeline == PIPELINE_BATCH ? "batch" : "packet", ctx->shard_id,
+                 (unsigned long long)stats->packets, (unsigned long long)stats->reads,
+                 (double)stats->packets / stats->reads, (unsigned long long)stats->batched,
+                 (unsigned long long)stats->batches,
+                 stats->batches > 0 ? (double)stats->batched / stats->batches : 0.0,
+                 stats->max_batch);
+    }
+
+    if (lookups > 0) {
+        log_info(">>>>: Match cache shard %u: %llu hits, %llu misses (%.2f%% hit rate), "
+                 "%llu evictions, %llu uncacheable",
+                 ctx->shard_id, (unsigned long long)cache->hits,
+                 (unsigned long long)cache->misses, 100.0 * cache->hits / lookups,
+                 (unsigned long long)cache->evictions, (unsigned long long)cache->uncacheable);
+    }
+
+    timer_wheel_schedule(&ctx->timer_wheel, stats_timer_id(), ctx->pipeline_stats_ms);
+}
+
+/*
+ * Timers due since the last wakeup, some clients may fail to acknowledge
+ * the PUBLISH messages, the reason can be anything, network faults
+ * among the most common, a number of attempts is retried before finally
+ * giving up. Clients silent for longer than their keepalive are dropped.
+ * The pipeline and match cache stats are reported on their own timer.
+ * Returns the time to wait before the next timer is due, -1 if none is armed.
+ */
+static time_t process_timers(Tera_Context *ctx)
+{
+    uint32 current_time = current_millis_relative();
+    int32 id            = 0;
+
+    timer_wheel_advance(&ctx->timer_wheel, current_time);
+
+    while ((id = timer_wheel_next_expired(&ctx->timer_wheel)) != -1) {
+        if (id < MAX_DELIVERY_MESSAGES) {
+            process_delivery_timeout(ctx, id, current_time);
+        } else if ((uint32)id == stats_timer_id()) {
+            report_stats(ctx);
+        } else {
+            log_info(">>>>: Client keepalive expired");
+            shutdown_connection(ctx, id - MAX_DELIVERY_MESSAGES);
+        }
+    }
+
+    return timer_wheel_timeout(&ctx->timer_wheel, current_time);
+}
+
 static int server_start(Tera_Context *ctx, int serverfd)
 {
-    int numevents          = 0;
-    Transport_Result err   = 0;
-    time_t current_time    = 0;
-    time_t check_delta     = 0;
-    time_t last_check      = 0;
-    time_t resend_check_ms = MQTT_RETRANSMISSION_CHECK_MS;
+    int numevents        = 0;
+    Transport_Result err = 0;
+    time_t timeout_ms    = -1;
+    int wakeupfd         = ctx->router ? shard_wakeup_fd(ctx->router, ctx->shard_id) : -1;
 
     iomux_add(ctx->iomux, serverfd, IOMUX_READ);
+    if (wakeupfd >= 0)
+        iomux_add(ctx->iomux, wakeupfd, IOMUX_READ);
 
     while (1) {
-        numevents = iomux_wait(ctx->iomux, resend_check_ms);
+        numevents = iomux_wait(ctx->iomux, timeout_ms);
         if (numevents < 0)
             log_critical(">>>>: iomux error: %s", strerror(errno));
 
+        // Timers armed while handling the events are relative to the wakeup
+        timer_wheel_advance(&ctx->timer_wheel, current_millis_relative());
+
         for (int i = 0; i < numevents; ++i) {
-            int fd = iomux_get_event_fd(ctx->iomux, i);
+            int fd        = iomux_get_event_fd(ctx->iomux, i);
+            int32 conn_id = -1;
 
             if (fd == serverfd) {
-                // New connection
-                int clientfd = net_tcp_accept(serverfd, 1);
-                if (clientfd < 0) {
-                    log_error(">>>>: accept() error: %s", strerror(errno));
+                accept_connections(ctx, serverfd);
+            } else if (fd == wakeupfd) {
+                process_shard_inbox(ctx);
+            } else if ((conn_id = connection_lookup(ctx, fd)) >= 0) {
+                IO_Mux_Event events = iomux_get_event_flags(ctx->iomux, i);
+                // Writable again after a partial flush, resumed with the others below
+                if (events & IOMUX_WRITE)
+                    connection_mark_dirty(ctx, conn_id);
+                if (!(events & IOMUX_READ))
                     continue;
-                }
 
-                if (ctx->connection_data[clientfd].socket_fd == clientfd) {
-                    log_warning(">>>>: Client connecting on an open socket");
-                    continue;
-                }
+                err = process_client_packets(ctx, conn_id);
+                if (err == TRANSPORT_DISCONNECT)
+                    shutdown_connection(ctx, conn_id);
+                else
+                    connection_recv_idle(ctx, &ctx->connection_data[conn_id]);
+            }
+        }
 
-                log_info(">>>>: New client connected");
-                iomux_add(ctx->iomux, clientfd, IOMUX_READ);
-                add_connection(ctx, clientfd);
+        timeout_ms = process_timers(ctx);
 
-                err = process_client_packets(ctx, clientfd);
-                if (err == TRANSPORT_DISCONNECT) {
-                    shutdown_connection(ctx, fd);
-                    continue;
-                } else if (err == TRANSPORT_INCOMPLETE_PACKET) {
-                    continue;
-                } else {
-                    buffer_reset(&ctx->connection_data[clientfd].recv_buffer);
-                }
+        /*
+         * Write out to clients, once all the ready descriptors of this
+         * wakeup have been processed in.
+         * Just send out all frames queued for the clients written to.
+         */
+        process_clients_replies(ctx);
+    }
 
-            } else if (ctx->connection_data[fd].socket_fd == fd) {
-                err = process_client_packets(ctx, fd);
-                if (err == TRANSPORT_DISCONNECT) {
-                    shutdown_connection(ctx, fd);
-                    continue;
-                } else if (err == TRANSPORT_INCOMPLETE_PACKET) {
-                    continue;
-                } else {
-                    buffer_reset(&ctx->connection_data[fd].recv_buffer);
-                }
-            }
+    iomux_free(ctx->iomux);
+    close(serverfd);
 
-            /*
-             * Write out to clients, after a full packet has been processed in.
-             * Just send out all bytes stored in the reply buffer of each connected client.
-             */
-            process_clients_replies(ctx);
+    return 0;
+}
+
+// ====================== io_uring event loop ========================
+
+/*
+ * Queue a sendmsg for every dirty connection with no send already in flight,
+ * they'll all be submitted in one go by the next uring_wait. Connections with
+ * a send in flight are picked up again by its completion.
+ */
+static void uring_flush_replies(Tera_Context *ctx)
+{
+    Connection_Data *cd = NULL;
+    for (usize i = 0; i < ctx->dirty_count; ++i) {
+        cd        = &ctx->connection_data[ctx->dirty_connections[i]];
+        cd->dirty = false;
+        if (!cd->connected || cd->send_inflight)
+            continue;
+        if (send_queue_is_empty(&cd->send_queue))
+            continue;
+
+        cd->send_msg = (struct msghdr){
+            .msg_iov    = cd->send_iov,
+            .msg_iovlen = send_queue_iovecs(&cd->send_queue, cd->send_iov, SEND_QUEUE_IOV_MAX)};
+
+        if (uring_sendmsg(ctx->ring, cd->socket_fd, cd->generation, &cd->send_msg) == 0)
+            cd->send_inflight = true;
+    }
+
+    ctx->dirty_count = 0;
+}
+
+/*
+ * Resolve the connection a completion belongs to, -1 if it went away since
+ * the request was submitted, even if a new connection got the same
+ * descriptor meanwhile.
+ */
+static int32 uring_event_connection(const Tera_Context *ctx, const Uring_Event *event)
+{
+    int32 conn_id = connection_lookup(ctx, event->fd);
+    if (conn_id < 0)
+        return -1;
+
+    const Connection_Data *cd = &ctx->connection_data[conn_id];
+    return (cd->generation & 0xFFFFFF) == event->generation ? conn_id : -1;
+}
+
+static void uring_handle_accept(Tera_Context *ctx, const Uring_Event *event)
+{
+    int clientfd = event->res;
+    if (clientfd < 0) {
+        log_error(">>>>: accept() error: %s", strerror(-clientfd));
+        return;
+    }
+
+    int32 conn_id = add_connection(ctx, clientfd);
+    if (conn_id < 0) {
+        log_warning(">>>>: Connection limit reached, rejecting client");
+        close(clientfd);
+        return;
+    }
+
+    log_info(">>>>: New client connected");
+    uring_recv_multishot(ctx->ring, clientfd, ctx->connection_data[conn_id].generation);
+}
+
+static void uring_handle_recv(Tera_Context *ctx, const Uring_Event *event)
+{
+    int32 conn_id = uring_event_connection(ctx, event);
+    if (conn_id < 0) {
+        uring_buffer_release(ctx->ring, event->buffer_id);
+        return;
+    }
+
+    Connection_Data *cdata = &ctx->connection_data[conn_id];
+
+    if (event->res <= 0) {
+        // Out of provided buffers, the multishot receive got terminated but
+        // the connection is still fine, just re-arm it
+        if (event->res == -ENOBUFS) {
+            uring_recv_multishot(ctx->ring, event->fd, cdata->generation);
+            return;
         }
+        shutdown_connection(ctx, conn_id);
+        return;
+    }
 
-        // Periodic check for deliveries, some clients may fail to acknowledge
-        // the PUBLISH messages, the reason can be anything, network faults
-        // among the most common. This check ensure that a number of attempts
-        // is retried before finally giving up.
-        current_time = current_millis_relative();
-        check_delta  = current_time - last_check;
-        if (check_delta >= resend_check_ms) {
-            process_delivery_timeouts(ctx, current_time);
-            last_check      = current_time;
-            resend_check_ms = MQTT_RETRANSMISSION_CHECK_MS;
-        } else {
-            resend_check_ms = MQTT_RETRANSMISSION_CHECK_MS - check_delta;
+    if (!connection_recv_acquire(ctx, cdata)) {
+        uring_buffer_release(ctx->ring, event->buffer_id);
+        shutdown_connection(ctx, conn_id);
+        return;
+    }
+
+    // A completion can carry more than the room left after a partial packet,
+    // copy what fits and decode until it's all in
+    Buffer *buf          = &cdata->recv_buffer;
+    const uint8 *data    = event->data;
+    uint32 left          = event->res;
+    Transport_Result err = TRANSPORT_SUCCESS;
+
+    while (left > 0 && err != TRANSPORT_DISCONNECT) {
+        uint32 room  = buf->size - buf->write_pos;
+        uint32 chunk = left < room ? left : room;
+        buffer_write(buf, data, chunk);
+        data += chunk;
+        left -= chunk;
+        err = process_client_buffer(ctx, conn_id);
+    }
+
+    uring_buffer_release(ctx->ring, event->buffer_id);
+    if (err == TRANSPORT_DISCONNECT) {
+        shutdown_connection(ctx, conn_id);
+        return;
+    }
+
+    connection_recv_idle(ctx, cdata);
+
+    if (!event->more)
+        uring_recv_multishot(ctx->ring, event->fd, cdata->generation);
+}
+
+static void uring_handle_send(Tera_Context *ctx, const Uring_Event *event)
+{
+    int32 conn_id = uring_event_connection(ctx, event);
+    if (conn_id < 0)
+        return;
+
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+    cd->send_inflight   = false;
+
+    if (event->res < 0 && event->res != -EAGAIN) {
+        shutdown_connection(ctx, conn_id);
+        return;
+    }
+
+    if (event->res > 0) {
+        send_queue_consume(&cd->send_queue, event->res);
+        connection_release_frames(ctx, cd);
+    }
+
+    if (send_queue_is_empty(&cd->send_queue))
+        return;
+
+    // Short send or more frames queued meanwhile, resume once it's writable again
+    if (uring_poll_writable(ctx->ring, event->fd, cd->generation) == 0)
+        cd->send_inflight = true;
+}
+
+static int server_start_uring(Tera_Context *ctx, int serverfd)
+{
+    int numevents     = 0;
+    Uring_Event event = {0};
+    time_t timeout_ms = -1;
+    int wakeupfd      = ctx->router ? shard_wakeup_fd(ctx->router, ctx->shard_id) : -1;
+
+    uring_accept_multishot(ctx->ring, serverfd);
+    if (wakeupfd >= 0)
+        uring_poll_readable(ctx->ring, wakeupfd, 0);
+
+    while (1) {
+        // Submissions (sends, re-armed receives) and completions share the
+        // same io_uring_enter
+        numevents = uring_wait(ctx->ring, timeout_ms);
+        if (numevents < 0)
+            log_critical(">>>>: io_uring error: %s", strerror(errno));
+
+        timer_wheel_advance(&ctx->timer_wheel, current_millis_relative());
+
+        while (uring_next_event(ctx->ring, &event)) {
+            switch (event.op) {
+            case URING_ACCEPT:
+                uring_handle_accept(ctx, &event);
+                if (!event.more)
+                    uring_accept_multishot(ctx->ring, serverfd);
+                break;
+            case URING_RECV:
+                uring_handle_recv(ctx, &event);
+                break;
+            case URING_SEND:
+                uring_handle_send(ctx, &event);
+                break;
+            case URING_POLL_WRITE: {
+                int32 conn_id = uring_event_connection(ctx, &event);
+                if (conn_id >= 0) {
+                    ctx->connection_data[conn_id].send_inflight = false;
+                    connection_mark_dirty(ctx, conn_id);
+                }
+                break;
+            }
+            case URING_POLL_READ:
+                if (event.fd == wakeupfd) {
+                    process_shard_inbox(ctx);
+                    uring_poll_readable(ctx->ring, wakeupfd, 0);
+                }
+                break;
+            }
         }
+
+        timeout_ms = process_timers(ctx);
+
+        uring_flush_replies(ctx);
     }
 
-    iomux_free(ctx->iomux);
+    uring_free(ctx->ring);
     close(serverfd);
 
     return 0;
 }
 
-static inline usize broker_memory(void)
+static void *worker_run(void *arg)
 {
-    return sizeof(Tera_Context) + context.io_arena->size + context.topic_arena->size +
-           context.client_arena->size + context.message_arena->size;
+    Tera_Worker *worker = arg;
+
+    if (worker->context.ring)
+        server_start_uring(&worker->context, worker->serverfd);
+    else
+        server_start(&worker->context, worker->serverfd);
+
+    return NULL;
+}
+
+static inline usize broker_memory(int worker_count)
+{
+    // Arenas backing memory is embedded in each worker
+    return worker_count * sizeof(Tera_Worker);
 }
 
 #define DEFAULT_HOST "127.0.0.1"
 #define DEFAULT_PORT 16768
 
-int main(void)
+int main(int argc, char **argv)
 {
     init_boot_time();
+    topic_scan_init();
+    utf8_init();
     config_set_default();
-    tera_context_init(&context);
+    if (argc > 1 && config_load(argv[1]) < 0)
+        log_warning(">>>>: Unable to read config file %s", argv[1]);
+
+    int worker_count = config_get_int("workers");
+    if (worker_count < 1) {
+        worker_count = 1;
+    } else if (worker_count > MAX_WORKERS) {
+        log_warning(">>>>: Too many workers, capping to %d", MAX_WORKERS);
+        worker_count = MAX_WORKERS;
+    }
+
+    // Zeroed on demand by the OS, pages are only touched as they get used
+    Tera_Worker *workers = calloc(worker_count, sizeof(Tera_Worker));
+    if (!workers)
+        log_critical(">>>>: Unable to allocate %d workers", worker_count);
+
+    Shard_Router *router = NULL;
+    if (worker_count > 1) {
+        router = shard_router_create(worker_count);
+        if (!router)
+            log_critical(">>>>: Unable to create the shard router");
+    }
+
+    const char *io_backend = config_get("io_backend");
+    bool use_uring         = io_backend && strncasecmp(io_backend, "uring", MAX_VALUE_SIZE) == 0;
+
+    const char *pipeline   = config_get("pipeline");
+    bool use_batch         = pipeline && strncasecmp(pipeline, "batch", MAX_VALUE_SIZE) == 0;
+    int stats_interval     = config_get_int("pipeline_stats");
+
+    for (int i = 0; i < worker_count; ++i) {
+        Tera_Context *ctx = &workers[i].context;
+
+        tera_context_init(ctx, &workers[i].memory);
+        ctx->router   = router;
+        ctx->shard_id = i;
+        ctx->pipeline = use_batch ? PIPELINE_BATCH : PIPELINE_PACKET;
 
-    log_info(">>>>: Memory at boot-up: %.2fMB", ((float)broker_memory() / (float)(1024 * 1024)));
+        if (stats_interval > 0) {
+            ctx->pipeline_stats_ms = stats_interval * 1000;
+            timer_wheel_schedule(&ctx->timer_wheel, stats_timer_id(), ctx->pipeline_stats_ms);
+        }
+
+        if (use_uring) {
+            void *ring_buffers = arena_alloc(ctx->io_arena, URING_BUFFER_COUNT * MAX_PACKET_SIZE);
+            if (!ring_buffers)
+                log_critical(">>>>: bump arena OOM");
+            ctx->ring =
+                uring_create(URING_ENTRIES, ring_buffers, MAX_PACKET_SIZE, URING_BUFFER_COUNT);
+            if (!ctx->ring)
+                log_warning(">>>>: io_uring not available, falling back to iomux");
+        }
+
+        // Every worker owns a listener on the same address, with more than
+        // one the kernel spreads the incoming connections across them
+        workers[i].serverfd = net_tcp_listen(DEFAULT_HOST, DEFAULT_PORT, 1, worker_count > 1);
+        if (workers[i].serverfd < 0)
+            return -1;
+    }
+
+    log_info(">>>>: Memory at boot-up: %.2fMB",
+             ((float)broker_memory(worker_count) / (float)(1024 * 1024)));
     log_info(">>>>: Settings");
     config_print();
 
-    int serverfd = net_tcp_listen(DEFAULT_HOST, DEFAULT_PORT, 1);
-    if (serverfd < 0)
-        return -1;
+    for (int i = 1; i < worker_count; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0)
+            log_critical(">>>>: Unable to start worker %d", i);
+    }
+
+    // The main thread runs the first shard
+    worker_run(&workers[0]);
 
-    server_start(&context, serverfd);
     return 0;
 }
@@ -0,0 +1,132 @@
+#include "shard.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static inline Shard_Ring *ring_at(Shard_Router *router, uint16 source, uint16 destination)
+{
+    return &router->rings[source * router->shard_count + destination];
+}
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Shard_Router *shard_router_create(uint16 shard_count)
+{
+    if (shard_count == 0 || shard_count > MAX_WORKERS)
+        return NULL;
+
+    Shard_Router *router = calloc(1, sizeof(Shard_Router));
+    if (!router)
+        return NULL;
+
+    router->shard_count = shard_count;
+    router->rings       = calloc((usize)shard_count * shard_count, sizeof(Shard_Ring));
+    if (!router->rings) {
+        free(router);
+        return NULL;
+    }
+
+    for (uint16 i = 0; i < shard_count; ++i) {
+        atomic_init(&router->subscriptions[i], 0);
+        atomic_init(&router->wakeup_pending[i], false);
+        router->wakeup_fds[i][0] = -1;
+        router->wakeup_fds[i][1] = -1;
+        if (pipe(router->wakeup_fds[i]) < 0 || set_nonblocking(router->wakeup_fds[i][0]) < 0 ||
+            set_nonblocking(router->wakeup_fds[i][1]) < 0) {
+            shard_router_free(router);
+            return NULL;
+        }
+    }
+
+    for (usize i = 0; i < (usize)shard_count * shard_count; ++i) {
+        atomic_init(&router->rings[i].head, 0);
+        atomic_init(&router->rings[i].tail, 0);
+    }
+
+    return router;
+}
+
+void shard_router_free(Shard_Router *router)
+{
+    for (uint16 i = 0; i < router->shard_count; ++i) {
+        if (router->wakeup_fds[i][0] >= 0)
+            close(router->wakeup_fds[i][0]);
+        if (router->wakeup_fds[i][1] >= 0)
+            close(router->wakeup_fds[i][1]);
+    }
+    free(router->rings);
+    free(router);
+}
+
+Shard_Message *shard_ring_reserve(Shard_Router *router, uint16 source, uint16 destination)
+{
+    Shard_Ring *ring = ring_at(router, source, destination);
+    uint32 tail      = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32 head      = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail - head >= SHARD_RING_SIZE)
+        return NULL;
+
+    return &ring->slots[tail & (SHARD_RING_SIZE - 1)];
+}
+
+void shard_ring_commit(Shard_Router *router, uint16 source, uint16 destination)
+{
+    Shard_Ring *ring = ring_at(router, source, destination);
+    uint32 tail      = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+
+    // Pairs with the fence of shard_wakeup_ack, the tail store must be visible
+    // before the flag is read, release alone lets the load pass the store
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // Only the first producer to find the destination idle pays for the write
+    if (!atomic_exchange_explicit(&router->wakeup_pending[destination], true,
+                                  memory_order_seq_cst)) {
+        if (write(router->wakeup_fds[destination][1], "w", 1) < 0) {
+            // Pipe full means a wakeup is already pending anyway
+        }
+    }
+}
+
+const Shard_Message *shard_ring_peek(Shard_Router *router, uint16 source, uint16 destination)
+{
+    Shard_Ring *ring = ring_at(router, source, destination);
+    uint32 head      = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32 tail      = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+
+    return &ring->slots[head & (SHARD_RING_SIZE - 1)];
+}
+
+void shard_ring_release(Shard_Router *router, uint16 source, uint16 destination)
+{
+    Shard_Ring *ring = ring_at(router, source, destination);
+    uint32 head      = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void shard_wakeup_ack(Shard_Router *router, uint16 shard)
+{
+    uint8 drain[64];
+    while (read(router->wakeup_fds[shard][0], drain, sizeof(drain)) > 0)
+        ;
+
+    // Cleared before the rings are drained, a message committed from now on
+    // will either be seen by the drain or trigger a new wakeup. The fence keeps
+    // the tail loads of the drain from being done before the flag is cleared,
+    // a producer could otherwise see it still set and skip the write
+    atomic_store_explicit(&router->wakeup_pending[shard], false, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+}
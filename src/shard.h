@@ -0,0 +1,94 @@
+#pragma once
+
+#include "mqtt.h"
+#include "tera_internal.h"
+#include "types.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#define MAX_WORKERS     16
+#define SHARD_RING_SIZE 64 // Must be a power of two
+
+/*
+ * Sharded reactor support, each worker thread owns a full Tera_Context
+ * (listener, IO_Mux, connections, subscriptions and arenas) and never touches
+ * another worker's state.
+ *
+ * Subscriptions are partitioned, each shard only knows about the subscriptions
+ * of its own clients. A PUBLISH is fanned out locally and then copied to the
+ * other shards through single-producer single-consumer rings, one for each
+ * (source, destination) pair, so no locks are involved: the destination shard
+ * runs its own local fanout once it drains the ring.
+ *
+ * Each shard exposes the number of its active subscriptions, shards without
+ * any are skipped by the producers.
+ */
+
+/*
+ * Self-contained copy of a PUBLISH crossing shards, topic and payload are
+ * stored back to back in data.
+ */
+typedef struct shard_message {
+    uint16 topic_size;
+    uint16 message_size;
+    uint8 options;
+    bool has_properties;
+    Publish_Properties properties;
+    uint8 data[MAX_PACKET_SIZE];
+} Shard_Message;
+
+typedef struct shard_ring {
+    _Alignas(64) atomic_uint head; // Written by the consumer
+    _Alignas(64) atomic_uint tail; // Written by the producer
+    Shard_Message slots[SHARD_RING_SIZE];
+} Shard_Ring;
+
+typedef struct shard_router {
+    uint16 shard_count;
+    // shard_count * shard_count rings, indexed by [source * shard_count + destination]
+    Shard_Ring *rings;
+    atomic_uint subscriptions[MAX_WORKERS];
+    atomic_bool wakeup_pending[MAX_WORKERS];
+    // Self-pipe per shard, the read end is watched by the shard event loop
+    int wakeup_fds[MAX_WORKERS][2];
+} Shard_Router;
+
+Shard_Router *shard_router_create(uint16 shard_count);
+void shard_router_free(Shard_Router *router);
+
+/*
+ * Producer side, reserve returns the next free slot of the ring or NULL if
+ * the destination is lagging behind, commit publishes it and wakes up the
+ * destination shard if needed.
+ */
+Shard_Message *shard_ring_reserve(Shard_Router *router, uint16 source, uint16 destination);
+void shard_ring_commit(Shard_Router *router, uint16 source, uint16 destination);
+
+/*
+ * Consumer side, peek returns the oldest message of the ring or NULL if empty,
+ * release hands the slot back to the producer.
+ */
+const Shard_Message *shard_ring_peek(Shard_Router *router, uint16 source, uint16 destination);
+void shard_ring_release(Shard_Router *router, uint16 source, uint16 destination);
+
+/*
+ * Must be called by the destination shard before draining its rings, once
+ * its wakeup descriptor reports readable.
+ */
+void shard_wakeup_ack(Shard_Router *router, uint16 shard);
+
+static inline int shard_wakeup_fd(const Shard_Router *router, uint16 shard)
+{
+    return router->wakeup_fds[shard][0];
+}
+
+static inline void shard_subscriptions_add(Shard_Router *router, uint16 shard, int32 delta)
+{
+    if (router)
+        atomic_fetch_add_explicit(&router->subscriptions[shard], delta, memory_order_relaxed);
+}
+
+static inline bool shard_has_subscriptions(Shard_Router *router, uint16 shard)
+{
+    return atomic_load_explicit(&router->subscriptions[shard], memory_order_relaxed) > 0;
+}
@@ -0,0 +1,112 @@
+#include "slab.h"
+#include <string.h>
+
+static inline uint32 class_block_size(uint8 size_class) { return SLAB_MIN_BLOCK << size_class; }
+
+static inline uint8 size_class_of(uint32 size)
+{
+    uint8 size_class = 0;
+    while (class_block_size(size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+static void partial_link(Slab *slab, int32 page_id)
+{
+    Slab_Page *page = &slab->pages[page_id];
+    int32 *head     = &slab->partial[page->size_class];
+
+    page->prev      = -1;
+    page->next      = *head;
+    if (*head != -1)
+        slab->pages[*head].prev = page_id;
+    *head = page_id;
+}
+
+static void partial_unlink(Slab *slab, int32 page_id)
+{
+    Slab_Page *page = &slab->pages[page_id];
+
+    if (page->prev != -1)
+        slab->pages[page->prev].next = page->next;
+    else
+        slab->partial[page->size_class] = page->next;
+
+    if (page->next != -1)
+        slab->pages[page->next].prev = page->prev;
+}
+
+void slab_init(Slab *slab, void *buffer, uint32 buffer_size, Slab_Page *pages)
+{
+    slab->buf        = buffer;
+    slab->pages      = pages;
+    slab->page_count = buffer_size / SLAB_PAGE_SIZE;
+    slab->free_pages = slab->page_count > 0 ? 0 : -1;
+
+    for (int i = 0; i < SLAB_CLASSES; ++i)
+        slab->partial[i] = -1;
+
+    for (uint32 i = 0; i < slab->page_count; ++i)
+        pages[i] = (Slab_Page){.next = i + 1 < slab->page_count ? (int32)i + 1 : -1, .prev = -1};
+}
+
+int32 slab_alloc(Slab *slab, uint32 size)
+{
+    if (size > SLAB_PAGE_SIZE)
+        return -1;
+
+    uint8 size_class = size_class_of(size);
+    int32 page_id    = slab->partial[size_class];
+
+    if (page_id == -1) {
+        page_id = slab->free_pages;
+        if (page_id == -1)
+            return -1;
+
+        slab->free_pages = slab->pages[page_id].next;
+        slab->pages[page_id] =
+            (Slab_Page){.free = -1, .bump = 0, .used = 0, .size_class = size_class};
+        partial_link(slab, page_id);
+    }
+
+    Slab_Page *page   = &slab->pages[page_id];
+    uint32 block_size = class_block_size(size_class);
+    uint32 page_start = page_id * SLAB_PAGE_SIZE;
+    int16 block       = 0;
+
+    if (page->free != -1) {
+        block = page->free;
+        memcpy(&page->free, slab->buf + page_start + block * block_size, sizeof(int16));
+    } else {
+        block = page->bump++;
+    }
+
+    if (++page->used == SLAB_PAGE_SIZE / block_size)
+        partial_unlink(slab, page_id);
+
+    return page_start + block * block_size;
+}
+
+void slab_free(Slab *slab, int32 offset)
+{
+    if (offset < 0)
+        return;
+
+    int32 page_id     = offset / SLAB_PAGE_SIZE;
+    Slab_Page *page   = &slab->pages[page_id];
+    uint32 block_size = class_block_size(page->size_class);
+    int16 block       = (offset % SLAB_PAGE_SIZE) / block_size;
+
+    memcpy(slab->buf + offset, &page->free, sizeof(int16));
+    page->free = block;
+
+    // A full page has room again
+    if (page->used-- == SLAB_PAGE_SIZE / block_size)
+        partial_link(slab, page_id);
+
+    if (page->used == 0) {
+        partial_unlink(slab, page_id);
+        page->next       = slab->free_pages;
+        slab->free_pages = page_id;
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "types.h"
+
+#define SLAB_PAGE_SIZE  4096
+#define SLAB_MIN_BLOCK  32
+#define SLAB_CLASSES    8 // 32 bytes up to a full page
+
+/*
+ * Size class allocator over a fixed buffer, for storage with a lifetime
+ * (message topics, payloads and encoded frames) where a bump arena would
+ * never get anything back.
+ *
+ * The buffer is split in pages, a page is handed to a size class the first
+ * time that class needs room and carved in blocks of that size. Free blocks
+ * are chained through their first bytes, each class keeps a list of its pages
+ * with at least one free block, pages going back to zero used blocks return
+ * to the shared free pages, available to any class again:
+ *
+ *   pages   [ 64B | 64B | 256B | free | 1KB | free | 64B | ... ]
+ *   partial  64B -> page 1 -> page 6, 256B -> page 2, 1KB -> none (full)
+ *
+ * Allocating and freeing are O(1), nothing is ever requested to the system
+ * after init. Allocations are identified by their offset in the buffer.
+ */
+typedef struct slab_page {
+    int16 free;        // First free block, -1 if none was ever freed
+    uint16 bump;       // Blocks from here on were never handed out
+    uint16 used;
+    int32 next;        // Next page of the class partial list, or of the free pages
+    int32 prev;
+    uint8 size_class;
+} Slab_Page;
+
+typedef struct slab {
+    uint8 *buf;
+    Slab_Page *pages;
+    uint32 page_count;
+    int32 free_pages;
+    int32 partial[SLAB_CLASSES];
+} Slab;
+
+// pages must hold buffer_size / SLAB_PAGE_SIZE entries
+void slab_init(Slab *slab, void *buffer, uint32 buffer_size, Slab_Page *pages);
+
+// Returns the offset of a block of at least size bytes, -1 if there's no room
+int32 slab_alloc(Slab *slab, uint32 size);
+void slab_free(Slab *slab, int32 offset);
+
+static inline void *slab_at(const Slab *slab, int32 offset) { return slab->buf + offset; }
@@ -1,6 +1,7 @@
 #include "logger.h"
 #include "mqtt.h"
 #include "tera_internal.h"
+#include <string.h>
 
 #define DEFAULT_SUBACK_BYTE 0x90
 
@@ -9,24 +10,34 @@ void mqtt_suback_write(Tera_Context *ctx, const Client_Data *cdata, const Subscr
     if (r->acknowledged || r->topic_filter_count == 0)
         return;
 
-    Buffer *buf         = &ctx->connection_data[cdata->conn_id].send_buffer;
+    Send_Queue *queue   = connection_send_queue(ctx, cdata->conn_id);
     isize bytes_written = 0;
 
-    buffer_reset(buf);
-
-    // Fixed Header
-    bytes_written += buffer_write_struct(buf, "B", DEFAULT_SUBACK_BYTE);
-
     // Calculate remaining length: packet_id(2) + properties_length(1) + reason_codes(n)
     usize remaining_length = sizeof(uint16) + sizeof(uint8) + r->topic_filter_count;
+
+    usize header_size      = sizeof(uint8) + mqtt_variable_length_encoded_length(remaining_length);
+    Buffer *buf            = send_queue_scratch_begin(queue, header_size + remaining_length);
+    if (!buf) {
+        log_warning(">>>>: Send queue full, SUBACK dropped");
+        return;
+    }
+
+    // Fixed Header
+    bytes_written += buffer_write_u8(buf, DEFAULT_SUBACK_BYTE);
     bytes_written += mqtt_variable_length_write(buf, remaining_length);
 
+    // The scratch was sized for the whole frame, the rest is stored unchecked
+    uint8 *dst = buffer_reserve(buf, remaining_length);
+
     // Variable Header (0 properties length)
-    bytes_written += buffer_write_struct(buf, "HB", r->packet_id, 0);
+    dst += buffer_store_u16(dst, r->packet_id);
+    dst += buffer_store_u8(dst, 0);
 
-    for (usize i = 0; i < r->topic_filter_count; ++i) {
-        bytes_written += buffer_write_struct(buf, "B", r->reason_codes[i]);
-    }
+    memcpy(dst, r->reason_codes, r->topic_filter_count);
+    bytes_written += remaining_length;
+
+    send_queue_scratch_commit(queue);
 
     log_info("sent: SUBACK %zd bytes, packet_id: %d, topics: %d", bytes_written, r->packet_id,
              r->topic_filter_count);
@@ -1,95 +1,71 @@
-#include "arena.h"
 #include "logger.h"
 #include "mqtt.h"
+#include "shard.h"
 #include "tera_internal.h"
 
 static Subscription_Data *find_free_subscription_slot(Tera_Context *ctx)
 {
-    for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
-        if (ctx->subscription_data[i].active)
-            continue;
+    int32 index = bitmap_find_clear(ctx->subscription_bitmap, MAX_SUBSCRIPTIONS);
+    if (index < 0)
+        return NULL;
 
-        return &ctx->subscription_data[i];
-    }
+    bitmap_set(ctx->subscription_bitmap, index);
 
-    return NULL;
+    return &ctx->subscription_data[index];
 }
 
 /**
- * Validates that a subscription topic filter follows MQTT wildcard rules
- * Should be called when processing SUBSCRIBE packets
+ * Validates that a subscription topic filter follows MQTT wildcard rules on the
+ * levels found by topic_scan, every wildcard must be alone in its level and
+ * '#' can only be the last one.
+ * Should be called when processing SUBSCRIBE and UNSUBSCRIBE packets
  */
-static bool topic_filter_is_valid(const char *filter, usize filter_size)
+bool topic_filter_is_valid(const char *filter, usize filter_size, const Topic_Levels *levels)
 {
-    if (filter_size == 0)
+    if (filter_size == 0 || levels->hash > 1)
         return false;
 
-    for (usize i = 0; i < filter_size; ++i) {
-        if (filter[i] == '#') {
-            // '#' must be at the end
-            if (i != filter_size - 1)
-                return false;
-
-            // '#' must be alone or preceded by '/'
-            if (i > 0 && filter[i - 1] != '/')
-                return false;
-        }
-
-        // Check for valid '+' filter
-        if (filter[i] == '+') {
-            // '+' must be alone in its level
-            bool valid_plus = true;
-
-            if (i > 0 && filter[i - 1] != '/')
-                valid_plus = false;
+    if (levels->hash == 1 && (filter[filter_size - 1] != '#' ||
+                              (filter_size > 1 && filter[filter_size - 2] != '/')))
+        return false;
 
-            if (i < filter_size - 1 && filter[i + 1] != '/')
-                valid_plus = false;
+    // Too deep for the trie, the subscription is refused when indexing it
+    if (levels->plus == 0 || levels->count > TOPIC_MAX_LEVELS)
+        return true;
 
-            if (!valid_plus)
-                return false;
-        }
+    // Each '+' must be a level of its own
+    uint16 plus_levels = 0;
+    for (uint32 level = 0; level < levels->count; ++level) {
+        uint32 start = topic_level_start(levels, level);
+        if (levels->end[level] - start == 1 && filter[start] == '+')
+            plus_levels++;
     }
 
-    return true;
+    return plus_levels == levels->plus;
 }
 
-MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cdata,
-                                       Subscribe_Result *r)
+/*
+ * Filters without wildcards go to the exact index, all the others to the trie
+ */
+static int subscription_index_insert(Tera_Context *ctx, int16 subscription_index)
 {
-    uint16 id       = 0;
-    Buffer *buf     = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    usize start_pos = buf->read_pos;
+    if (ctx->subscription_filters[subscription_index].type == TFT_WILDCARD_NONE)
+        return exact_index_insert(ctx, subscription_index);
 
-    r->acknowledged = false;
-
-    // Read packet type and flags
-    if (buffer_read_struct(buf, "B", &(uint8){0}) != 1) {
-        log_error("recv: SUBSCRIBE - failed to read packet header");
-        return MQTT_DECODE_ERROR;
-    }
+    return topic_trie_insert(ctx, subscription_index);
+}
 
-    // Read remaining length
-    usize packet_length = 0;
-    int length_bytes    = mqtt_variable_length_read(buf, &packet_length);
-    if (length_bytes < 0) {
-        log_error("recv: SUBSCRIBE - invalid variable length encoding");
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
+MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cdata,
+                                       MQTT_Frame *frame, Subscribe_Result *r)
+{
+    uint16 id           = 0;
+    Buffer *buf         = &frame->payload;
+    usize packet_length = frame->header.remaining_length;
 
-    // Validate we have enough data for the complete packet
-    usize total_packet_size =
-        sizeof(uint8) + length_bytes + packet_length; // header + length + payload
-    if (start_pos + total_packet_size > buf->size) {
-        log_debug("recv: SUBSCRIBE - incomplete packet - need %zu more bytes",
-                  (start_pos + total_packet_size) - buf->size);
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
+    r->acknowledged     = false;
 
     // TODO set ID
-    if (buffer_read_struct(buf, "H", &id) != sizeof(uint16))
+    if (buffer_read_u16(buf, &id) != sizeof(uint16))
         return MQTT_DECODE_ERROR;
     packet_length -= sizeof(uint16);
 
@@ -98,7 +74,7 @@ MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cda
     if (cdata->mqtt_version == MQTT_V5) {
         usize properties_length = 0;
         int prop_length_bytes   = mqtt_variable_length_read(buf, &properties_length);
-        if (prop_length_bytes < 0)
+        if (prop_length_bytes == 0)
             return MQTT_DECODE_ERROR;
 
         packet_length -= prop_length_bytes;
@@ -110,6 +86,8 @@ MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cda
                 return MQTT_DECODE_ERROR;
 
             usize sub_id_length = mqtt_variable_length_read(buf, &sub_id);
+            if (sub_id_length == 0)
+                return MQTT_DECODE_ERROR;
 
             if (buffer_skip(buf, properties_length - sizeof(uint8) - sub_id_length) !=
                 properties_length - sizeof(uint8) - sub_id_length)
@@ -127,64 +105,102 @@ MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cda
      *  - qos
      */
     while (packet_length > 0) {
-        Subscription_Data *tdata = find_free_subscription_slot(ctx);
-        if (!tdata)
-            return MQTT_DECODE_ERROR;
-        tdata->client_id = cdata->conn_id;
-        tdata->active    = true;
-        tdata->id        = sub_id > 0 ? sub_id : -1;
-        // Read length bytes of the first topic filter
+        if (r->topic_filter_count == MAX_TOPIC_FILTERS_PER_SUBSCRIBE) {
+            log_warning("recv: SUBSCRIBE - more than %d topic filters",
+                        MAX_TOPIC_FILTERS_PER_SUBSCRIBE);
+            return MQTT_DECODE_INVALID;
+        }
 
-        if (buffer_read_struct(buf, "H", &tdata->topic_size) != sizeof(uint16))
+        // Read length bytes of the topic filter before a slot is taken for it
+        uint16 topic_size = 0;
+        if (buffer_read_u16(buf, &topic_size) != sizeof(uint16))
             return MQTT_DECODE_ERROR;
 
         packet_length -= sizeof(uint16);
 
-        tdata->topic_offset = arena_current_offset(ctx->topic_arena);
-        uint8 *topic_filter = arena_alloc(ctx->topic_arena, tdata->topic_size);
+        Subscription_Data *tdata = find_free_subscription_slot(ctx);
+        if (!tdata)
+            return MQTT_DECODE_ERROR;
+        Subscription_Filter *filter = &ctx->subscription_filters[tdata - ctx->subscription_data];
+        Client_Data *client         = &ctx->client_data[cdata->conn_id];
+        tdata->client_id            = cdata->conn_id;
+        filter->client_next         = client->subscriptions;
+        filter->topic_size          = topic_size;
+        client->subscriptions       = tdata - ctx->subscription_data;
+        shard_subscriptions_add(ctx->router, ctx->shard_id, 1);
+        tdata->id = sub_id > 0 ? sub_id : -1;
+
+        /*
+         * From here the slot is linked to the client and counted on the shard,
+         * every way out before the SUBACK reason code has to free it.
+         */
+
+        uint8 *topic_filter =
+            topic_filter_alloc(ctx, tdata - ctx->subscription_data, filter->topic_size);
         if (!topic_filter) {
-            // TODO handle case
-            log_critical("bump arena OOM");
+            log_warning("recv: SUBSCRIBE - topic arena full");
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
+
+            // Skip the filter and its options, the client is told with the reason code
+            usize skip_size = filter->topic_size + sizeof(uint8);
+            if (buffer_skip(buf, skip_size) != skip_size)
+                return MQTT_DECODE_ERROR;
+
+            packet_length -= skip_size;
+            r->reason_codes[r->topic_filter_count++] = SUBACK_IMPLEMENTATION_SPECIFIC_ERROR;
+            r->packet_id                             = id;
+            continue;
         }
 
-        if (buffer_read_binary(topic_filter, buf, tdata->topic_size) != tdata->topic_size)
-            return MQTT_DECODE_ERROR;
+        // A filter that isn't valid UTF-8 makes the whole packet malformed
+        if (buffer_read_utf8(topic_filter, buf, filter->topic_size) != filter->topic_size) {
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
+            return MQTT_DECODE_INVALID;
+        }
+
+        Topic_Levels levels;
+        topic_scan((const char *)topic_filter, filter->topic_size, &levels);
 
-        if (!topic_filter_is_valid((const char *)topic_filter, tdata->topic_size))
+        if (!topic_filter_is_valid((const char *)topic_filter, filter->topic_size, &levels)) {
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
             return MQTT_DECODE_INVALID;
+        }
 
         // Classify the filter type
         Topic_Filter_Type type = TFT_WILDCARD_NONE;
-        uint16 prefix_levels   = 0;
-
-        for (usize i = 0; i < tdata->topic_size; ++i) {
-            if (topic_filter[i] == '#') {
-                type = TFT_WILDCARD_HASH;
-                break;
-            } else if (topic_filter[i] == '+') {
-                type = TFT_WILDCARD_PLUS;
-            } else if (topic_filter[i] == '/') {
-                prefix_levels++;
-            }
-        }
+        if (levels.hash > 0)
+            type = TFT_WILDCARD_HASH;
+        else if (levels.plus > 0)
+            type = TFT_WILDCARD_PLUS;
+
+        // A valid '#' is always the last level, all the others come before it
+        uint16 prefix_levels = levels.count - 1;
 
-        tdata->type          = type;
-        tdata->prefix_levels = prefix_levels;
+        filter->type          = type;
+        filter->prefix_levels = prefix_levels;
+        filter->topic_hash    = topic_hash((const char *)topic_filter, filter->topic_size);
 
-        packet_length -= tdata->topic_size;
+        packet_length -= filter->topic_size;
 
-        if (buffer_read_struct(buf, "B", &tdata->options) != sizeof(uint8))
+        if (buffer_read_u8(buf, &tdata->options) != sizeof(uint8)) {
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
             return MQTT_DECODE_ERROR;
+        }
 
         packet_length -= sizeof(uint8);
         uint8 qos = tdata->options & 0x03;
 
         // TODO not the right error
-        if (qos < AT_MOST_ONCE || qos > EXACTLY_ONCE)
+        if (qos < AT_MOST_ONCE || qos > EXACTLY_ONCE) {
             r->reason_codes[r->topic_filter_count] = SUBACK_UNSPECIFIED_ERROR;
-        else
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
+        } else if (subscription_index_insert(ctx, tdata - ctx->subscription_data) < 0) {
+            r->reason_codes[r->topic_filter_count] = SUBACK_IMPLEMENTATION_SPECIFIC_ERROR;
+            mqtt_subscription_free(ctx, tdata - ctx->subscription_data);
+        } else {
             // TODO subscription logic (e.g. check for auth, QoS level etc)
             r->reason_codes[r->topic_filter_count] = (SUBACK_Reason_Code)qos;
+        }
 
         log_info("recv: SUBSCRIBE id: %d, sid: %d, cid: %d QoS: %d, rc: 0x%02X", id, tdata->id,
                  tdata->client_id, qos, r->reason_codes[r->topic_filter_count]);
@@ -196,6 +212,56 @@ MQTT_Decode_Result mqtt_subscribe_read(Tera_Context *ctx, const Client_Data *cda
     return MQTT_DECODE_SUCCESS;
 }
 
+void mqtt_subscription_free(Tera_Context *ctx, uint16 subscription_index)
+{
+    if (!bitmap_test(ctx->subscription_bitmap, subscription_index))
+        return;
+
+    Subscription_Filter *filter = &ctx->subscription_filters[subscription_index];
+    uint16 client_id            = ctx->subscription_data[subscription_index].client_id;
+
+    // Usually the head, subscriptions go away all together on disconnect
+    int16 *link = &ctx->client_data[client_id].subscriptions;
+    while (*link != -1 && *link != subscription_index)
+        link = &ctx->subscription_filters[*link].client_next;
+    if (*link == subscription_index)
+        *link = filter->client_next;
+    filter->client_next = -1;
+
+    if (filter->type == TFT_WILDCARD_NONE)
+        exact_index_remove(ctx, subscription_index);
+    else
+        topic_trie_remove(ctx, subscription_index);
+    topic_filter_release(ctx, subscription_index);
+    bitmap_clear(ctx->subscription_bitmap, subscription_index);
+    shard_subscriptions_add(ctx->router, ctx->shard_id, -1);
+}
+
+usize mqtt_subscription_remove(Tera_Context *ctx, uint16 client_id, const char *filter,
+                               uint16 filter_size)
+{
+    uint32 hash   = topic_hash(filter, filter_size);
+    usize removed = 0;
+    int16 index   = ctx->client_data[client_id].subscriptions;
+
+    while (index != -1) {
+        const Subscription_Filter *sub = &ctx->subscription_filters[index];
+        int16 next                     = sub->client_next;
+
+        if (sub->topic_offset != TOPIC_FILTER_NONE && sub->topic_hash == hash &&
+            sub->topic_size == filter_size &&
+            topic_bytes_equal((const char *)arena_at(ctx->topic_arena, sub->topic_offset), filter,
+                              filter_size)) {
+            mqtt_subscription_free(ctx, index);
+            removed++;
+        }
+
+        index = next;
+    }
+
+    return removed;
+}
+
 uint16 mqtt_subscription_next_mid(Subscription_Data *subscription_data)
 {
     // TODO check for boundary
@@ -1,39 +1,117 @@
 #pragma once
 
+#include "bitmap.h"
 #include "buffer.h"
+#include "buffer_pool.h"
+#include "connection.h"
 #include "iomux.h"
 #include "mqtt.h"
+#include "send_queue.h"
+#include "slab.h"
+#include "timer_wheel.h"
+#include "timeutil.h"
+#include "trie.h"
 #include "types.h"
+#include "uring.h"
+#include <stdalign.h>
+#include <sys/socket.h>
 
 #define MAX_CLIENTS                  1024
+#define MAX_FD_SLOTS                 (2 * MAX_CLIENTS) // Power of two
 #define MAX_CLIENT_SIZE              1024
 #define MAX_PACKET_SIZE              1024
 #define MAX_PUBLISHED_MESSAGES       1024
 #define MAX_DELIVERY_MESSAGES        (8 * MAX_PUBLISHED_MESSAGES)
+#define MAX_DELIVERY_SLOTS           (2 * MAX_DELIVERY_MESSAGES) // Power of two
 
 #define MAX_CLIENT_DATA_BUFFER_SIZE  (MAX_CLIENTS * MAX_CLIENT_SIZE)
 #define MAX_MESSAGE_DATA_BUFFER_SIZE (MAX_DELIVERY_MESSAGES * MAX_PACKET_SIZE)
+// A receive and a scratch buffer for each connection, the io arena only holds
+// the io_uring provided buffers
+#define MAX_IO_BUFFERS               (2 * MAX_CLIENTS)
+#define MAX_IO_DATA_BUFFER_SIZE      (URING_BUFFER_COUNT * MAX_PACKET_SIZE)
 
 #define MAX_SUBSCRIPTIONS            8192
 #define MAX_TOPIC_DATA_BUFFER_SIZE   (MAX_SUBSCRIPTIONS) * 64
+#define MAX_TOPIC_NODES              (2 * MAX_SUBSCRIPTIONS)
+#define MAX_EXACT_BUCKETS            (2 * MAX_SUBSCRIPTIONS) // Power of two
+#define MAX_MATCH_CACHE_ENTRIES      4096                    // Power of two
+
+// One timer per delivery for the retries, followed by one per connection for
+// the keepalive and a last one for the stats report
+#define MAX_TIMERS                   (MAX_DELIVERY_MESSAGES + MAX_CLIENTS + 1)
+
+// Packets decoded out of a receive buffer before the grouped passes run, see
+// PIPELINE_BATCH
+#define MAX_PACKET_BATCH             64
 
-#define MQTT_RETRANSMISSION_CHECK_MS 5000
 #define MQTT_MAX_RETRY_ATTEMPTS      5
 #define MQTT_RETRY_TIMEOUT_MS        20000
 
-// Main pools of pre-allocated data
-// TODO use a bump allocator on heap
-extern uint8 client_data_buffer[];
-extern Arena client_arena;
+// io_uring backend, submission queue depth and number of provided receive
+// buffers (power of two, MAX_PACKET_SIZE each, carved from the io arena)
+#define URING_ENTRIES                1024
+#define URING_BUFFER_COUNT           256
 
-extern uint8 message_data_buffer[];
-extern Arena message_arena;
+typedef struct shard_router Shard_Router;
 
-extern uint8 topic_data_buffer[];
-extern Arena topic_arena;
+/*
+ * How the packets of a receive buffer are handled:
+ *
+ * - PIPELINE_PACKET decodes and handles each packet in turn, a switch on the
+ *   type for every packet
+ * - PIPELINE_BATCH splits the buffer in a flat array of descriptors first,
+ *   then handles them in passes grouped by type (all the acks, then all the
+ *   PUBLISH fanouts, ...) so each pass keeps running the same code on the
+ *   same tables
+ *
+ * Only packets whose relative order doesn't matter are grouped, CONNECT,
+ * SUBSCRIBE, UNSUBSCRIBE and DISCONNECT run the pending passes first and are
+ * then handled on their own.
+ */
+typedef enum { PIPELINE_PACKET, PIPELINE_BATCH } Pipeline_Mode;
 
-extern uint8 io_buffer[];
-extern Arena io_arena;
+typedef struct packet_desc {
+    uint32 offset; // Of the payload in the receive buffer
+    uint32 length; // Remaining length
+    uint16 conn_id;
+    uint8 header; // First byte of the fixed header
+} Packet_Desc;
+
+typedef struct packet_batch {
+    uint16 count;
+    Packet_Desc packets[MAX_PACKET_BATCH];
+} Packet_Batch;
+
+// Counters for comparing the pipeline modes, reported every pipeline_stats seconds
+typedef struct pipeline_stats {
+    uint64 reads;   // Receive buffers with at least a complete packet
+    uint64 packets; // Complete packets across those
+    uint64 batches; // Grouped passes runs, PIPELINE_BATCH only
+    uint64 batched; // Packets handled by the grouped passes
+    uint16 max_batch;
+} Pipeline_Stats;
+
+/*
+ * Main pools of pre-allocated data, one for each worker. The arenas are only
+ * ever accessed by the owning worker, so each one gets its own backing memory
+ * instead of sharing a global pool.
+ */
+typedef struct tera_memory {
+    Arena client_arena;
+    Slab message_slab;
+    Arena topic_arena;
+    Arena io_arena;
+    Buffer_Pool io_pool;
+
+    uint8 client_data_buffer[MAX_CLIENT_DATA_BUFFER_SIZE];
+    uint8 message_data_buffer[MAX_MESSAGE_DATA_BUFFER_SIZE];
+    Slab_Page message_pages[MAX_MESSAGE_DATA_BUFFER_SIZE / SLAB_PAGE_SIZE];
+    // Aligned like the arena blocks, the filter headers are walked from the start, see trie.h
+    alignas(4) uint8 topic_data_buffer[MAX_TOPIC_DATA_BUFFER_SIZE];
+    uint8 io_buffer[MAX_IO_DATA_BUFFER_SIZE];
+    uint8 io_pool_buffer[MAX_IO_BUFFERS * MAX_PACKET_SIZE];
+} Tera_Memory;
 
 typedef struct client_data {
     // MQTT connect flags and ID
@@ -46,6 +124,7 @@ typedef struct client_data {
     // Connection data
     uint16 conn_id;
     uint16 keepalive;
+    int16 subscriptions; // Last subscription made, -1 if none, chained by client_next
     uint8 connect_flags;
 
     // Byte string sizes in memory
@@ -61,24 +140,40 @@ typedef struct client_data {
  * Wrapper structure around a connected client, each connection can be a publisher
  * or a subscriber.
  * As of now, no allocations will occur, just a big pool of memory at the
- * start of the application will serve us a client pool, read and write buffers
- * are initialized at the start.
+ * start of the application will serve us a client pool. The receive buffer
+ * and the send queue scratch are taken from the io pool only while there are
+ * bytes in flight, an idle connection holds none.
  */
 typedef struct connection_data {
-    Buffer recv_buffer;
-    Buffer send_buffer;
+    Buffer recv_buffer; // No backing block between reads unless a packet is partial
+    Send_Queue send_queue;
     int socket_fd;
+    uint32 generation;    // Changes on each new connection on the slot
+    uint16 live_position; // Index in Tera_Context.connection_ids
     bool connected;
+    bool send_inflight; // io_uring only, a send or a write poll is pending
+    bool dirty;          // Queued in the dirty list, to be flushed
+    bool write_interest; // IOMUX_WRITE registered, a flush left bytes behind
+    // io_uring only, the message of the inflight send must outlive the submission
+    struct msghdr send_msg;
+    struct iovec send_iov[SEND_QUEUE_IOV_MAX];
 } Connection_Data;
 
-// Bare bone lookup table entry structure to be used in a fixed length array
-// to track inflight deliveries
-#define MAX_COLLISIONS 8
-
-typedef struct {
-    int8 count;
-    int16 indexes[MAX_COLLISIONS];
-} Delivery_Bucket;
+/*
+ * Slot of the inflight deliveries index, an open addressing table keyed by
+ * subscriber and packet id with Robin Hood probing: an insert takes the slot
+ * of any entry closer to its home slot than itself, so a lookup stops as soon
+ * as it reaches an entry closer to home than it would be, and a delete shifts
+ * the following entries back a slot instead of leaving a tombstone.
+ *
+ * Eight slots fit in a cache line and the table is never more than half full,
+ * an ack is found in its home slot or the few next to it.
+ */
+typedef struct delivery_slot {
+    uint32 key;      // Client id on the high half, packet id on the low one
+    int16 delivery;  // Message_Delivery index, -1 when the slot is empty
+    uint16 distance; // Slots between the home slot of the key and this one
+} Delivery_Slot;
 
 /**
  * Main server context structure containing all global state for the MQTT broker.
@@ -95,7 +190,8 @@ typedef struct {
  * - Fixed-size arrays provide predictable memory usage and avoid dynamic allocation
  * - Arrays are sized by MAX_* constants to enforce broker capacity limits
  * - Parallel arrays (connection_data/client_data) allow separation of transport vs
- *   protocol state
+ *   protocol state, subscription_data/subscription_filters of the fields read on
+ *   each match from the ones only read to index a filter
  * - Utility sentinels and auxilary table for quick lookup of resources
  *
  * Memory Layout:
@@ -106,29 +202,58 @@ typedef struct {
  *                       deliveries depending on how many subscribers are connected to the
  *                       topic it publishes to
  * - Properties: MQTT 5.0 properties associated with published messages
- * - Subscriptions: Topic filters and associated client subscriptions, wildacards and
- *                  hierarchies are not supported as of yet
+ * - Subscriptions: Topic filters and associated client subscriptions, indexed by a
+ *                  hash table for exact filters and a trie of topic levels for '+'
+ *                  and '#' wildcards, the matches of recent topics are cached
  */
 typedef struct tera_context {
-    // I/O Event handler
+    // I/O Event handler, the io_uring ring is NULL unless selected at startup
     IO_Mux *iomux;
+    IO_Ring *ring;
+
+    // Sharding, the router is NULL when running a single worker
+    Shard_Router *router;
+    uint16 shard_id;
 
-    // Memory arenas, separated by entity
+    // Memory pools, separated by entity
     Arena *io_arena;
+    Buffer_Pool *io_pool; // Connection receive and scratch buffers, held only while in use
     Arena *client_arena;
     Arena *topic_arena;
-    Arena *message_arena;
+    Slab *message_slab; // Published topics, payloads and frames, freed with the message
 
     // Mapping auxilary indexes
     // Simple free-list sentinels for properties, published and deliveries for
     // fast lookup
-    // The last one is a basic lookup table to track inflight message, a max
-    // number of 8 collisions per entry should be enough to provide reasonable
-    // low probability of dropping packets
+    // The last one indexes the inflight deliveries by client and packet id,
+    // for the acks to find them, see Delivery_Slot
     int16 property_free_list_head;
     int16 published_free_list_head;
     int16 message_delivery_free_list_head;
-    Delivery_Bucket message_delivery_lookup_table[MAX_DELIVERY_MESSAGES];
+    int16 topic_node_free_list_head;
+    Delivery_Slot message_delivery_index[MAX_DELIVERY_SLOTS];
+
+    // Connections with frames queued since the last flush, only these are
+    // visited by the flush instead of every connection slot
+    uint16 dirty_count;
+    uint16 dirty_connections[MAX_CLIENTS];
+
+    // Connection slot map, live slots first followed by the free ones, and
+    // the descriptor to slot lookup
+    uint16 connection_count;
+    uint32 connection_generation;
+    uint16 connection_ids[MAX_CLIENTS];
+    Fd_Slot fd_slots[MAX_FD_SLOTS];
+
+    // Retries and keepalive deadlines, only the due ones are visited
+    Timer_Wheel timer_wheel;
+    Timer_Node timer_nodes[MAX_TIMERS];
+
+    // Receive side pipeline, the batch is only filled in PIPELINE_BATCH mode
+    Pipeline_Mode pipeline;
+    uint32 pipeline_stats_ms; // Report interval, 0 to disable
+    Pipeline_Stats pipeline_stats;
+    Packet_Batch packet_batch;
 
     // Data arrays
     Connection_Data connection_data[MAX_CLIENTS];
@@ -137,8 +262,49 @@ typedef struct tera_context {
     Message_Delivery message_deliveries[MAX_DELIVERY_MESSAGES];
     Publish_Properties properties_data[MAX_PUBLISHED_MESSAGES];
     Subscription_Data subscription_data[MAX_SUBSCRIPTIONS];
+    Subscription_Filter subscription_filters[MAX_SUBSCRIPTIONS];
+    uint64 subscription_bitmap[BITMAP_WORDS(MAX_SUBSCRIPTIONS)]; // Slots in use
+    Topic_Node topic_nodes[MAX_TOPIC_NODES];
+    Exact_Bucket exact_buckets[MAX_EXACT_BUCKETS];
+
+    // Matches of the recent topics, valid while match_epoch doesn't change
+    uint32 match_epoch;
+    Match_Cache_Stats match_cache_stats;
+    Match_Cache_Entry match_cache[MAX_MATCH_CACHE_ENTRIES];
 } Tera_Context;
 
+// Slots of the timer wheel, see MAX_TIMERS
+static inline uint32 delivery_timer_id(uint16 delivery_id) { return delivery_id; }
+static inline uint32 keepalive_timer_id(uint16 conn_id) { return MAX_DELIVERY_MESSAGES + conn_id; }
+static inline uint32 stats_timer_id(void) { return MAX_DELIVERY_MESSAGES + MAX_CLIENTS; }
+
+// A record holding a connection id outlived the connection if the generation changed
+static inline bool connection_is_live(const Tera_Context *ctx, uint16 conn_id, uint32 generation)
+{
+    const Connection_Data *cd = &ctx->connection_data[conn_id];
+    return cd->socket_fd >= 0 && cd->generation == generation;
+}
+
+static inline void connection_mark_dirty(Tera_Context *ctx, uint16 conn_id)
+{
+    Connection_Data *cd = &ctx->connection_data[conn_id];
+    if (cd->dirty)
+        return;
+
+    cd->dirty                                  = true;
+    ctx->dirty_connections[ctx->dirty_count++] = conn_id;
+}
+
+/*
+ * Every writer gets the send queue of a connection through here, so that it
+ * gets flushed at the end of the current loop iteration.
+ */
+static inline Send_Queue *connection_send_queue(Tera_Context *ctx, uint16 conn_id)
+{
+    connection_mark_dirty(ctx, conn_id);
+    return &ctx->connection_data[conn_id].send_queue;
+}
+
 /**
  * Simple helper structure to quickly access all the encoded bitfields
  * of each published message
@@ -173,27 +339,42 @@ static inline uint8 data_flags_active_set(uint8 byte, uint8 value)
     return (byte & ~(0x01 << 0x04)) | ((value & 0x01) << 0x04);
 }
 
-static inline void tera_context_init(Tera_Context *ctx)
+static inline void tera_context_init(Tera_Context *ctx, Tera_Memory *memory)
 {
     // TODO move out of heap
     ctx->iomux = iomux_create();
 
-    arena_init(&client_arena, client_data_buffer, MAX_CLIENT_DATA_BUFFER_SIZE);
-    arena_init(&message_arena, message_data_buffer, MAX_MESSAGE_DATA_BUFFER_SIZE);
-    arena_init(&topic_arena, topic_data_buffer, MAX_TOPIC_DATA_BUFFER_SIZE);
-    arena_init(&io_arena, io_buffer, MAX_MESSAGE_DATA_BUFFER_SIZE);
+    arena_init(&memory->client_arena, memory->client_data_buffer, MAX_CLIENT_DATA_BUFFER_SIZE);
+    slab_init(&memory->message_slab, memory->message_data_buffer, MAX_MESSAGE_DATA_BUFFER_SIZE,
+              memory->message_pages);
+    arena_init(&memory->topic_arena, memory->topic_data_buffer, MAX_TOPIC_DATA_BUFFER_SIZE);
+    arena_init(&memory->io_arena, memory->io_buffer, MAX_IO_DATA_BUFFER_SIZE);
+    buffer_pool_init(&memory->io_pool, memory->io_pool_buffer, MAX_PACKET_SIZE, MAX_IO_BUFFERS);
 
-    ctx->io_arena      = &io_arena;
-    ctx->topic_arena   = &topic_arena;
-    ctx->client_arena  = &client_arena;
-    ctx->message_arena = &message_arena;
+    ctx->io_arena      = &memory->io_arena;
+    ctx->io_pool       = &memory->io_pool;
+    ctx->topic_arena   = &memory->topic_arena;
+    ctx->client_arena  = &memory->client_arena;
+    ctx->message_slab  = &memory->message_slab;
 
     for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
-        ctx->subscription_data[i].active     = false;
-        ctx->subscription_data[i].mid        = 1;
-        ctx->subscription_data[i].topic_size = 0;
+        ctx->subscription_data[i].mid             = 1;
+        ctx->subscription_data[i].trie_next       = -1;
+        ctx->subscription_data[i].exact_next      = -1;
+        ctx->subscription_filters[i].topic_size   = 0;
+        ctx->subscription_filters[i].topic_offset = TOPIC_FILTER_NONE;
+        ctx->subscription_filters[i].trie_node    = -1;
+        ctx->subscription_filters[i].client_next  = -1;
     }
 
+    for (usize i = 0; i < BITMAP_WORDS(MAX_SUBSCRIPTIONS); ++i)
+        ctx->subscription_bitmap[i] = 0;
+
+    topic_trie_init(ctx);
+    exact_index_init(ctx);
+    match_cache_init(ctx);
+    connection_table_init(ctx);
+
     for (usize i = 0; i < MAX_PUBLISHED_MESSAGES; ++i) {
         ctx->published_messages[i].options   = 0;
         ctx->published_messages[i].next_free = i + 1;
@@ -208,17 +389,22 @@ static inline void tera_context_init(Tera_Context *ctx)
     ctx->property_free_list_head         = 0;
     ctx->published_free_list_head        = 0;
     ctx->message_delivery_free_list_head = 0;
+    ctx->dirty_count                     = 0;
+    ctx->pipeline                        = PIPELINE_PACKET;
+    ctx->pipeline_stats_ms               = 0;
+    ctx->pipeline_stats                  = (Pipeline_Stats){0};
+    ctx->packet_batch.count              = 0;
 
-    for (usize i = 0; i < MAX_DELIVERY_MESSAGES; ++i) {
-        ctx->message_delivery_lookup_table[i].count = 0;
-        for (uint8 j = 0; j < MAX_COLLISIONS; ++j)
-            ctx->message_delivery_lookup_table[i].indexes[j] = -1;
-    }
+    timer_wheel_init(&ctx->timer_wheel, ctx->timer_nodes, MAX_TIMERS, current_millis_relative());
+
+    mqtt_message_delivery_index_init(ctx);
 
     // The last slot points to an invalid index to signify the end of the list
-    ctx->properties_data[MAX_PUBLISHED_MESSAGES - 1].active      = false;
-    ctx->properties_data[MAX_PUBLISHED_MESSAGES - 1].next_free   = -1;
+    ctx->properties_data[MAX_PUBLISHED_MESSAGES - 1].active       = false;
+    ctx->properties_data[MAX_PUBLISHED_MESSAGES - 1].next_free    = -1;
+
+    ctx->published_messages[MAX_PUBLISHED_MESSAGES - 1].next_free = -1;
 
-    ctx->message_deliveries[MAX_DELIVERY_MESSAGES - 1].active    = false;
-    ctx->message_deliveries[MAX_DELIVERY_MESSAGES - 1].next_free = -1;
+    ctx->message_deliveries[MAX_DELIVERY_MESSAGES - 1].active     = false;
+    ctx->message_deliveries[MAX_DELIVERY_MESSAGES - 1].next_free  = -1;
 }
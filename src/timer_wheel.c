@@ -0,0 +1,183 @@
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_EXPIRED_SLOT  (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+#define TIMER_MAX_TICKS     ((1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static int32 *slot_head(Timer_Wheel *wheel, int16 slot)
+{
+    if (slot == TIMER_EXPIRED_SLOT)
+        return &wheel->expired;
+
+    return &wheel->slots[slot / TIMER_WHEEL_SLOTS][slot % TIMER_WHEEL_SLOTS];
+}
+
+static void timer_link(Timer_Wheel *wheel, uint32 id, int16 slot)
+{
+    Timer_Node *node = &wheel->nodes[id];
+    int32 *head      = slot_head(wheel, slot);
+
+    node->slot       = slot;
+    node->prev       = -1;
+    node->next       = *head;
+    if (*head != -1)
+        wheel->nodes[*head].prev = id;
+    *head = id;
+}
+
+static void timer_unlink(Timer_Wheel *wheel, uint32 id)
+{
+    Timer_Node *node = &wheel->nodes[id];
+
+    if (node->prev != -1)
+        wheel->nodes[node->prev].next = node->next;
+    else
+        *slot_head(wheel, node->slot) = node->next;
+
+    if (node->next != -1)
+        wheel->nodes[node->next].prev = node->prev;
+
+    node->slot = -1;
+}
+
+/*
+ * Place a timer in the lowest level able to hold it, timers already due go
+ * straight to the expired list.
+ */
+static void timer_place(Timer_Wheel *wheel, uint32 id)
+{
+    Timer_Node *node = &wheel->nodes[id];
+    int32 delta      = (int32)(node->expires - wheel->current_tick);
+
+    if (delta <= 0) {
+        timer_link(wheel, id, TIMER_EXPIRED_SLOT);
+        return;
+    }
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        if ((uint32)delta < 1u << (TIMER_WHEEL_BITS * (level + 1))) {
+            uint32 slot = (node->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+            timer_link(wheel, id, level * TIMER_WHEEL_SLOTS + slot);
+            return;
+        }
+    }
+}
+
+// Move all the timers of a slot of an higher level down to the lower ones
+static void timer_cascade(Timer_Wheel *wheel, int level)
+{
+    uint32 slot = (wheel->current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    int32 id    = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = -1;
+
+    while (id != -1) {
+        int32 next = wheel->nodes[id].next;
+        timer_place(wheel, id);
+        id = next;
+    }
+}
+
+void timer_wheel_init(Timer_Wheel *wheel, Timer_Node *nodes, uint32 node_count, uint32 now_ms)
+{
+    wheel->current_tick = 0;
+    wheel->elapsed_ms   = 0;
+    wheel->last_ms      = now_ms;
+    wheel->armed        = 0;
+    wheel->expired      = -1;
+    wheel->nodes        = nodes;
+    wheel->node_count   = node_count;
+
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+            wheel->slots[level][slot] = -1;
+
+    for (uint32 i = 0; i < node_count; ++i)
+        nodes[i] = (Timer_Node){.expires = 0, .next = -1, .prev = -1, .slot = -1};
+}
+
+void timer_wheel_schedule(Timer_Wheel *wheel, uint32 id, uint32 timeout_ms)
+{
+    // Count from the start of the current tick, never fire early
+    uint32 ticks = (timeout_ms + wheel->elapsed_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    if (ticks > TIMER_MAX_TICKS)
+        ticks = TIMER_MAX_TICKS;
+
+    timer_wheel_cancel(wheel, id);
+
+    wheel->nodes[id].expires = wheel->current_tick + ticks;
+    timer_place(wheel, id);
+    wheel->armed++;
+}
+
+void timer_wheel_cancel(Timer_Wheel *wheel, uint32 id)
+{
+    if (!timer_wheel_armed(wheel, id))
+        return;
+
+    timer_unlink(wheel, id);
+    wheel->armed--;
+}
+
+void timer_wheel_advance(Timer_Wheel *wheel, uint32 now_ms)
+{
+    // Unsigned difference, the relative clock can wrap around
+    wheel->elapsed_ms += now_ms - wheel->last_ms;
+    wheel->last_ms = now_ms;
+
+    while (wheel->elapsed_ms >= TIMER_WHEEL_TICK_MS) {
+        wheel->elapsed_ms -= TIMER_WHEEL_TICK_MS;
+        wheel->current_tick++;
+
+        // Each time a level wraps, the next slot of the level above comes down
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if (wheel->current_tick & ((1u << (TIMER_WHEEL_BITS * level)) - 1))
+                break;
+            timer_cascade(wheel, level);
+        }
+
+        int32 id = wheel->slots[0][wheel->current_tick & TIMER_WHEEL_MASK];
+        while (id != -1) {
+            int32 next = wheel->nodes[id].next;
+            timer_unlink(wheel, id);
+            timer_link(wheel, id, TIMER_EXPIRED_SLOT);
+            id = next;
+        }
+    }
+}
+
+int32 timer_wheel_next_expired(Timer_Wheel *wheel)
+{
+    int32 id = wheel->expired;
+    if (id == -1)
+        return -1;
+
+    timer_unlink(wheel, id);
+    wheel->armed--;
+
+    return id;
+}
+
+time_t timer_wheel_timeout(const Timer_Wheel *wheel, uint32 now_ms)
+{
+    if (wheel->armed == 0)
+        return -1;
+
+    if (wheel->expired != -1)
+        return 0;
+
+    // Nearest slot of the lowest level, or the next cascade at the latest
+    uint32 ticks = TIMER_WHEEL_SLOTS - (wheel->current_tick & TIMER_WHEEL_MASK);
+    for (uint32 distance = 1; distance < ticks; ++distance) {
+        if (wheel->slots[0][(wheel->current_tick + distance) & TIMER_WHEEL_MASK] != -1) {
+            ticks = distance;
+            break;
+        }
+    }
+
+    // Time already elapsed since the last advance counts towards the next tick
+    time_t timeout = (time_t)ticks * TIMER_WHEEL_TICK_MS - wheel->elapsed_ms;
+    timeout -= now_ms - wheel->last_ms;
+
+    return timeout > 0 ? timeout : 0;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+#include <time.h>
+
+#define TIMER_WHEEL_TICK_MS 100
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+
+/*
+ * Hierarchical timing wheel, 4 levels of 64 slots each covering 64 times the
+ * span of the level below:
+ *
+ *   level 0   100ms slots,  6.4s
+ *   level 1   6.4s slots,   ~7min
+ *   level 2   ~7min slots,  ~7h
+ *   level 3   ~7h slots,    ~19 days (longer timers are clamped)
+ *
+ * Timers are identified by a caller defined index into a fixed array of
+ * nodes, chained in a doubly linked list per slot so that scheduling and
+ * cancelling are O(1). When the lowest level wraps, the next slot of the level
+ * above is cascaded down, so the cost of advancing the wheel is proportional
+ * to the number of due timers and not to the number of armed ones.
+ */
+typedef struct timer_node {
+    uint32 expires; // In ticks
+    int32 next;
+    int32 prev;
+    int16 slot; // level * TIMER_WHEEL_SLOTS + slot, -1 if not armed
+} Timer_Node;
+
+typedef struct timer_wheel {
+    uint32 current_tick; // Last tick processed
+    uint32 elapsed_ms;   // Into the current tick
+    uint32 last_ms;      // Time of the last advance
+    uint32 armed;
+    int32 expired; // Head of the timers already due, popped by timer_wheel_next_expired
+    int32 slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    Timer_Node *nodes;
+    uint32 node_count;
+} Timer_Wheel;
+
+void timer_wheel_init(Timer_Wheel *wheel, Timer_Node *nodes, uint32 node_count, uint32 now_ms);
+
+/*
+ * Arm a timer to fire timeout_ms after the last advance, re-scheduling it if
+ * it's already armed.
+ */
+void timer_wheel_schedule(Timer_Wheel *wheel, uint32 id, uint32 timeout_ms);
+void timer_wheel_cancel(Timer_Wheel *wheel, uint32 id);
+
+static inline bool timer_wheel_armed(const Timer_Wheel *wheel, uint32 id)
+{
+    return wheel->nodes[id].slot != -1;
+}
+
+/*
+ * Move the wheel forward to now, all the timers due in the meantime can then
+ * be popped one by one with timer_wheel_next_expired, which returns -1 once
+ * there are no more. A popped timer is disarmed.
+ */
+void timer_wheel_advance(Timer_Wheel *wheel, uint32 now_ms);
+int32 timer_wheel_next_expired(Timer_Wheel *wheel);
+
+/*
+ * Milliseconds until the wheel needs to be advanced again, either to expire
+ * the nearest timer or to cascade a higher level, -1 if no timer is armed.
+ */
+time_t timer_wheel_timeout(const Timer_Wheel *wheel, uint32 now_ms);
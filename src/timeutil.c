@@ -43,7 +43,14 @@ time_t current_seconds(void)
     return ts.tv_sec;
 }
 
-int64 current_millis(void) { return current_seconds() * 1000; }
+int64 current_millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    // Converts the time to milliseconds
+    return (int64)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
 int clocktime(struct timespec *ts) { return clock_gettime(CLOCK_PROCESS_CPUTIME_ID, ts); }
 
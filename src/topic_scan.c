@@ -0,0 +1,104 @@
+#include "topic_scan.h"
+
+typedef void (*Topic_Scan_Kernel)(const char *topic, usize from, usize topic_size,
+                                  Topic_Levels *levels);
+
+static inline void levels_push(Topic_Levels *levels, uint32 end)
+{
+    if (levels->count < TOPIC_MAX_LEVELS)
+        levels->end[levels->count] = end;
+    levels->count++;
+}
+
+// One level end for each bit of a '/' bitmap, base is the offset of its bit 0
+static inline void levels_push_mask(Topic_Levels *levels, uint32 base, uint32 mask)
+{
+    while (mask) {
+        levels_push(levels, base + __builtin_ctz(mask));
+        mask &= mask - 1;
+    }
+}
+
+static void topic_scan_scalar(const char *topic, usize from, usize topic_size,
+                              Topic_Levels *levels)
+{
+    for (usize i = from; i < topic_size; ++i) {
+        if (topic[i] == '/')
+            levels_push(levels, i);
+        else if (topic[i] == '+')
+            levels->plus++;
+        else if (topic[i] == '#')
+            levels->hash++;
+    }
+}
+
+#if defined(__SSE2__)
+
+static void topic_scan_sse2(const char *topic, usize from, usize topic_size,
+                            Topic_Levels *levels)
+{
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i plus  = _mm_set1_epi8('+');
+    const __m128i hash  = _mm_set1_epi8('#');
+    usize i             = from;
+
+    for (; i + 16 <= topic_size; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(topic + i));
+        levels->plus += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, plus)));
+        levels->hash += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, hash)));
+        levels_push_mask(levels, i, _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, slash)));
+    }
+
+    topic_scan_scalar(topic, i, topic_size, levels);
+}
+
+__attribute__((target("avx2"))) static void topic_scan_avx2(const char *topic, usize from,
+                                                            usize topic_size,
+                                                            Topic_Levels *levels)
+{
+    const __m256i slash = _mm256_set1_epi8('/');
+    const __m256i plus  = _mm256_set1_epi8('+');
+    const __m256i hash  = _mm256_set1_epi8('#');
+    usize i             = from;
+
+    for (; i + 32 <= topic_size; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(topic + i));
+        uint32 pluses = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, plus));
+        uint32 hashes = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, hash));
+        levels->plus += __builtin_popcount(pluses);
+        levels->hash += __builtin_popcount(hashes);
+        levels_push_mask(levels, i, _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, slash)));
+    }
+
+    // Most topics are shorter than a vector, or leave a tail of one
+    topic_scan_sse2(topic, i, topic_size, levels);
+}
+
+static Topic_Scan_Kernel scan_kernel = topic_scan_sse2;
+
+#else
+
+static Topic_Scan_Kernel scan_kernel = topic_scan_scalar;
+
+#endif
+
+void topic_scan_init(void)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_kernel = topic_scan_avx2;
+#endif
+}
+
+void topic_scan(const char *topic, usize topic_size, Topic_Levels *levels)
+{
+    levels->count = 0;
+    levels->plus  = 0;
+    levels->hash  = 0;
+
+    scan_kernel(topic, 0, topic_size, levels);
+
+    // The last level runs up to the end of the topic
+    levels_push(levels, topic_size);
+}
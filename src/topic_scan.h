@@ -0,0 +1,95 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#define TOPIC_MAX_LEVELS 64
+
+/*
+ * Level boundaries of a topic name or filter, found with a single pass over
+ * its bytes. The pass compares whole vectors against '/', '+' and '#' and
+ * turns the results into bitmaps, one bit per byte, the set bits of the '/'
+ * bitmap are the level ends:
+ *
+ *   topic   s i t e / f l o o r / r o o m
+ *   '/'     0 0 0 0 1 0 0 0 0 0 1 0 0 0 0   end = { 4, 10, 15 }
+ *
+ * Level i spans [end[i - 1] + 1, end[i]), the first one starts at 0 and the
+ * last one ends at the topic size. Only the first TOPIC_MAX_LEVELS ends are
+ * kept, count is always the real number of levels.
+ *
+ * The kernel is picked at runtime, AVX2 where the CPU has it, SSE2 on any
+ * other x86-64 and a byte loop everywhere else.
+ */
+typedef struct topic_levels {
+    uint32 count;
+    uint16 plus; // '+' and '#' bytes seen anywhere in the topic
+    uint16 hash;
+    uint16 end[TOPIC_MAX_LEVELS];
+} Topic_Levels;
+
+// Select the scan kernel for the running CPU, to be called once before any scan
+void topic_scan_init(void);
+
+void topic_scan(const char *topic, usize topic_size, Topic_Levels *levels);
+
+static inline uint32 topic_level_start(const Topic_Levels *levels, uint32 level)
+{
+    return level == 0 ? 0 : levels->end[level - 1] + 1u;
+}
+
+/*
+ * Compare two runs of topic bytes, labels of the same size as a level are
+ * the common case. Runs of 16 bytes or more are compared a vector at a time,
+ * the last vector overlapping the previous one instead of reading past the
+ * end, shorter runs the same way with 8 and 4 bytes words.
+ */
+static inline bool topic_bytes_equal(const char *a, const char *b, usize size)
+{
+#if defined(__SSE2__)
+    if (size >= 16) {
+        usize last = size - 16;
+        for (usize i = 0; i < last; i += 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+                return false;
+        }
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + last));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + last));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+    }
+#endif
+
+    if (size >= 8) {
+        uint64 x = 0, y = 0, u = 0, v = 0;
+        for (usize i = 0; i + 8 < size; i += 8) {
+            memcpy(&x, a + i, sizeof(x));
+            memcpy(&y, b + i, sizeof(y));
+            if (x != y)
+                return false;
+        }
+        memcpy(&u, a + size - 8, sizeof(u));
+        memcpy(&v, b + size - 8, sizeof(v));
+        return u == v;
+    }
+
+    if (size >= 4) {
+        uint32 x = 0, y = 0, u = 0, v = 0;
+        memcpy(&x, a, sizeof(x));
+        memcpy(&y, b, sizeof(y));
+        memcpy(&u, a + size - 4, sizeof(u));
+        memcpy(&v, b + size - 4, sizeof(v));
+        return x == y && u == v;
+    }
+
+    for (usize i = 0; i < size; ++i)
+        if (a[i] != b[i])
+            return false;
+
+    return true;
+}
@@ -0,0 +1,535 @@
+#include "trie.h"
+#include "arena.h"
+#include "logger.h"
+#include "tera_internal.h"
+#include <string.h>
+
+#define TOPIC_TRIE_ROOT 0
+
+// Pending node to visit while matching, along with the topic level to match
+// against its children
+typedef struct trie_visit {
+    int16 index;
+    uint16 level;
+} Trie_Visit;
+
+static int16 topic_node_alloc(Tera_Context *ctx, int16 parent, uint32 label_offset,
+                              uint16 label_size)
+{
+    int16 index = ctx->topic_node_free_list_head;
+    if (index == -1)
+        return -1;
+
+    Topic_Node *node               = &ctx->topic_nodes[index];
+    ctx->topic_node_free_list_head = node->next_sibling;
+
+    *node = (Topic_Node){.label_offset  = label_offset,
+                         .label_size    = label_size,
+                         .parent        = parent,
+                         .first_child   = -1,
+                         .next_sibling  = -1,
+                         .plus_child    = -1,
+                         .hash_child    = -1,
+                         .subscriptions = -1};
+
+    return index;
+}
+
+static void topic_node_free(Tera_Context *ctx, int16 index)
+{
+    // The released slot becomes the new head of the free list
+    ctx->topic_nodes[index].next_sibling = ctx->topic_node_free_list_head;
+    ctx->topic_node_free_list_head       = index;
+}
+
+static int16 topic_node_find_child(const Tera_Context *ctx, int16 parent, const char *label,
+                                   usize label_size)
+{
+    int16 child = ctx->topic_nodes[parent].first_child;
+
+    while (child != -1) {
+        const Topic_Node *node = &ctx->topic_nodes[child];
+        if (node->label_size == label_size &&
+            topic_bytes_equal((const char *)arena_at(ctx->topic_arena, node->label_offset),
+                              label, label_size))
+            return child;
+        child = node->next_sibling;
+    }
+
+    return -1;
+}
+
+/*
+ * Walk up from a node releasing every node left without subscriptions and
+ * children, the root is never released.
+ */
+static void topic_trie_prune(Tera_Context *ctx, int16 index)
+{
+    while (index != TOPIC_TRIE_ROOT) {
+        Topic_Node *node = &ctx->topic_nodes[index];
+        if (node->subscriptions != -1 || node->first_child != -1 || node->plus_child != -1 ||
+            node->hash_child != -1)
+            return;
+
+        int16 parent_index = node->parent;
+        Topic_Node *parent = &ctx->topic_nodes[parent_index];
+
+        if (parent->plus_child == index) {
+            parent->plus_child = -1;
+        } else if (parent->hash_child == index) {
+            parent->hash_child = -1;
+        } else {
+            int16 *link = &parent->first_child;
+            while (*link != index)
+                link = &ctx->topic_nodes[*link].next_sibling;
+            *link = node->next_sibling;
+        }
+
+        topic_node_free(ctx, index);
+        index = parent_index;
+    }
+}
+
+void topic_trie_init(Tera_Context *ctx)
+{
+    for (usize i = 0; i < MAX_TOPIC_NODES; ++i)
+        ctx->topic_nodes[i].next_sibling = i + 1;
+
+    // The last slot points to an invalid index to signify the end of the list
+    ctx->topic_nodes[MAX_TOPIC_NODES - 1].next_sibling = -1;
+    ctx->topic_node_free_list_head                     = 0;
+
+    topic_node_alloc(ctx, -1, 0, 0);
+}
+
+int topic_trie_insert(Tera_Context *ctx, int16 subscription_index)
+{
+    Subscription_Data *sub  = &ctx->subscription_data[subscription_index];
+    Subscription_Filter *sf = &ctx->subscription_filters[subscription_index];
+    const char *filter      = (const char *)arena_at(ctx->topic_arena, sf->topic_offset);
+    int16 index             = TOPIC_TRIE_ROOT;
+    Topic_Levels levels;
+
+    // Every '/' opens a new level, possibly empty, e.g. "a//b" has 3 levels
+    topic_scan(filter, sf->topic_size, &levels);
+    if (levels.count > TOPIC_MAX_LEVELS) {
+        log_warning(">>>>: Topic filter exceeds %d levels", TOPIC_MAX_LEVELS);
+        return -1;
+    }
+
+    for (uint32 level = 0; level < levels.count; ++level) {
+        uint32 start     = topic_level_start(&levels, level);
+        usize label_size = levels.end[level] - start;
+        int16 child      = -1;
+
+        if (label_size == 1 && filter[start] == '+') {
+            child = ctx->topic_nodes[index].plus_child;
+            if (child == -1) {
+                child = topic_node_alloc(ctx, index, sf->topic_offset + start, label_size);
+                ctx->topic_nodes[index].plus_child = child;
+            }
+        } else if (label_size == 1 && filter[start] == '#') {
+            child = ctx->topic_nodes[index].hash_child;
+            if (child == -1) {
+                child = topic_node_alloc(ctx, index, sf->topic_offset + start, label_size);
+                ctx->topic_nodes[index].hash_child = child;
+            }
+        } else {
+            child = topic_node_find_child(ctx, index, filter + start, label_size);
+            if (child == -1) {
+                child = topic_node_alloc(ctx, index, sf->topic_offset + start, label_size);
+                if (child != -1) {
+                    ctx->topic_nodes[child].next_sibling = ctx->topic_nodes[index].first_child;
+                    ctx->topic_nodes[index].first_child  = child;
+                }
+            }
+        }
+
+        if (child == -1) {
+            log_warning(">>>>: Topic trie nodes exhausted");
+            topic_trie_prune(ctx, index);
+            return -1;
+        }
+
+        index = child;
+    }
+
+    sf->trie_node                         = index;
+    sub->trie_next                        = ctx->topic_nodes[index].subscriptions;
+    ctx->topic_nodes[index].subscriptions = subscription_index;
+
+    match_cache_invalidate(ctx);
+
+    return 0;
+}
+
+void topic_trie_remove(Tera_Context *ctx, int16 subscription_index)
+{
+    Subscription_Data *sub  = &ctx->subscription_data[subscription_index];
+    Subscription_Filter *sf = &ctx->subscription_filters[subscription_index];
+    int16 index             = sf->trie_node;
+    if (index == -1)
+        return;
+
+    int16 *link = &ctx->topic_nodes[index].subscriptions;
+    while (*link != -1 && *link != subscription_index)
+        link = &ctx->subscription_data[*link].trie_next;
+    if (*link == subscription_index)
+        *link = sub->trie_next;
+
+    sf->trie_node  = -1;
+    sub->trie_next = -1;
+
+    topic_trie_prune(ctx, index);
+    match_cache_invalidate(ctx);
+}
+
+static usize topic_node_collect(const Tera_Context *ctx, int16 index, int16 *out, usize count,
+                                usize out_size)
+{
+    int16 sub = ctx->topic_nodes[index].subscriptions;
+    while (sub != -1 && count < out_size) {
+        out[count++] = sub;
+        sub          = ctx->subscription_data[sub].trie_next;
+    }
+
+    return count;
+}
+
+usize topic_trie_match(const Tera_Context *ctx, const char *topic, const Topic_Levels *levels,
+                       int16 *out, usize out_size)
+{
+    // Each visit pushes at most two nodes, an exact and a '+' child, so the
+    // stack never grows past twice the depth of the trie
+    Trie_Visit stack[2 * TOPIC_MAX_LEVELS + 2];
+    usize depth    = 0;
+    usize count    = 0;
+
+    stack[depth++] = (Trie_Visit){.index = TOPIC_TRIE_ROOT, .level = 0};
+
+    while (depth > 0 && count < out_size) {
+        Trie_Visit visit       = stack[--depth];
+        const Topic_Node *node = &ctx->topic_nodes[visit.index];
+
+        // '#' matches the parent level as well as any number of levels after
+        if (node->hash_child != -1)
+            count = topic_node_collect(ctx, node->hash_child, out, count, out_size);
+
+        // The topic has been consumed entirely
+        if (visit.level == levels->count) {
+            count = topic_node_collect(ctx, visit.index, out, count, out_size);
+            continue;
+        }
+
+        // No filter goes deeper, only the '#' above could match what's left
+        if (visit.level >= TOPIC_MAX_LEVELS)
+            continue;
+
+        uint32 start = topic_level_start(levels, visit.level);
+        uint32 end   = levels->end[visit.level];
+        uint16 next  = visit.level + 1;
+
+        int16 child  = topic_node_find_child(ctx, visit.index, topic + start, end - start);
+        if (child != -1)
+            stack[depth++] = (Trie_Visit){.index = child, .level = next};
+
+        if (node->plus_child != -1)
+            stack[depth++] = (Trie_Visit){.index = node->plus_child, .level = next};
+    }
+
+    return count;
+}
+
+static bool exact_bucket_matches(const Tera_Context *ctx, const Exact_Bucket *bucket, uint32 hash,
+                                 const char *topic, usize topic_size)
+{
+    if (bucket->hash != hash)
+        return false;
+
+    // All the subscriptions of a bucket share the same filter, the head is enough
+    const Subscription_Filter *sub = &ctx->subscription_filters[bucket->head];
+    return sub->topic_size == topic_size &&
+           topic_bytes_equal((const char *)arena_at(ctx->topic_arena, sub->topic_offset), topic,
+                             topic_size);
+}
+
+static int32 exact_bucket_find(const Tera_Context *ctx, uint32 hash, const char *topic,
+                               usize topic_size)
+{
+    uint32 mask = MAX_EXACT_BUCKETS - 1;
+    uint32 slot = hash & mask;
+
+    for (usize probes = 0; probes < MAX_EXACT_BUCKETS; ++probes) {
+        const Exact_Bucket *bucket = &ctx->exact_buckets[slot];
+        if (bucket->head == -1)
+            return -1;
+        if (exact_bucket_matches(ctx, bucket, hash, topic, topic_size))
+            return slot;
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
+
+/*
+ * Backward shift deletion, entries following the emptied slot in the same
+ * probe run are moved back so that lookups never stop early and no tombstones
+ * are needed.
+ */
+static void exact_bucket_delete(Tera_Context *ctx, uint32 slot)
+{
+    uint32 mask = MAX_EXACT_BUCKETS - 1;
+    uint32 hole = slot;
+    uint32 next = (slot + 1) & mask;
+
+    while (ctx->exact_buckets[next].head != -1) {
+        uint32 home = ctx->exact_buckets[next].hash & mask;
+        // The entry can fill the hole only if that doesn't move it before its home slot
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            ctx->exact_buckets[hole] = ctx->exact_buckets[next];
+            hole                     = next;
+        }
+        next = (next + 1) & mask;
+    }
+
+    ctx->exact_buckets[hole].head = -1;
+}
+
+void exact_index_init(Tera_Context *ctx)
+{
+    for (usize i = 0; i < MAX_EXACT_BUCKETS; ++i)
+        ctx->exact_buckets[i] = (Exact_Bucket){.hash = 0, .head = -1};
+}
+
+int exact_index_insert(Tera_Context *ctx, int16 subscription_index)
+{
+    Subscription_Data *sub  = &ctx->subscription_data[subscription_index];
+    Subscription_Filter *sf = &ctx->subscription_filters[subscription_index];
+    const char *filter      = (const char *)arena_at(ctx->topic_arena, sf->topic_offset);
+    uint32 mask             = MAX_EXACT_BUCKETS - 1;
+    uint32 slot             = sf->topic_hash & mask;
+
+    for (usize probes = 0; probes < MAX_EXACT_BUCKETS; ++probes) {
+        Exact_Bucket *bucket = &ctx->exact_buckets[slot];
+        if (bucket->head == -1) {
+            bucket->hash    = sf->topic_hash;
+            bucket->head    = subscription_index;
+            sub->exact_next = -1;
+            match_cache_invalidate(ctx);
+            return 0;
+        }
+        if (exact_bucket_matches(ctx, bucket, sf->topic_hash, filter, sf->topic_size)) {
+            sub->exact_next = bucket->head;
+            bucket->head    = subscription_index;
+            match_cache_invalidate(ctx);
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    log_warning(">>>>: Exact subscriptions index full");
+    return -1;
+}
+
+void exact_index_remove(Tera_Context *ctx, int16 subscription_index)
+{
+    Subscription_Data *sub  = &ctx->subscription_data[subscription_index];
+    Subscription_Filter *sf = &ctx->subscription_filters[subscription_index];
+    if (sf->topic_offset == TOPIC_FILTER_NONE)
+        return;
+
+    const char *filter      = (const char *)arena_at(ctx->topic_arena, sf->topic_offset);
+    int32 slot              = exact_bucket_find(ctx, sf->topic_hash, filter, sf->topic_size);
+    if (slot < 0)
+        return;
+
+    int16 *link = &ctx->exact_buckets[slot].head;
+    while (*link != -1 && *link != subscription_index)
+        link = &ctx->subscription_data[*link].exact_next;
+    if (*link != subscription_index)
+        return;
+
+    *link           = sub->exact_next;
+    sub->exact_next = -1;
+
+    if (ctx->exact_buckets[slot].head == -1)
+        exact_bucket_delete(ctx, slot);
+
+    match_cache_invalidate(ctx);
+}
+
+usize exact_index_match(const Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                        int16 *out, usize count, usize out_size)
+{
+    int32 slot = exact_bucket_find(ctx, hash, topic, topic_size);
+    if (slot < 0)
+        return count;
+
+    int16 sub = ctx->exact_buckets[slot].head;
+    while (sub != -1 && count < out_size) {
+        out[count++] = sub;
+        sub          = ctx->subscription_data[sub].exact_next;
+    }
+
+    return count;
+}
+
+void match_cache_init(Tera_Context *ctx)
+{
+    for (usize i = 0; i < MAX_MATCH_CACHE_ENTRIES; ++i)
+        ctx->match_cache[i].epoch = 0;
+
+    ctx->match_epoch       = 1;
+    ctx->match_cache_stats = (Match_Cache_Stats){0};
+}
+
+void match_cache_invalidate(Tera_Context *ctx)
+{
+    // Entries of an epoch that wrapped around would look fresh again
+    if (++ctx->match_epoch == 0) {
+        for (usize i = 0; i < MAX_MATCH_CACHE_ENTRIES; ++i)
+            ctx->match_cache[i].epoch = 0;
+        ctx->match_epoch = 1;
+    }
+}
+
+int32 match_cache_lookup(Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                         int16 *out)
+{
+    const Match_Cache_Entry *entry = &ctx->match_cache[hash & (MAX_MATCH_CACHE_ENTRIES - 1)];
+
+    if (entry->epoch != ctx->match_epoch || entry->hash != hash ||
+        entry->topic_size != topic_size || !topic_bytes_equal(entry->topic, topic, topic_size)) {
+        ctx->match_cache_stats.misses++;
+        return -1;
+    }
+
+    memcpy(out, entry->matches, entry->count * sizeof(int16));
+    ctx->match_cache_stats.hits++;
+
+    return entry->count;
+}
+
+void match_cache_store(Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                       const int16 *matches, usize count)
+{
+    if (topic_size > MATCH_CACHE_TOPIC_SIZE || count > MATCH_CACHE_MAX_MATCHES) {
+        ctx->match_cache_stats.uncacheable++;
+        return;
+    }
+
+    Match_Cache_Entry *entry = &ctx->match_cache[hash & (MAX_MATCH_CACHE_ENTRIES - 1)];
+    if (entry->epoch == ctx->match_epoch)
+        ctx->match_cache_stats.evictions++;
+
+    entry->epoch      = ctx->match_epoch;
+    entry->hash       = hash;
+    entry->topic_size = topic_size;
+    entry->count      = count;
+    memcpy(entry->topic, topic, topic_size);
+    memcpy(entry->matches, matches, count * sizeof(int16));
+}
+
+// Blocks are kept aligned, so that the headers can be walked from the start
+static uint32 topic_filter_block_size(uint16 size)
+{
+    uint32 align = sizeof(Topic_Filter_Header);
+    return (sizeof(Topic_Filter_Header) + size + align - 1) & ~(align - 1);
+}
+
+uint8 *topic_filter_alloc(Tera_Context *ctx, int16 subscription_index, uint16 size)
+{
+    uint32 block_size = topic_filter_block_size(size);
+    uint8 *block      = arena_alloc(ctx->topic_arena, block_size);
+
+    if (!block) {
+        topic_filter_compact(ctx);
+        block = arena_alloc(ctx->topic_arena, block_size);
+        if (!block)
+            return NULL;
+    }
+
+    Topic_Filter_Header header = {.owner = subscription_index, .size = size};
+    memcpy(block, &header, sizeof(header));
+
+    ctx->subscription_filters[subscription_index].topic_offset =
+        arena_current_offset(ctx->topic_arena) + sizeof(header);
+
+    return block + sizeof(header);
+}
+
+void topic_filter_release(Tera_Context *ctx, int16 subscription_index)
+{
+    Subscription_Filter *sub = &ctx->subscription_filters[subscription_index];
+    if (sub->topic_offset == TOPIC_FILTER_NONE)
+        return;
+
+    Topic_Filter_Header *header =
+        arena_at(ctx->topic_arena, sub->topic_offset - sizeof(Topic_Filter_Header));
+    header->owner = -1;
+
+    sub->topic_offset = TOPIC_FILTER_NONE;
+}
+
+/*
+ * Point every node on the path of a wildcard subscription to its own filter,
+ * walking up from the last level. All the filters going through a node share
+ * its label bytes, and every node has at least one subscription below it, so
+ * after a compaction all the labels end up on live filters.
+ */
+static void topic_trie_relabel(Tera_Context *ctx, const Subscription_Filter *sub)
+{
+    const char *filter = (const char *)arena_at(ctx->topic_arena, sub->topic_offset);
+    int16 index        = sub->trie_node;
+    uint32 end         = sub->topic_size;
+
+    while (index != TOPIC_TRIE_ROOT) {
+        uint32 start = end;
+        while (start > 0 && filter[start - 1] != '/')
+            start--;
+
+        ctx->topic_nodes[index].label_offset = sub->topic_offset + start;
+
+        index = ctx->topic_nodes[index].parent;
+        end   = start > 0 ? start - 1 : 0;
+    }
+}
+
+void topic_filter_compact(Tera_Context *ctx)
+{
+    Arena *arena = ctx->topic_arena;
+    uint32 used  = arena->curr_offset;
+    uint32 read  = 0;
+    uint32 write = 0;
+
+    while (read < used) {
+        Topic_Filter_Header header = {0};
+        memcpy(&header, arena_at(arena, read), sizeof(header));
+
+        uint32 block_size = topic_filter_block_size(header.size);
+
+        // Live filters only ever move down, the source is never overwritten before it's read
+        if (header.owner != -1) {
+            if (write != read)
+                memmove(arena_at(arena, write), arena_at(arena, read),
+                        sizeof(header) + header.size);
+            ctx->subscription_filters[header.owner].topic_offset = write + sizeof(header);
+            write += block_size;
+        }
+
+        read += block_size;
+    }
+
+    arena_rewind(arena, write);
+
+    for (usize w = 0; w < BITMAP_WORDS(MAX_SUBSCRIPTIONS); ++w) {
+        for (uint64 bits = ctx->subscription_bitmap[w]; bits; bits &= bits - 1) {
+            usize i                        = w * 64 + __builtin_ctzll(bits);
+            const Subscription_Filter *sub = &ctx->subscription_filters[i];
+            if (sub->trie_node != -1)
+                topic_trie_relabel(ctx, sub);
+        }
+    }
+
+    log_debug(">>>>: Topic arena compacted, %u of %u bytes in use", write, used);
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "mqtt.h"
+#include "topic_scan.h"
+#include "types.h"
+
+/*
+ * Subscription indexes, filters without wildcards go in a hash table keyed by
+ * the filter bytes, wildcard filters in a trie of topic levels. A PUBLISH
+ * resolves all its exact subscribers with a single probe and only walks the
+ * wildcard branches of the trie.
+ */
+
+/*
+ * Wildcard index, a trie of topic filter levels stored in a flat array of
+ * nodes, each node is one level of one or more filters:
+ *
+ *   sensors/+/temperature, sensors/#, sensors/kitchen/humidity
+ *
+ *   (root)
+ *     └── sensors
+ *           ├── kitchen
+ *           │     └── humidity     [sub 2]
+ *           ├── +
+ *           │     └── temperature  [sub 0]
+ *           └── #                  [sub 1]
+ *
+ * Exact levels are kept in a sibling list, the `+` and `#` children of a node
+ * have a dedicated link so that wildcards are resolved without scanning.
+ * A node label points to the bytes of one of the filters going through it in
+ * the topic arena, subscriptions ending on a node are chained through
+ * Subscription_Data.trie_next.
+ *
+ * Matching a topic costs O(levels + matches) instead of a scan over all the
+ * subscriptions.
+ */
+typedef struct topic_node {
+    uint32 label_offset;
+    uint16 label_size;
+    int16 parent;
+    int16 first_child;  // Exact levels only
+    int16 next_sibling; // Next exact child of the parent or next free node
+    int16 plus_child;
+    int16 hash_child;
+    int16 subscriptions; // Head of the subscriptions list ending on this node
+} Topic_Node;
+
+void topic_trie_init(Tera_Context *ctx);
+
+/*
+ * Link an active subscription, its filter must have been already validated.
+ * Returns -1 if the filter is too deep or the node pool is exhausted.
+ */
+int topic_trie_insert(Tera_Context *ctx, int16 subscription_index);
+
+/*
+ * Unlink a subscription, pruning the nodes left without subscriptions and
+ * children
+ */
+void topic_trie_remove(Tera_Context *ctx, int16 subscription_index);
+
+/*
+ * Collect the indexes of all the subscriptions matching a topic name, levels
+ * being its topic_scan. Returns the number of matches written in out.
+ */
+usize topic_trie_match(const Tera_Context *ctx, const char *topic, const Topic_Levels *levels,
+                       int16 *out, usize out_size);
+
+/*
+ * Exact index, open addressing with linear probing, one bucket for each
+ * distinct filter pointing to the list of its subscriptions, chained through
+ * Subscription_Data.exact_next. An empty bucket has head set to -1.
+ */
+typedef struct exact_bucket {
+    uint32 hash;
+    int16 head;
+} Exact_Bucket;
+
+// FNV-1a over the filter or topic bytes
+static inline uint32 topic_hash(const char *topic, usize topic_size)
+{
+    uint32 hash = 2166136261u;
+    for (usize i = 0; i < topic_size; ++i) {
+        hash ^= (uint8)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void exact_index_init(Tera_Context *ctx);
+
+/*
+ * Link an active subscription without wildcards, its topic_hash must be set.
+ * Returns -1 if the table is full.
+ */
+int exact_index_insert(Tera_Context *ctx, int16 subscription_index);
+void exact_index_remove(Tera_Context *ctx, int16 subscription_index);
+
+/*
+ * Same as topic_trie_match for the exact filters, hash is the topic_hash of
+ * the topic name. Matches are appended to out starting at count, returns the
+ * new count.
+ */
+usize exact_index_match(const Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                        int16 *out, usize count, usize out_size);
+
+#define MATCH_CACHE_TOPIC_SIZE  64
+#define MATCH_CACHE_MAX_MATCHES 16
+
+/*
+ * Match cache, the subscriptions matching the topic names published most
+ * recently, as found by the exact index and the trie. Devices keep publishing
+ * to the same topics, a hit replaces both lookups with a copy of the list.
+ * Direct mapped on topic_hash, an entry only holds topics up to
+ * MATCH_CACHE_TOPIC_SIZE bytes with up to MATCH_CACHE_MAX_MATCHES matches,
+ * the others always go through the indexes.
+ *
+ * Every change to the filter set bumps the epoch of the context, entries
+ * filled under a previous epoch are stale, so invalidating the whole cache is
+ * a single increment.
+ */
+typedef struct match_cache_entry {
+    uint32 epoch; // 0 if never filled
+    uint32 hash;
+    uint16 topic_size;
+    uint16 count;
+    int16 matches[MATCH_CACHE_MAX_MATCHES];
+    char topic[MATCH_CACHE_TOPIC_SIZE];
+} Match_Cache_Entry;
+
+// Cumulative since startup, reported along with the pipeline stats
+typedef struct match_cache_stats {
+    uint64 hits;
+    uint64 misses;
+    uint64 evictions;   // Misses that replaced the entry of another live topic
+    uint64 uncacheable; // Topics or match lists too big for an entry
+} Match_Cache_Stats;
+
+void match_cache_init(Tera_Context *ctx);
+void match_cache_invalidate(Tera_Context *ctx);
+
+/*
+ * Copy the cached matches of a topic name to out, which must have room for
+ * MATCH_CACHE_MAX_MATCHES entries. Returns their number, -1 on a miss.
+ */
+int32 match_cache_lookup(Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                         int16 *out);
+
+// Fill the entry of a topic name after a miss, if it fits
+void match_cache_store(Tera_Context *ctx, const char *topic, usize topic_size, uint32 hash,
+                       const int16 *matches, usize count);
+
+#define TOPIC_FILTER_NONE UINT32_MAX
+
+/*
+ * Filter storage, the topic arena holds the filters of the subscriptions, each
+ * one preceded by a header with its owner and padded to the arena alignment:
+ *
+ *   [ 3 | 14 ] sensors/+/temp [ -1 | 5 ] a/b/c [ 7 | 9 ] sensors/# ...
+ *
+ * Released filters are only marked, once the arena runs out of room the live
+ * ones are slid down over the released ones in a single sweep, relocating the
+ * offsets of their subscriptions and the trie labels pointing into them. The
+ * space left behind by unsubscribing or disconnecting clients is reclaimed
+ * without any allocation.
+ */
+typedef struct topic_filter_header {
+    int16 owner; // Subscription index, -1 once released
+    uint16 size;
+} Topic_Filter_Header;
+
+/*
+ * Reserve room for the filter of a subscription and set its topic_offset,
+ * compacting the arena if it's full. Returns NULL if there's no room even
+ * after compaction.
+ */
+uint8 *topic_filter_alloc(Tera_Context *ctx, int16 subscription_index, uint16 size);
+void topic_filter_release(Tera_Context *ctx, int16 subscription_index);
+void topic_filter_compact(Tera_Context *ctx);
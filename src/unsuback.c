@@ -1,11 +1,49 @@
+#include "logger.h"
 #include "mqtt.h"
 #include "tera_internal.h"
+#include <string.h>
+
+#define DEFAULT_UNSUBACK_BYTE 0xB0
 
 void mqtt_unsuback_write(Tera_Context *ctx, const Client_Data *cdata, const Subscribe_Result *r)
 {
-    (void)ctx;
-    (void)cdata;
-    (void)r;
+    if (r->acknowledged || r->topic_filter_count == 0)
+        return;
+
+    Send_Queue *queue   = connection_send_queue(ctx, cdata->conn_id);
+    isize bytes_written = 0;
+    bool v5             = cdata->mqtt_version == MQTT_V5;
+
+    // Calculate remaining length: packet_id(2) + properties_length(1) + reason_codes(n) on v5
+    usize remaining_length = sizeof(uint16);
+    if (v5)
+        remaining_length += sizeof(uint8) + r->topic_filter_count;
+
+    usize header_size = sizeof(uint8) + mqtt_variable_length_encoded_length(remaining_length);
+    Buffer *buf       = send_queue_scratch_begin(queue, header_size + remaining_length);
+    if (!buf) {
+        log_warning(">>>>: Send queue full, UNSUBACK dropped");
+        return;
+    }
+
+    // Fixed Header
+    bytes_written += buffer_write_u8(buf, DEFAULT_UNSUBACK_BYTE);
+    bytes_written += mqtt_variable_length_write(buf, remaining_length);
+
+    // The scratch was sized for the whole frame, the rest is stored unchecked
+    uint8 *dst = buffer_reserve(buf, remaining_length);
+
+    dst += buffer_store_u16(dst, r->packet_id);
+
+    // Variable Header (0 properties length) and a reason code per topic filter
+    if (v5) {
+        dst += buffer_store_u8(dst, 0);
+        memcpy(dst, r->reason_codes, r->topic_filter_count);
+    }
+    bytes_written += remaining_length;
+
+    send_queue_scratch_commit(queue);
 
-    // TODO
+    log_info("sent: UNSUBACK %zd bytes, packet_id: %d, topics: %d", bytes_written, r->packet_id,
+             r->topic_filter_count);
 }
@@ -3,83 +3,77 @@
 #include "tera_internal.h"
 
 MQTT_Decode_Result mqtt_unsubscribe_read(Tera_Context *ctx, const Client_Data *cdata,
-                                         Subscribe_Result *r)
+                                         MQTT_Frame *frame, Subscribe_Result *r)
 {
-    (void)r;
+    Buffer *buf         = &frame->payload;
+    usize packet_length = frame->header.remaining_length;
+    uint16 id           = 0;
 
-    Buffer *buf     = &ctx->connection_data[cdata->conn_id].recv_buffer;
-    usize start_pos = buf->read_pos;
+    r->acknowledged     = false;
 
-    // Read packet type and flags
-    if (buffer_read_struct(buf, "B", &(uint8){0}) != 1) {
-        log_error("recv: UNSUBSCRIBE - failed to read packet header");
-        return MQTT_DECODE_ERROR;
-    }
-
-    // Read remaining length
-    usize packet_length = 0;
-    int length_bytes    = mqtt_variable_length_read(buf, &packet_length);
-    if (length_bytes < 0) {
-        log_error("recv: UNSUBSCRIBE - invalid variable length encoding");
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
-
-    // Validate we have enough data for the complete packet
-    usize total_packet_size =
-        sizeof(uint8) + length_bytes + packet_length; // header + length + payload
-    if (start_pos + total_packet_size > buf->size) {
-        log_debug("recv: UNSUBSCRIBE - incomplete packet - need %zu more bytes",
-                  (start_pos + total_packet_size) - buf->size);
-        buf->read_pos = start_pos; // Restore position
-        return MQTT_DECODE_INCOMPLETE;
-    }
-
-    uint16 id = 0;
-    // TODO set ID
-    if (buffer_read_struct(buf, "H", &id) != sizeof(uint16))
+    if (buffer_read_u16(buf, &id) != sizeof(uint16))
         return MQTT_DECODE_ERROR;
     packet_length -= sizeof(uint16);
+    r->packet_id = id;
 
-    usize sub_id = 0;
-
+    // User properties are the only ones allowed on UNSUBSCRIBE, nothing to act on
     if (cdata->mqtt_version == MQTT_V5) {
         usize properties_length = 0;
         int prop_length_bytes   = mqtt_variable_length_read(buf, &properties_length);
-        if (prop_length_bytes < 0)
+        if (prop_length_bytes == 0 || prop_length_bytes + properties_length > packet_length)
             return MQTT_DECODE_ERROR;
 
-        packet_length -= prop_length_bytes;
-
-        if (properties_length > 0) {
-
-            // Skip Properties for now (should be parsed in full implementation)
-            if (buffer_skip(buf, sizeof(uint8)) != sizeof(uint8))
-                return MQTT_DECODE_ERROR;
-
-            usize sub_id_length = mqtt_variable_length_read(buf, &sub_id);
-
-            if (buffer_skip(buf, properties_length - sizeof(uint8) - sub_id_length) !=
-                properties_length - sizeof(uint8) - sub_id_length)
-                return MQTT_DECODE_ERROR;
+        if (buffer_skip(buf, properties_length) != properties_length)
+            return MQTT_DECODE_ERROR;
 
-            packet_length -= properties_length;
-        }
+        packet_length -= prop_length_bytes + properties_length;
     }
 
     /*
      * Read in a loop all remaining bytes specified by len of the Fixed Header.
-     * From now on the payload consists of 3-tuples formed by:
+     * From now on the payload consists of 2-tuples formed by:
      *  - topic length
      *  - topic filter (string)
-     *  - qos
      */
     while (packet_length > 0) {
-        // TODO
-        // Decode topic filters (u16 length + string)
-        // Scan existing subscriptions for the current client
-        // Collect the indexes in memory of each, take care of wildcards (# and +)
+        char filter[MAX_PACKET_SIZE];
+        uint16 filter_size = 0;
+
+        if (r->topic_filter_count == MAX_TOPIC_FILTERS_PER_SUBSCRIBE) {
+            log_warning("recv: UNSUBSCRIBE - more than %d topic filters",
+                        MAX_TOPIC_FILTERS_PER_SUBSCRIBE);
+            return MQTT_DECODE_INVALID;
+        }
+
+        if (packet_length < sizeof(uint16) || buffer_read_u16(buf, &filter_size) != sizeof(uint16))
+            return MQTT_DECODE_ERROR;
+        packet_length -= sizeof(uint16);
+
+        if (filter_size > packet_length || filter_size > sizeof(filter))
+            return MQTT_DECODE_ERROR;
+
+        // A filter that isn't valid UTF-8 makes the whole packet malformed
+        if (buffer_read_utf8(filter, buf, filter_size) != filter_size)
+            return MQTT_DECODE_INVALID;
+        packet_length -= filter_size;
+
+        Topic_Levels levels;
+        topic_scan(filter, filter_size, &levels);
+
+        UNSUBACK_Reason_Code rc = UNSUBACK_TOPIC_FILTER_INVALID;
+        if (topic_filter_is_valid(filter, filter_size, &levels))
+            rc = mqtt_subscription_remove(ctx, cdata->conn_id, filter, filter_size) > 0
+                     ? UNSUBACK_SUCCESS
+                     : UNSUBACK_NO_SUBSCRIPTION_EXISTED;
+
+        log_info("recv: UNSUBSCRIBE id: %d, cid: %d, rc: 0x%02X", id, cdata->conn_id, rc);
+
+        r->reason_codes[r->topic_filter_count++] = rc;
     }
 
+    // At least one topic filter is required (MQTT-3.10.3-2)
+    if (r->topic_filter_count == 0)
+        return MQTT_DECODE_INVALID;
+
     return MQTT_DECODE_SUCCESS;
 }
@@ -0,0 +1,421 @@
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Single buffer group for all the receives
+#define URING_BUFFER_GROUP 0
+
+struct io_ring {
+    int fd;
+
+    // Submission queue, shared with the kernel
+    uint32 *sq_head;
+    uint32 *sq_tail;
+    uint32 *sq_array;
+    uint32 sq_mask;
+    uint32 sq_entries;
+    uint32 sq_local_tail;
+    struct io_uring_sqe *sqes;
+
+    // Completion queue, shared with the kernel
+    uint32 *cq_head;
+    uint32 *cq_tail;
+    uint32 cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers ring, the buffers themselves are owned by the caller
+    struct io_uring_buf_ring *buf_ring;
+    uint8 *buffers;
+    uint32 buffer_size;
+    uint16 buffer_count;
+
+    void *ring_ptr;
+    usize ring_len;
+    usize sqes_len;
+    usize buf_ring_len;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                              void *arg, usize argsz)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * user_data layout
+ *
+ * |  63 .. 32  |  31 .. 8   | 7 .. 0 |
+ * |------------|------------|--------|
+ * | descriptor | generation |   op   |
+ */
+static inline uint64 user_data_pack(Uring_Op op, int fd, uint32 generation)
+{
+    return ((uint64)(uint32)fd << 32) | ((uint64)(generation & 0xFFFFFF) << 8) | (uint64)op;
+}
+
+static void uring_release_mappings(IO_Ring *ring)
+{
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->ring_ptr)
+        munmap(ring->ring_ptr, ring->ring_len);
+    if (ring->fd >= 0)
+        close(ring->fd);
+}
+
+IO_Ring *uring_create(uint32 entries, void *buffers, uint32 buffer_size, uint16 buffer_count)
+{
+    // The provided buffers ring requires a power of two number of entries
+    if (!buffers || buffer_count == 0 || (buffer_count & (buffer_count - 1)) != 0)
+        return NULL;
+
+    IO_Ring *ring = calloc(1, sizeof(IO_Ring));
+    if (!ring)
+        return NULL;
+
+    // Multishot requests post many completions per submission, give the CQ
+    // some headroom over the SQ
+    struct io_uring_params params = {.flags = IORING_SETUP_CQSIZE, .cq_entries = entries * 4};
+
+    ring->fd                      = sys_io_uring_setup(entries, &params);
+    if (ring->fd < 0)
+        goto err;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+        goto err;
+
+    usize sq_len   = params.sq_off.array + params.sq_entries * sizeof(uint32);
+    usize cq_len   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED) {
+        ring->ring_ptr = NULL;
+        goto err;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes     = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto err;
+    }
+
+    uint8 *ptr          = ring->ring_ptr;
+    ring->sq_head       = (uint32 *)(ptr + params.sq_off.head);
+    ring->sq_tail       = (uint32 *)(ptr + params.sq_off.tail);
+    ring->sq_array      = (uint32 *)(ptr + params.sq_off.array);
+    ring->sq_mask       = *(uint32 *)(ptr + params.sq_off.ring_mask);
+    ring->sq_entries    = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    ring->cq_head       = (uint32 *)(ptr + params.cq_off.head);
+    ring->cq_tail       = (uint32 *)(ptr + params.cq_off.tail);
+    ring->cq_mask       = *(uint32 *)(ptr + params.cq_off.ring_mask);
+    ring->cqes          = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+
+    // Provided buffers ring, must be page aligned, hence the mmap
+    ring->buf_ring_len  = buffer_count * sizeof(struct io_uring_buf);
+    ring->buf_ring      = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        goto err;
+    }
+
+    struct io_uring_buf_reg reg = {.ring_addr    = (uint64)(uintptr_t)ring->buf_ring,
+                                   .ring_entries = buffer_count,
+                                   .bgid         = URING_BUFFER_GROUP};
+    if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        goto err;
+
+    ring->buffers      = buffers;
+    ring->buffer_size  = buffer_size;
+    ring->buffer_count = buffer_count;
+
+    for (uint16 i = 0; i < buffer_count; ++i) {
+        struct io_uring_buf *buf = &ring->buf_ring->bufs[i];
+        buf->addr                = (uint64)(uintptr_t)(ring->buffers + (usize)i * buffer_size);
+        buf->len                 = buffer_size;
+        buf->bid                 = i;
+    }
+    __atomic_store_n(&ring->buf_ring->tail, buffer_count, __ATOMIC_RELEASE);
+
+    return ring;
+
+err:
+    uring_release_mappings(ring);
+    free(ring);
+    return NULL;
+}
+
+void uring_free(IO_Ring *ring)
+{
+    uring_release_mappings(ring);
+    free(ring);
+}
+
+static int uring_submit(IO_Ring *ring, unsigned min_complete, unsigned flags, void *arg,
+                        usize argsz)
+{
+    uint32 to_submit = ring->sq_local_tail - *ring->sq_tail;
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    return sys_io_uring_enter(ring->fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static struct io_uring_sqe *uring_get_sqe(IO_Ring *ring)
+{
+    uint32 head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_local_tail - head >= ring->sq_entries) {
+        // SQ full, flush what's queued so far without waiting for anything
+        if (uring_submit(ring, 0, 0, NULL, 0) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sq_local_tail - head >= ring->sq_entries)
+            return NULL;
+    }
+
+    uint32 index             = ring->sq_local_tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+int uring_accept_multishot(IO_Ring *ring, int listen_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = listen_fd;
+    sqe->ioprio       = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data    = user_data_pack(URING_ACCEPT, listen_fd, 0);
+
+    return 0;
+}
+
+int uring_recv_multishot(IO_Ring *ring, int fd, uint32 generation)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = fd;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = user_data_pack(URING_RECV, fd, generation);
+
+    return 0;
+}
+
+/*
+ * MSG_DONTWAIT makes the send run inline during the next io_uring_enter and
+ * complete with -EAGAIN (or a short count) instead of being parked in the
+ * kernel, so the data is never read after the submitting call returns and the
+ * caller keeps full ownership of its buffer.
+ */
+int uring_sendmsg(IO_Ring *ring, int fd, uint32 generation, const struct msghdr *msg)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode    = IORING_OP_SENDMSG;
+    sqe->fd        = fd;
+    sqe->addr      = (uint64)(uintptr_t)msg;
+    sqe->len       = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    sqe->user_data = user_data_pack(URING_SEND, fd, generation);
+
+    return 0;
+}
+
+static int uring_poll(IO_Ring *ring, Uring_Op op, int fd, uint32 generation, uint32 events)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe)
+        return -1;
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = fd;
+    sqe->poll32_events = events;
+    sqe->user_data     = user_data_pack(op, fd, generation);
+
+    return 0;
+}
+
+int uring_poll_writable(IO_Ring *ring, int fd, uint32 generation)
+{
+    return uring_poll(ring, URING_POLL_WRITE, fd, generation, POLLOUT);
+}
+
+int uring_poll_readable(IO_Ring *ring, int fd, uint32 generation)
+{
+    return uring_poll(ring, URING_POLL_READ, fd, generation, POLLIN);
+}
+
+/*
+ * Submit everything queued since the last call and wait for at least one
+ * completion or the timeout, all in a single io_uring_enter. Returns the
+ * number of completions ready to be consumed through uring_next_event.
+ */
+int uring_wait(IO_Ring *ring, time_t timeout_ms)
+{
+    struct __kernel_timespec ts        = {.tv_sec  = timeout_ms / 1000,
+                                          .tv_nsec = (timeout_ms % 1000) * 1000000};
+    struct io_uring_getevents_arg args = {.sigmask_sz = _NSIG / 8,
+                                          .ts = timeout_ms >= 0 ? (uint64)(uintptr_t)&ts : 0};
+
+    int result = uring_submit(ring, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &args,
+                              sizeof(args));
+    if (result < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+
+    return __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) - *ring->cq_head;
+}
+
+bool uring_next_event(IO_Ring *ring, Uring_Event *event)
+{
+    uint32 head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+
+    event->op                      = (Uring_Op)(cqe->user_data & 0xFF);
+    event->generation              = (uint32)((cqe->user_data >> 8) & 0xFFFFFF);
+    event->fd                      = (int)(cqe->user_data >> 32);
+    event->res                     = cqe->res;
+    event->more                    = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    event->data                    = NULL;
+    event->buffer_id               = -1;
+
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        event->buffer_id = (int32)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        event->data      = ring->buffers + (usize)event->buffer_id * ring->buffer_size;
+    }
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+void uring_buffer_release(IO_Ring *ring, int32 buffer_id)
+{
+    if (buffer_id < 0)
+        return;
+
+    uint16 tail              = ring->buf_ring->tail;
+    uint8 *data              = ring->buffers + (usize)buffer_id * ring->buffer_size;
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->buffer_count - 1)];
+    buf->addr                = (uint64)(uintptr_t)data;
+    buf->len                 = ring->buffer_size;
+    buf->bid                 = (uint16)buffer_id;
+    __atomic_store_n(&ring->buf_ring->tail, (uint16)(tail + 1), __ATOMIC_RELEASE);
+}
+
+#else
+
+IO_Ring *uring_create(uint32 entries, void *buffers, uint32 buffer_size, uint16 buffer_count)
+{
+    (void)entries;
+    (void)buffers;
+    (void)buffer_size;
+    (void)buffer_count;
+    return NULL;
+}
+
+void uring_free(IO_Ring *ring) { (void)ring; }
+
+int uring_accept_multishot(IO_Ring *ring, int listen_fd)
+{
+    (void)ring;
+    (void)listen_fd;
+    return -1;
+}
+
+int uring_recv_multishot(IO_Ring *ring, int fd, uint32 generation)
+{
+    (void)ring;
+    (void)fd;
+    (void)generation;
+    return -1;
+}
+
+int uring_sendmsg(IO_Ring *ring, int fd, uint32 generation, const struct msghdr *msg)
+{
+    (void)ring;
+    (void)fd;
+    (void)generation;
+    (void)msg;
+    return -1;
+}
+
+int uring_poll_writable(IO_Ring *ring, int fd, uint32 generation)
+{
+    (void)ring;
+    (void)fd;
+    (void)generation;
+    return -1;
+}
+
+int uring_poll_readable(IO_Ring *ring, int fd, uint32 generation)
+{
+    (void)ring;
+    (void)fd;
+    (void)generation;
+    return -1;
+}
+
+int uring_wait(IO_Ring *ring, time_t timeout_ms)
+{
+    (void)ring;
+    (void)timeout_ms;
+    return -1;
+}
+
+bool uring_next_event(IO_Ring *ring, Uring_Event *event)
+{
+    (void)ring;
+    (void)event;
+    return false;
+}
+
+void uring_buffer_release(IO_Ring *ring, int32 buffer_id)
+{
+    (void)ring;
+    (void)buffer_id;
+}
+
+#endif
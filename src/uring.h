@@ -0,0 +1,57 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/*
+ * Completion based I/O backend on top of io_uring, used as an alternative to
+ * the readiness based IO_Mux when the kernel supports it.
+ *
+ * - Accepts are armed once in multishot mode, each new connection produces a
+ *   completion carrying the new descriptor
+ * - Receives are multishot as well, the kernel picks a buffer out of a
+ *   provided-buffer ring registered at creation time, the caller hands it back
+ *   with uring_buffer_release once consumed
+ * - Sends are vectored and only queued, all the pending submissions go to the
+ *   kernel in a single io_uring_enter together with the wait for completions
+ *
+ * Every request is tagged with the descriptor and a caller defined generation,
+ * so that late completions for a recycled descriptor can be told apart.
+ *
+ * On platforms without io_uring, uring_create always returns NULL.
+ */
+typedef struct io_ring IO_Ring;
+
+typedef enum uring_op {
+    URING_ACCEPT     = 1,
+    URING_RECV       = 2,
+    URING_SEND       = 3,
+    URING_POLL_WRITE = 4,
+    URING_POLL_READ  = 5,
+} Uring_Op;
+
+typedef struct uring_event {
+    Uring_Op op;
+    int fd;
+    uint32 generation;
+    int32 res;         // Bytes transferred, accepted descriptor or -errno
+    bool more;         // Whether the multishot request is still armed
+    const uint8 *data; // Received bytes, valid until the buffer is released
+    int32 buffer_id;   // Provided buffer of a receive, -1 if none
+} Uring_Event;
+
+IO_Ring *uring_create(uint32 entries, void *buffers, uint32 buffer_size, uint16 buffer_count);
+void uring_free(IO_Ring *ring);
+
+int uring_accept_multishot(IO_Ring *ring, int listen_fd);
+int uring_recv_multishot(IO_Ring *ring, int fd, uint32 generation);
+// The message and its iovecs must stay valid until the completion is reaped
+int uring_sendmsg(IO_Ring *ring, int fd, uint32 generation, const struct msghdr *msg);
+int uring_poll_writable(IO_Ring *ring, int fd, uint32 generation);
+int uring_poll_readable(IO_Ring *ring, int fd, uint32 generation);
+
+int uring_wait(IO_Ring *ring, time_t timeout_ms);
+bool uring_next_event(IO_Ring *ring, Uring_Event *event);
+void uring_buffer_release(IO_Ring *ring, int32 buffer_id);
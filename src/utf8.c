@@ -0,0 +1,284 @@
+#include "utf8.h"
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+typedef bool (*Utf8_Kernel)(uint8 *dst, const uint8 *src, usize size);
+
+/*
+ * Validate the rest of a string from a sequence boundary, following table 3-7
+ * of the Unicode standard for the ranges allowed after each lead byte.
+ */
+static bool utf8_validate_scalar(const uint8 *src, usize size)
+{
+    usize i = 0;
+
+    while (i < size) {
+        uint8 lead = src[i];
+
+        if (lead < 0x80) {
+            if (lead == 0)
+                return false;
+            i++;
+            continue;
+        }
+
+        usize length = 0;
+        uint8 min    = 0x80;
+        uint8 max    = 0xBF;
+
+        if (lead >= 0xC2 && lead <= 0xDF) {
+            length = 2;
+        } else if (lead >= 0xE0 && lead <= 0xEF) {
+            length = 3;
+            if (lead == 0xE0)
+                min = 0xA0; // Overlong
+            else if (lead == 0xED)
+                max = 0x9F; // Surrogates
+        } else if (lead >= 0xF0 && lead <= 0xF4) {
+            length = 4;
+            if (lead == 0xF0)
+                min = 0x90; // Overlong
+            else if (lead == 0xF4)
+                max = 0x8F; // Past U+10FFFF
+        } else {
+            return false;
+        }
+
+        if (i + length > size || src[i + 1] < min || src[i + 1] > max)
+            return false;
+
+        for (usize j = 2; j < length; ++j)
+            if ((src[i + j] & 0xC0) != 0x80)
+                return false;
+
+        i += length;
+    }
+
+    return true;
+}
+
+#if defined(__SSE2__)
+
+static bool utf8_copy_sse2(uint8 *dst, const uint8 *src, usize size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    usize i            = 0;
+
+    // A high bit or a zero byte in either vector ends the ASCII run
+    for (; i + 32 <= size; i += 32) {
+        __m128i low  = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i high = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        _mm_storeu_si128((__m128i *)(dst + i), low);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), high);
+
+        __m128i nul  = _mm_cmpeq_epi8(_mm_min_epu8(low, high), zero);
+        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(low, high), nul)) != 0)
+            break;
+    }
+
+    // No byte shuffle in SSE2, what's past the ASCII run goes byte by byte
+    memcpy(dst + i, src + i, size - i);
+    return utf8_validate_scalar(src + i, size - i);
+}
+
+/*
+ * Lookup validation, from "Validating UTF-8 In Less Than One Instruction Per
+ * Byte" by Keiser and Lemire. Every error shows up in the first two bytes of
+ * a sequence, three tables indexed by the high and low nibble of the previous
+ * byte and the high nibble of the current one flag the errors each nibble can
+ * take part in, a byte pair is wrong if a bit is set in all three. The only
+ * check left is for the third and fourth bytes of the longer sequences, which
+ * must be continuations and are the only continuations not flagged as
+ * following another one.
+ */
+#define TOO_SHORT      (1 << 0)         // 11______ 0_______ or 11______ 11______
+#define TOO_LONG       (1 << 1)         // 0_______ 10______
+#define OVERLONG_3     (1 << 2)         // 11100000 100_____
+#define TOO_LARGE      (1 << 3)         // 11110100 1001____, 11110100 101_____ and above
+#define SURROGATE      (1 << 4)         // 11101101 101_____
+#define OVERLONG_2     (1 << 5)         // 1100000_ 10______
+#define TOO_LARGE_1000 (1 << 6)         // 11110101 1000____ and above
+#define OVERLONG_4     (1 << 6)         // 11110000 1000____
+#define TWO_CONTS      ((int8)(1 << 7)) // 10______ 10______
+#define CARRY          (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// The same 16 entries in both lanes, vpshufb looks up each lane on its own
+#define LOOKUP_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2"))) static inline __m256i nibble_high(__m256i input)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(input, 4), _mm256_set1_epi8(0x0F));
+}
+
+// The input shifted by n bytes, with the last n bytes of the previous one in front
+__attribute__((target("avx2"))) static inline __m256i prev_bytes(__m256i input, __m256i prev,
+                                                                 int n)
+{
+    __m256i carried = _mm256_permute2x128_si256(prev, input, 0x21);
+    switch (n) {
+    case 1:
+        return _mm256_alignr_epi8(input, carried, 15);
+    case 2:
+        return _mm256_alignr_epi8(input, carried, 14);
+    default:
+        return _mm256_alignr_epi8(input, carried, 13);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i utf8_block_errors(__m256i input,
+                                                                        __m256i prev)
+{
+    const __m256i byte_1_high_table =
+        LOOKUP_TABLE(TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+                     TOO_LONG, TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS, TOO_SHORT | OVERLONG_2,
+                     TOO_SHORT, TOO_SHORT | OVERLONG_3 | SURROGATE,
+                     TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);
+    const __m256i byte_1_low_table = LOOKUP_TABLE(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4, CARRY | OVERLONG_2, CARRY, CARRY,
+        CARRY | TOO_LARGE, CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE, CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000);
+    const __m256i byte_2_high_table = LOOKUP_TABLE(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE, TOO_SHORT, TOO_SHORT,
+        TOO_SHORT, TOO_SHORT);
+
+    __m256i prev1       = prev_bytes(input, prev, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table, nibble_high(prev1));
+    __m256i byte_1_low  = _mm256_shuffle_epi8(byte_1_low_table,
+                                              _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table, nibble_high(input));
+    __m256i special     = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // Third and fourth bytes, only 111_____ and 1111____ stay at 0x80 or above
+    __m256i third       = _mm256_subs_epu8(prev_bytes(input, prev, 2), _mm256_set1_epi8(0x60));
+    __m256i fourth      = _mm256_subs_epu8(prev_bytes(input, prev, 3), _mm256_set1_epi8(0x70));
+    __m256i must_be_2_3 =
+        _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((int8)0x80));
+
+    return _mm256_xor_si256(must_be_2_3, special);
+}
+
+// Lead bytes in the last three positions still waiting for their continuations
+__attribute__((target("avx2"))) static inline __m256i utf8_block_incomplete(__m256i input)
+{
+    const __m256i max = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                         -1, (int8)(0xF0 - 1), (int8)(0xE0 - 1),
+                                         (int8)(0xC0 - 1));
+    return _mm256_subs_epu8(input, max);
+}
+
+typedef struct utf8_state {
+    __m256i error;
+    __m256i prev;
+    __m256i incomplete;
+} Utf8_State;
+
+__attribute__((target("avx2"))) static inline void utf8_check(Utf8_State *state, __m256i input)
+{
+    if (_mm256_movemask_epi8(input) == 0) {
+        state->error = _mm256_or_si256(state->error, state->incomplete);
+    } else {
+        state->error      = _mm256_or_si256(state->error, utf8_block_errors(input, state->prev));
+        state->incomplete = utf8_block_incomplete(input);
+    }
+
+    state->prev = input;
+}
+
+__attribute__((target("avx2"))) static bool utf8_copy_avx2(uint8 *dst, const uint8 *src,
+                                                           usize size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    Utf8_State state   = {zero, zero, zero};
+    usize i            = 0;
+
+    // Two vectors at a time, ASCII pairs only check for U+0000 and a pending sequence
+    for (; i + 64 <= size; i += 64) {
+        __m256i low  = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i high = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_storeu_si256((__m256i *)(dst + i), low);
+        _mm256_storeu_si256((__m256i *)(dst + i + 32), high);
+
+        __m256i nul  = _mm256_cmpeq_epi8(_mm256_min_epu8(low, high), zero);
+        state.error  = _mm256_or_si256(state.error, nul);
+
+        if (_mm256_movemask_epi8(_mm256_or_si256(low, high)) == 0) {
+            state.error = _mm256_or_si256(state.error, state.incomplete);
+            state.prev  = high;
+        } else {
+            utf8_check(&state, low);
+            utf8_check(&state, high);
+        }
+    }
+
+    for (; i < size; i += 32) {
+        __m256i input;
+
+        if (i + 32 <= size) {
+            input = _mm256_loadu_si256((const __m256i *)(src + i));
+            _mm256_storeu_si256((__m256i *)(dst + i), input);
+        } else {
+            // Padded with spaces, a sequence cut by the end of the string shows up as too short
+            uint8 tail[32];
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, src + i, size - i);
+            memcpy(dst + i, src + i, size - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+
+        state.error = _mm256_or_si256(state.error, _mm256_cmpeq_epi8(input, zero));
+        utf8_check(&state, input);
+    }
+
+    state.error = _mm256_or_si256(state.error, state.incomplete);
+    return _mm256_testz_si256(state.error, state.error);
+}
+
+static Utf8_Kernel utf8_kernel = utf8_copy_sse2;
+
+#else
+
+#define ASCII_HIGH_BITS 0x8080808080808080ull
+#define ASCII_LOW_BITS  0x0101010101010101ull
+
+// ASCII 8 bytes at a time, a word with a high bit or a zero byte ends the run
+static bool utf8_copy_scalar(uint8 *dst, const uint8 *src, usize size)
+{
+    usize i = 0;
+
+    memcpy(dst, src, size);
+
+    for (; i + sizeof(uint64) <= size; i += sizeof(uint64)) {
+        uint64 word = 0;
+        memcpy(&word, src + i, sizeof(word));
+        if ((word | ((word - ASCII_LOW_BITS) & ~word)) & ASCII_HIGH_BITS)
+            break;
+    }
+
+    return utf8_validate_scalar(src + i, size - i);
+}
+
+static Utf8_Kernel utf8_kernel = utf8_copy_scalar;
+
+#endif
+
+void utf8_init(void)
+{
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        utf8_kernel = utf8_copy_avx2;
+#endif
+}
+
+bool utf8_copy(uint8 *dst, const uint8 *src, usize size) { return utf8_kernel(dst, src, size); }
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+/*
+ * UTF-8 validation fused with the copy of a string out of a packet, as MQTT
+ * requires for topic names, topic filters, client identifiers and user names:
+ * well-formed UTF-8 (no overlong forms, surrogates or code points past
+ * U+10FFFF) and no U+0000. Each vector of input is validated while it's in
+ * registers for the store, a string costs a single pass over its bytes.
+ *
+ * The kernel is picked at runtime, like the topic scan: AVX2 validates any
+ * input with lookup tables over each byte and the three preceding it, SSE2
+ * runs ASCII a vector at a time and the rest byte by byte, other CPUs use
+ * 8 bytes words for ASCII.
+ */
+
+// Select the kernel for the running CPU, to be called once before any copy
+void utf8_init(void);
+
+/*
+ * Copy size bytes from src to dst, returns false if they're not a valid MQTT
+ * UTF-8 string, dst is left with an unspecified content in that case.
+ */
+bool utf8_copy(uint8 *dst, const uint8 *src, usize size);
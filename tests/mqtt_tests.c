@@ -1,8 +1,17 @@
 #include "../src/mqtt.h"
+#include "../src/shard.h"
+#include "../src/tera_internal.h"
+#include "../src/trie.h"
+#include "../src/utf8.h"
 #include "test_helpers.h"
 #include "tests.h"
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 static int test_variable_length_read(void)
 {
@@ -41,6 +50,16 @@ static int test_variable_length_read(void)
     ASSERT_EQ(len4, 0);
     ASSERT_EQ(bytes4, 0);
 
+    // Malformed - not the shortest encoding, and truncated
+    Buffer buf5 = {.data = (uint8[]){0x80, 0x80, 0x00}, .size = 3};
+    ASSERT_EQ(0, mqtt_variable_length_read(&buf5, &len4));
+    ASSERT_EQ(0, buf5.read_pos);
+
+    uint32 value = 0;
+    ASSERT_EQ(0, mqtt_variable_length_decode((uint8[]){0x80, 0x80, 0x80}, 3, &value));
+    ASSERT_EQ(3, mqtt_variable_length_decode((uint8[]){0x80, 0x80, 0x01}, 3, &value));
+    ASSERT_EQ(16384, value);
+
     TEST_FOOTER;
     return 0;
 }
@@ -71,6 +90,853 @@ static int test_variable_length_write(void)
     ASSERT_EQ(4, bytes3);
     ASSERT_TRUE(memcmp(test3, buf3.data, 4) == 0, " FAIL: encoded buffer doesn't match expected\n");
 
+    // Test case 4: Appended after other data, e.g. properties length
+    uint8_t test4[] = {0x80, 0x01}; // 128
+    Buffer buf4     = {.data = (uint8[8]){0}, .write_pos = 5, .size = 8};
+    isize bytes4    = mqtt_variable_length_write(&buf4, 128);
+    ASSERT_EQ(2, bytes4);
+    ASSERT_TRUE(memcmp(test4, buf4.data + 5, 2) == 0,
+                " FAIL: encoded buffer doesn't match expected\n");
+
+    // Round trip around each length boundary
+    static const uint32 values[] = {0, 127, 128, 16383, 16384, 2097151, 2097152, 268435455};
+    for (usize i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+        Buffer round  = {.data = (uint8[4]){0}, .size = 4};
+        usize decoded = 0;
+        isize bytes   = mqtt_variable_length_write(&round, values[i]);
+        ASSERT_EQ(mqtt_variable_length_encoded_length(values[i]), bytes);
+        ASSERT_EQ(bytes, mqtt_variable_length_read(&round, &decoded));
+        ASSERT_EQ(values[i], decoded);
+    }
+
+    Buffer full = {.data = (uint8[1]){0}, .size = 1};
+    ASSERT_EQ(-1, mqtt_variable_length_write(&full, 128));
+    ASSERT_EQ(0, full.write_pos);
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_frame_next(void)
+{
+    TEST_HEADER;
+
+    // PINGREQ, PUBACK id 5 and the first 3 bytes of a PUBLISH to "a"
+    uint8 data[16] = {0xC0, 0x00, 0x40, 0x02, 0x00, 0x05, 0x30, 0x03, 0x00};
+    Buffer buf     = {.data = data, .size = sizeof(data), .read_pos = 0, .write_pos = 9};
+    MQTT_Frame frame;
+
+    ASSERT_EQ(MQTT_DECODE_SUCCESS, mqtt_frame_next(&buf, &frame));
+    ASSERT_EQ(PINGREQ, frame.header.bits.type);
+    ASSERT_EQ(2, frame.size);
+
+    ASSERT_EQ(MQTT_DECODE_SUCCESS, mqtt_frame_next(&buf, &frame));
+    ASSERT_EQ(PUBACK, frame.header.bits.type);
+    ASSERT_EQ(2, frame.payload.size);
+    ASSERT_EQ(0x00, frame.payload.data[0]);
+    ASSERT_EQ(0x05, frame.payload.data[1]);
+
+    // Nothing is consumed until the rest arrives
+    ASSERT_EQ(MQTT_DECODE_INCOMPLETE, mqtt_frame_next(&buf, &frame));
+    ASSERT_EQ(5, frame.size);
+    ASSERT_EQ(6, buf.read_pos);
+
+    buffer_write(&buf, (uint8[]){0x01, 'a', 0xC0}, 3);
+    ASSERT_EQ(MQTT_DECODE_SUCCESS, mqtt_frame_next(&buf, &frame));
+    ASSERT_EQ(PUBLISH, frame.header.bits.type);
+    ASSERT_EQ(3, frame.payload.size);
+    ASSERT_EQ('a', frame.payload.data[2]);
+
+    // A split fixed header, then one that can never fit
+    ASSERT_EQ(MQTT_DECODE_INCOMPLETE, mqtt_frame_next(&buf, &frame));
+    ASSERT_EQ(0, frame.size);
+    buffer_write(&buf, (uint8[]){0x80, 0x01}, 2);
+    ASSERT_EQ(MQTT_DECODE_OUT_OF_BOUNDS, mqtt_frame_next(&buf, &frame));
+
+    // More than 4 bytes of remaining length
+    Buffer bad = {.data = (uint8[]){0x30, 0xFF, 0xFF, 0xFF, 0xFF, 0x01}, .size = 6, .write_pos = 6};
+    ASSERT_EQ(MQTT_DECODE_ERROR, mqtt_frame_next(&bad, &frame));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_fixed_packet_encode(void)
+{
+    TEST_HEADER;
+
+    uint8 data[5] = {0};
+    Buffer buf    = {.data = data, .size = sizeof(data)};
+
+    ASSERT_EQ(4, mqtt_puback_size());
+    ASSERT_EQ(4, mqtt_pubrel_encode(&buf, 0x1234));
+    ASSERT_EQ(0x62, data[0]);
+    ASSERT_EQ(0x02, data[1]);
+    ASSERT_EQ(0x12, data[2]);
+    ASSERT_EQ(0x34, data[3]);
+
+    // Sized once, nothing is written if the whole frame doesn't fit
+    ASSERT_EQ(0, mqtt_connack_v5_encode(&buf, 0x01, 0x87, 0));
+    ASSERT_EQ(4, buf.write_pos);
+
+    buffer_reset(&buf);
+    ASSERT_EQ(5, mqtt_connack_v5_encode(&buf, 0x01, 0x87, 0));
+    ASSERT_EQ(0x20, data[0]);
+    ASSERT_EQ(0x03, data[1]);
+    ASSERT_EQ(0x87, data[3]);
+
+    TEST_FOOTER;
+
+    return 0;
+}
+
+static Tera_Context trie_ctx                                          = {0};
+static Arena trie_topic_arena                                         = {0};
+static alignas(4) uint8 trie_topic_buffer[MAX_TOPIC_DATA_BUFFER_SIZE] = {0};
+
+static void trie_reset(uint32 arena_size)
+{
+    arena_init(&trie_topic_arena, trie_topic_buffer, arena_size);
+    trie_ctx.topic_arena = &trie_topic_arena;
+    for (usize i = 0; i < MAX_SUBSCRIPTIONS; ++i) {
+        trie_ctx.subscription_data[i] = (Subscription_Data){.trie_next = -1, .exact_next = -1};
+        trie_ctx.subscription_filters[i] =
+            (Subscription_Filter){
+                .topic_offset = TOPIC_FILTER_NONE, .trie_node = -1, .client_next = -1};
+    }
+    for (usize i = 0; i < BITMAP_WORDS(MAX_SUBSCRIPTIONS); ++i)
+        trie_ctx.subscription_bitmap[i] = 0;
+    topic_trie_init(&trie_ctx);
+    exact_index_init(&trie_ctx);
+    match_cache_init(&trie_ctx);
+}
+
+static int16 trie_subscribe(int16 index, const char *filter)
+{
+    Subscription_Filter *sub = &trie_ctx.subscription_filters[index];
+    uint8 *dst               = topic_filter_alloc(&trie_ctx, index, strlen(filter));
+    if (!dst)
+        return -1;
+
+    memcpy(dst, filter, strlen(filter));
+    sub->topic_size = strlen(filter);
+    sub->topic_hash = topic_hash(filter, sub->topic_size);
+    sub->type       = strpbrk(filter, "+#") ? TFT_WILDCARD_PLUS : TFT_WILDCARD_NONE;
+
+    bitmap_set(trie_ctx.subscription_bitmap, index);
+    if (sub->type != TFT_WILDCARD_NONE ? topic_trie_insert(&trie_ctx, index) < 0
+                                       : exact_index_insert(&trie_ctx, index) < 0)
+        return -1;
+
+    return index;
+}
+
+static void trie_unsubscribe(int16 index)
+{
+    if (trie_ctx.subscription_filters[index].type == TFT_WILDCARD_NONE)
+        exact_index_remove(&trie_ctx, index);
+    else
+        topic_trie_remove(&trie_ctx, index);
+    topic_filter_release(&trie_ctx, index);
+    bitmap_clear(trie_ctx.subscription_bitmap, index);
+}
+
+static bool trie_matches(const char *topic, int16 sub)
+{
+    int16 out[MAX_SUBSCRIPTIONS];
+    Topic_Levels levels;
+    usize size  = strlen(topic);
+    usize count = exact_index_match(&trie_ctx, topic, size, topic_hash(topic, size), out, 0,
+                                    MAX_SUBSCRIPTIONS);
+    topic_scan(topic, size, &levels);
+    count += topic_trie_match(&trie_ctx, topic, &levels, out + count, MAX_SUBSCRIPTIONS - count);
+    for (usize i = 0; i < count; ++i)
+        if (out[i] == sub)
+            return true;
+    return false;
+}
+
+static int test_topic_trie_match(void)
+{
+    TEST_HEADER;
+
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+
+    int16 exact = trie_subscribe(0, "sensors/kitchen/temp");
+    int16 plus  = trie_subscribe(1, "sensors/+/temp");
+    int16 hash  = trie_subscribe(2, "sensors/#");
+    int16 all   = trie_subscribe(3, "#");
+    int16 empty = trie_subscribe(4, "a//b");
+
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", exact), " FAIL: exact filter\n");
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", plus), " FAIL: '+' filter\n");
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", hash), " FAIL: '#' filter\n");
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", all), " FAIL: '#' root filter\n");
+    ASSERT_TRUE(trie_matches("sensors", hash), " FAIL: '#' parent level\n");
+    ASSERT_TRUE(!trie_matches("sensors/kitchen/humidity", plus), " FAIL: '+' mismatch\n");
+    ASSERT_TRUE(!trie_matches("sensors/kitchen", exact), " FAIL: exact prefix\n");
+    ASSERT_TRUE(trie_matches("a//b", empty), " FAIL: empty level\n");
+    ASSERT_TRUE(!trie_matches("a/b", empty), " FAIL: empty level mismatch\n");
+
+    int16 out[MAX_SUBSCRIPTIONS];
+    Topic_Levels levels;
+    topic_scan("sensors/x/temp", 14, &levels);
+    ASSERT_EQ(topic_trie_match(&trie_ctx, "sensors/x/temp", &levels, out, MAX_SUBSCRIPTIONS), 3);
+
+    // Subscriptions to the same exact filter share a bucket
+    int16 twin = trie_subscribe(5, "sensors/kitchen/temp");
+    ASSERT_EQ(exact_index_match(&trie_ctx, "sensors/kitchen/temp", 20,
+                                topic_hash("sensors/kitchen/temp", 20), out, 0, MAX_SUBSCRIPTIONS),
+              2);
+
+    trie_unsubscribe(exact);
+    ASSERT_TRUE(!trie_matches("sensors/kitchen/temp", exact), " FAIL: removed filter\n");
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", twin), " FAIL: shared filter\n");
+
+    // Removing a subscription prunes its branch, the shared levels survive
+    trie_unsubscribe(hash);
+    ASSERT_TRUE(!trie_matches("sensors", hash), " FAIL: removed wildcard\n");
+    ASSERT_TRUE(trie_matches("sensors/kitchen/temp", plus), " FAIL: sibling filter\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static void client_link(int16 index, uint16 client_id)
+{
+    Client_Data *client = &trie_ctx.client_data[client_id];
+
+    trie_ctx.subscription_data[index].client_id      = client_id;
+    trie_ctx.subscription_filters[index].client_next = client->subscriptions;
+    client->subscriptions                            = index;
+}
+
+static int test_client_subscriptions(void)
+{
+    TEST_HEADER;
+
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+
+    // Client 1 holds 4, 2, 0 in this order, client 2 holds 3, 1
+    const char *filters[]                 = {"a/b", "c/+", "d/e", "f/#", "g/h"};
+    trie_ctx.client_data[1].subscriptions = -1;
+    trie_ctx.client_data[2].subscriptions = -1;
+    for (int16 i = 0; i < 5; ++i) {
+        ASSERT_EQ(i, trie_subscribe(i, filters[i]));
+        client_link(i, i % 2 ? 2 : 1);
+    }
+
+    // Freed from the middle of the list, its neighbours get linked
+    mqtt_subscription_free(&trie_ctx, 2);
+    ASSERT_EQ(4, trie_ctx.client_data[1].subscriptions);
+    ASSERT_EQ(0, trie_ctx.subscription_filters[4].client_next);
+    ASSERT_TRUE(!bitmap_test(trie_ctx.subscription_bitmap, 2), " FAIL: middle released\n");
+
+    // Draining by the head as on disconnect empties the list and the slots
+    while (trie_ctx.client_data[1].subscriptions != -1)
+        mqtt_subscription_free(&trie_ctx, trie_ctx.client_data[1].subscriptions);
+    ASSERT_TRUE(!bitmap_test(trie_ctx.subscription_bitmap, 0) &&
+                    !bitmap_test(trie_ctx.subscription_bitmap, 4),
+                " FAIL: slots released\n");
+    ASSERT_TRUE(!trie_matches("a/b", 0) && !trie_matches("d/e", 2), " FAIL: unindexed\n");
+
+    // The other client keeps its list and its subscriptions
+    ASSERT_EQ(3, trie_ctx.client_data[2].subscriptions);
+    ASSERT_EQ(1, trie_ctx.subscription_filters[3].client_next);
+    ASSERT_EQ(-1, trie_ctx.subscription_filters[1].client_next);
+    ASSERT_TRUE(bitmap_test(trie_ctx.subscription_bitmap, 1) &&
+                    bitmap_test(trie_ctx.subscription_bitmap, 3),
+                " FAIL: other client untouched\n");
+    ASSERT_TRUE(trie_matches("c/x", 1) && trie_matches("f/x/y", 3), " FAIL: other matches\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_subscription_remove(void)
+{
+    TEST_HEADER;
+
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+
+    // Four subscriptions of the same client, the first and third to the same filter
+    const char *filters[]                 = {"a/b", "a/+", "a/b", "x/#"};
+    trie_ctx.client_data[3].subscriptions = -1;
+    for (int16 i = 0; i < 4; ++i) {
+        ASSERT_EQ(i, trie_subscribe(i, filters[i]));
+        trie_ctx.subscription_data[i].client_id      = 3;
+        trie_ctx.subscription_filters[i].client_next = trie_ctx.client_data[3].subscriptions;
+        trie_ctx.client_data[3].subscriptions        = i;
+    }
+
+    ASSERT_EQ(2, mqtt_subscription_remove(&trie_ctx, 3, "a/b", 3));
+    ASSERT_EQ(0, mqtt_subscription_remove(&trie_ctx, 3, "a/b", 3));
+    ASSERT_EQ(0, mqtt_subscription_remove(&trie_ctx, 4, "a/+", 3));
+    ASSERT_TRUE(!trie_matches("a/b", 0) && !trie_matches("a/b", 2), " FAIL: exact removed\n");
+    ASSERT_TRUE(trie_matches("a/b", 1), " FAIL: wildcard kept\n");
+
+    // The slots are free again and the client's list holds what's left
+    ASSERT_EQ(1, mqtt_subscription_remove(&trie_ctx, 3, "x/#", 3));
+    ASSERT_EQ(1, trie_ctx.client_data[3].subscriptions);
+    ASSERT_EQ(-1, trie_ctx.subscription_filters[1].client_next);
+    ASSERT_TRUE(!bitmap_test(trie_ctx.subscription_bitmap, 0) &&
+                    !bitmap_test(trie_ctx.subscription_bitmap, 3),
+                " FAIL: slots released\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_topic_scan(void)
+{
+    TEST_HEADER;
+
+    Topic_Levels levels;
+
+    // Longer than a vector of each width, boundaries fall in the vectors and the tail
+    const char *topic = "site/building-north/floor-12/room-1204/sensor-7/temperature/celsius";
+    topic_scan(topic, strlen(topic), &levels);
+    ASSERT_EQ(levels.count, 7);
+    ASSERT_EQ(levels.end[0], 4);
+    ASSERT_EQ(levels.end[2], 28);
+    ASSERT_EQ(levels.end[5], 59);
+    ASSERT_EQ(levels.end[6], strlen(topic));
+    ASSERT_EQ(topic_level_start(&levels, 6), 60);
+    ASSERT_EQ(levels.plus + levels.hash, 0);
+
+    // Empty levels, and wildcards past the first vectors
+    const char *filter = "/a//b/cccccccccccccccccccccccccccccc/+/dddddddddddddddddddd/+/#";
+    topic_scan(filter, strlen(filter), &levels);
+    ASSERT_EQ(levels.count, 9);
+    ASSERT_EQ(levels.end[0], 0);
+    ASSERT_EQ(levels.end[2], 3);
+    ASSERT_EQ(levels.plus, 2);
+    ASSERT_EQ(levels.hash, 1);
+
+    topic_scan("", 0, &levels);
+    ASSERT_EQ(levels.count, 1);
+    ASSERT_EQ(levels.end[0], 0);
+
+    // Deeper than the recorded levels, the count stays exact
+    char deep[2 * (TOPIC_MAX_LEVELS + 8)];
+    for (usize i = 0; i < sizeof(deep); i += 2)
+        memcpy(deep + i, "x/", 2);
+    topic_scan(deep, sizeof(deep), &levels);
+    ASSERT_EQ(levels.count, TOPIC_MAX_LEVELS + 9);
+    ASSERT_EQ(levels.end[TOPIC_MAX_LEVELS - 1], 2 * TOPIC_MAX_LEVELS - 1);
+
+    ASSERT_TRUE(topic_bytes_equal(topic, topic, strlen(topic)), " FAIL: equal bytes\n");
+    ASSERT_TRUE(!topic_bytes_equal(topic, "site/building-north/floor-12/room-1204/sensor-7/x", 49),
+                " FAIL: last vector\n");
+    ASSERT_TRUE(!topic_bytes_equal("sensor-7", "sensor-8", 8), " FAIL: last word\n");
+    ASSERT_TRUE(topic_bytes_equal("temp", "temp", 4), " FAIL: short word\n");
+
+    // A '#' filter matches topics with more levels than any filter can have
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+    int16 all = trie_subscribe(0, "x/#");
+    char deep_topic[sizeof(deep) + 1] = {0};
+    memcpy(deep_topic, deep, sizeof(deep) - 1);
+    ASSERT_TRUE(trie_matches(deep_topic, all), " FAIL: '#' on a deep topic\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_match_cache(void)
+{
+    TEST_HEADER;
+
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+
+    const Match_Cache_Stats *stats = &trie_ctx.match_cache_stats;
+    const char *topic              = "site/floor-1/room-2/temp";
+    usize size                     = strlen(topic);
+    uint32 hash                    = topic_hash(topic, size);
+    int16 stored[]                 = {3, 1, 4};
+    int16 matches[MATCH_CACHE_MAX_MATCHES];
+
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, topic, size, hash, matches), -1);
+    match_cache_store(&trie_ctx, topic, size, hash, stored, 3);
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, topic, size, hash, matches), 3);
+    ASSERT_EQ(matches[2], 4);
+
+    // Same hash, different topic bytes
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, "site/floor-1/room-2/hume", size, hash, matches), -1);
+
+    // Any change to the filters makes every entry stale
+    trie_subscribe(0, "site/+/+/temp");
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, topic, size, hash, matches), -1);
+    match_cache_store(&trie_ctx, topic, size, hash, stored, 1);
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, topic, size, hash, matches), 1);
+    trie_unsubscribe(0);
+    ASSERT_EQ(match_cache_lookup(&trie_ctx, topic, size, hash, matches), -1);
+
+    // Another live topic on the same entry is evicted, oversized ones are never stored
+    match_cache_store(&trie_ctx, topic, size, hash, stored, 1);
+    match_cache_store(&trie_ctx, "other", 5, hash, stored, 1);
+    char long_topic[MATCH_CACHE_TOPIC_SIZE + 1];
+    memset(long_topic, 'a', sizeof(long_topic));
+    match_cache_store(&trie_ctx, long_topic, sizeof(long_topic), hash, stored, 1);
+
+    ASSERT_EQ(stats->hits, 2);
+    ASSERT_EQ(stats->misses, 4);
+    ASSERT_EQ(stats->evictions, 1);
+    ASSERT_EQ(stats->uncacheable, 1);
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static bool utf8_valid(const char *string)
+{
+    uint8 dst[128];
+    return utf8_copy(dst, (const uint8 *)string, strlen(string)) &&
+           memcmp(dst, string, strlen(string)) == 0;
+}
+
+static int test_utf8_copy(void)
+{
+    TEST_HEADER;
+
+    ASSERT_TRUE(utf8_valid(""), " FAIL: empty string\n");
+    ASSERT_TRUE(utf8_valid("sensors/kitchen/temperature"), " FAIL: ASCII\n");
+    ASSERT_TRUE(utf8_valid("caf\xC3\xA9/\xE2\x82\xAC/\xF0\x9F\x98\x80/\xF4\x8F\xBF\xBF"),
+                " FAIL: multibyte\n");
+    // A 4 bytes sequence across the first 32 bytes boundary
+    ASSERT_TRUE(utf8_valid("site/building/floor/room/sen\xF0\x9F\x98\x80sor/metric"),
+                " FAIL: sequence across vectors\n");
+
+    ASSERT_TRUE(!utf8_valid("a/\xC0\xAF"), " FAIL: overlong 2 bytes\n");
+    ASSERT_TRUE(!utf8_valid("a/\xE0\x80\xAF"), " FAIL: overlong 3 bytes\n");
+    ASSERT_TRUE(!utf8_valid("a/\xED\xA0\x80"), " FAIL: surrogate\n");
+    ASSERT_TRUE(!utf8_valid("a/\xF4\x90\x80\x80"), " FAIL: past U+10FFFF\n");
+    ASSERT_TRUE(!utf8_valid("a/\x80"), " FAIL: lone continuation\n");
+    ASSERT_TRUE(!utf8_valid("0123456789abcdef0123456789abcde\xE2\x82"),
+                " FAIL: truncated sequence\n");
+    ASSERT_TRUE(!utf8_valid("0123456789abcdef0123456789abcdef\xC3"),
+                " FAIL: lead byte at the end\n");
+
+    // U+0000 is not allowed, the bytes are checked with an explicit size
+    uint8 nul[] = {'a', '/', 0, 'b'};
+    uint8 dst[sizeof(nul)];
+    ASSERT_TRUE(!utf8_copy(dst, nul, sizeof(nul)), " FAIL: U+0000\n");
+
+    // The read position only moves past a valid string
+    Buffer buf = {.data = nul, .size = sizeof(nul), .write_pos = sizeof(nul)};
+    ASSERT_EQ(buffer_read_utf8(dst, &buf, sizeof(nul)), 0);
+    ASSERT_EQ(buf.read_pos, 0);
+    ASSERT_EQ(buffer_read_utf8(dst, &buf, 2), 2);
+    ASSERT_EQ(buf.read_pos, 2);
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_topic_filter_compact(void)
+{
+    TEST_HEADER;
+
+    // Room for the three filters below only, 12 + 16 + 12 bytes with headers
+    trie_reset(48);
+
+    int16 dead     = trie_subscribe(0, "dead/+/x");
+    int16 survivor = trie_subscribe(1, "zzzzzzzzzz");
+    int16 shared   = trie_subscribe(2, "dead/+/y");
+    ASSERT_EQ(-1, trie_subscribe(3, "new/topic/abc"));
+
+    // The first filter created the "dead" and "+" nodes, it goes away and the
+    // other two slide down over it
+    trie_unsubscribe(dead);
+    ASSERT_EQ(3, trie_subscribe(3, "new/topic/abc"));
+
+    ASSERT_EQ(4, trie_ctx.subscription_filters[survivor].topic_offset);
+    ASSERT_EQ(20, trie_ctx.subscription_filters[shared].topic_offset);
+    ASSERT_TRUE(trie_matches("dead/1/y", shared), " FAIL: relocated trie labels\n");
+    ASSERT_TRUE(trie_matches("zzzzzzzzzz", survivor), " FAIL: relocated exact filter\n");
+    ASSERT_TRUE(trie_matches("new/topic/abc", 3), " FAIL: filter stored after compaction\n");
+    ASSERT_EQ(-1, trie_subscribe(4, "a"));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static usize send_queue_gather(const Send_Queue *queue, uint8 *out)
+{
+    struct iovec iov[SEND_QUEUE_IOV_MAX];
+    int count   = send_queue_iovecs(queue, iov, SEND_QUEUE_IOV_MAX);
+    usize total = 0;
+
+    for (int i = 0; i < count; ++i) {
+        memcpy(out + total, iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+
+    return total;
+}
+
+static int test_send_queue_iovecs(void)
+{
+    TEST_HEADER;
+
+    Send_Queue queue = {0};
+    Buffer_Pool pool = {0};
+    uint8 scratch[16];
+    uint8 out[64];
+    buffer_pool_init(&pool, scratch, sizeof(scratch), 1);
+    send_queue_init(&queue, &pool);
+
+    // Shared QoS 1 PUBLISH, topic "a/b", packet id at offset 7, payload "hi"
+    const uint8 frame[] = {0x32, 0x09, 0x00, 0x03, 'a', '/', 'b', 0x00, 0x00, 'h', 'i'};
+    ASSERT_EQ(0, send_queue_push(&queue, frame, sizeof(frame), 7, 0x1234, true, 3));
+
+    Buffer *buf = send_queue_scratch_begin(&queue, 4);
+    ASSERT_TRUE(buf != NULL, " FAIL: scratch space\n");
+    buffer_write(buf, (uint8[]){0x40, 0x02, 0x00, 0x05}, 4);
+    ASSERT_EQ(0, send_queue_scratch_commit(&queue));
+
+    const uint8 expected[] = {0x3A, 0x09, 0x00, 0x03, 'a', '/', 'b', 0x12, 0x34,
+                              'h',  'i',  0x40, 0x02, 0x00, 0x05};
+    ASSERT_EQ(sizeof(expected), send_queue_gather(&queue, out));
+    ASSERT_TRUE(memcmp(expected, out, sizeof(expected)) == 0, " FAIL: patched frames\n");
+    ASSERT_TRUE(frame[0] == 0x32 && frame[7] == 0x00, " FAIL: shared frame modified\n");
+
+    // Partial write in the middle of the packet identifier
+    send_queue_consume(&queue, 8);
+    ASSERT_EQ(sizeof(expected) - 8, send_queue_gather(&queue, out));
+    ASSERT_TRUE(memcmp(expected + 8, out, sizeof(expected) - 8) == 0, " FAIL: resumed write\n");
+
+    // Once drained the scratch space goes back to the pool
+    send_queue_consume(&queue, sizeof(expected) - 8);
+    ASSERT_TRUE(send_queue_is_empty(&queue), " FAIL: drained queue\n");
+    ASSERT_TRUE(queue.scratch.data == NULL, " FAIL: scratch released\n");
+    ASSERT_EQ(0, pool.in_use);
+    ASSERT_TRUE(buffer_pool_acquire(&pool) == scratch, " FAIL: scratch reused\n");
+
+    // Only the owner of the shared frame is handed back
+    ASSERT_EQ(3, send_queue_next_released(&queue));
+    ASSERT_EQ(-1, send_queue_next_released(&queue));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_timer_wheel(void)
+{
+    TEST_HEADER;
+
+    Timer_Wheel wheel = {0};
+    Timer_Node nodes[4];
+    timer_wheel_init(&wheel, nodes, 4, 0);
+
+    // Level 0, 6.4s cascaded from level 1 and cancelled
+    timer_wheel_schedule(&wheel, 0, 250);
+    timer_wheel_schedule(&wheel, 1, 20000);
+    timer_wheel_schedule(&wheel, 2, 1000);
+    timer_wheel_cancel(&wheel, 2);
+    ASSERT_EQ(2, wheel.armed);
+    ASSERT_EQ(300, timer_wheel_timeout(&wheel, 0));
+
+    timer_wheel_advance(&wheel, 200);
+    ASSERT_EQ(-1, timer_wheel_next_expired(&wheel));
+    timer_wheel_advance(&wheel, 300);
+    ASSERT_EQ(0, timer_wheel_next_expired(&wheel));
+    ASSERT_EQ(-1, timer_wheel_next_expired(&wheel));
+
+    // Only the level 1 timer is left, the wait is capped to the next cascade
+    ASSERT_EQ(6100, timer_wheel_timeout(&wheel, 300));
+    timer_wheel_advance(&wheel, 19900);
+    ASSERT_EQ(-1, timer_wheel_next_expired(&wheel));
+    timer_wheel_advance(&wheel, 20000);
+    ASSERT_EQ(1, timer_wheel_next_expired(&wheel));
+    ASSERT_EQ(-1, timer_wheel_timeout(&wheel, 20000));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static Tera_Context conn_ctx = {0};
+
+static int test_connection_slots(void)
+{
+    TEST_HEADER;
+
+    connection_table_init(&conn_ctx);
+
+    // Descriptors way past MAX_CLIENTS are fine, only the number of connections is bounded
+    int32 a = connection_open(&conn_ctx, 5);
+    int32 b = connection_open(&conn_ctx, 70000);
+    int32 c = connection_open(&conn_ctx, 6);
+    ASSERT_TRUE(a >= 0 && b >= 0 && c >= 0, " FAIL: open\n");
+    ASSERT_EQ(b, connection_lookup(&conn_ctx, 70000));
+    ASSERT_EQ(-1, connection_lookup(&conn_ctx, 7));
+
+    uint32 generation = conn_ctx.connection_data[a].generation;
+    connection_close(&conn_ctx, a);
+    ASSERT_EQ(-1, connection_lookup(&conn_ctx, 5));
+    ASSERT_EQ(c, connection_lookup(&conn_ctx, 6));
+
+    // Live slots stay packed at the front
+    ASSERT_EQ(2, conn_ctx.connection_count);
+    ASSERT_TRUE((conn_ctx.connection_ids[0] == c && conn_ctx.connection_ids[1] == b) ||
+                    (conn_ctx.connection_ids[0] == b && conn_ctx.connection_ids[1] == c),
+                " FAIL: packed slots\n");
+
+    // The same descriptor on the recycled slot is a different connection
+    int32 d = connection_open(&conn_ctx, 5);
+    ASSERT_EQ(a, d);
+    ASSERT_TRUE(!connection_is_live(&conn_ctx, d, generation), " FAIL: stale generation\n");
+    ASSERT_TRUE(connection_is_live(&conn_ctx, d, conn_ctx.connection_data[d].generation),
+                " FAIL: live generation\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_delivery_index(void)
+{
+    TEST_HEADER;
+
+    connection_table_init(&conn_ctx);
+    timer_wheel_init(&conn_ctx.timer_wheel, conn_ctx.timer_nodes, MAX_TIMERS, 0);
+    mqtt_message_delivery_index_init(&conn_ctx);
+
+    int32 conn_id = connection_open(&conn_ctx, 5);
+    ASSERT_TRUE(conn_id >= 0, " FAIL: open\n");
+
+    // Far more deliveries than the old buckets held, for the same client
+    const uint16 count = 3000;
+    for (uint16 i = 0; i < count; ++i) {
+        Message_Delivery *delivery  = &conn_ctx.message_deliveries[i];
+        delivery->client_id         = conn_id;
+        delivery->client_generation = conn_ctx.connection_data[conn_id].generation;
+        delivery->message_id        = i + 1;
+        mqtt_message_delivery_add(&conn_ctx, conn_id, i + 1, i);
+    }
+
+    for (uint16 i = 0; i < count; ++i)
+        ASSERT_TRUE(mqtt_message_delivery_find_existing(&conn_ctx, conn_id, i + 1) ==
+                        &conn_ctx.message_deliveries[i],
+                    " FAIL: lookup\n");
+    ASSERT_TRUE(!mqtt_message_delivery_find_existing(&conn_ctx, conn_id, count + 1),
+                " FAIL: missing key\n");
+
+    // Every other one acked, the entries shifted back are still found
+    for (uint16 i = 0; i < count; i += 2)
+        mqtt_message_delivery_free(&conn_ctx, i);
+
+    for (uint16 i = 0; i < count; ++i) {
+        Message_Delivery *delivery = mqtt_message_delivery_find_existing(&conn_ctx, conn_id, i + 1);
+        ASSERT_TRUE(i % 2 ? delivery == &conn_ctx.message_deliveries[i] : delivery == NULL,
+                    " FAIL: lookup after delete\n");
+    }
+
+    // Deliveries of a previous connection on the slot are skipped
+    connection_close(&conn_ctx, conn_id);
+    ASSERT_EQ(conn_id, connection_open(&conn_ctx, 5));
+    ASSERT_TRUE(!mqtt_message_delivery_find_existing(&conn_ctx, conn_id, 2),
+                " FAIL: stale generation\n");
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_slab_reuse(void)
+{
+    TEST_HEADER;
+
+    static uint8 buffer[4 * SLAB_PAGE_SIZE];
+    Slab_Page pages[4];
+    Slab slab = {0};
+    slab_init(&slab, buffer, sizeof(buffer), pages);
+
+    // Same class, same page
+    int32 a = slab_alloc(&slab, 20);
+    int32 b = slab_alloc(&slab, 32);
+    ASSERT_EQ(a / SLAB_PAGE_SIZE, b / SLAB_PAGE_SIZE);
+
+    // Freed blocks are handed out again
+    slab_free(&slab, a);
+    ASSERT_EQ(a, slab_alloc(&slab, 10));
+
+    // Full page blocks take a page each, until there's none left
+    int32 big[3];
+    for (int i = 0; i < 3; ++i)
+        big[i] = slab_alloc(&slab, SLAB_PAGE_SIZE);
+    ASSERT_TRUE(big[0] >= 0 && big[1] >= 0 && big[2] >= 0, " FAIL: page blocks\n");
+    ASSERT_EQ(-1, slab_alloc(&slab, 100));
+
+    // An empty page goes back to the free pages for any class
+    slab_free(&slab, big[1]);
+    ASSERT_EQ(big[1], slab_alloc(&slab, 100));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static int test_bitmap(void)
+{
+    TEST_HEADER;
+
+    uint64 map[BITMAP_WORDS(200)] = {0};
+
+    // Free slots come out in order, a word at a time
+    for (int32 i = 0; i < 130; ++i) {
+        ASSERT_EQ(i, bitmap_find_clear(map, 200));
+        bitmap_set(map, i);
+    }
+
+    bitmap_clear(map, 70);
+    ASSERT_EQ(70, bitmap_find_clear(map, 200));
+    ASSERT_TRUE(bitmap_test(map, 69) && !bitmap_test(map, 70), " FAIL: test bit\n");
+
+    // The walk visits only the set bits
+    usize visited = 0, last = 0;
+    for (usize w = 0; w < BITMAP_WORDS(200); ++w) {
+        for (uint64 bits = map[w]; bits; bits &= bits - 1) {
+            last = w * 64 + __builtin_ctzll(bits);
+            visited++;
+        }
+    }
+    ASSERT_EQ(129, visited);
+    ASSERT_EQ(129, last);
+
+    // 200 bits end in the middle of the last word, its tail is never handed out
+    for (int32 i = 0; i < 200; ++i)
+        bitmap_set(map, i);
+    bitmap_clear(map, 199);
+    ASSERT_EQ(199, bitmap_find_clear(map, 200));
+    bitmap_set(map, 199);
+    ASSERT_EQ(0, map[BITMAP_WORDS(200) - 1] >> (200 % 64));
+    ASSERT_EQ(-1, bitmap_find_clear(map, 200));
+
+    TEST_FOOTER;
+    return 0;
+}
+
+static void frame_init(MQTT_Frame *frame, const void *payload, usize size)
+{
+    frame->header.remaining_length = size;
+    buffer_init(&frame->payload, (void *)payload, size);
+}
+
+static int test_malformed_utf8(void)
+{
+    TEST_HEADER;
+
+    static alignas(4) uint8 client_buffer[MAX_CLIENT_SIZE];
+    Arena client_arena;
+    arena_init(&client_arena, client_buffer, sizeof(client_buffer));
+    trie_ctx.client_arena = &client_arena;
+    trie_reset(MAX_TOPIC_DATA_BUFFER_SIZE);
+
+    /*
+     * A string that isn't valid UTF-8 makes the packet malformed, the decoders
+     * report it as invalid and process_packet closes the connection on it.
+     */
+    Client_Data *client   = &trie_ctx.client_data[0];
+    client->conn_id       = 0;
+    client->subscriptions = -1;
+    MQTT_Frame frame      = {0};
+
+    // CONNECT v5, clean start, client id "a\xFF"
+    const uint8 connect[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05, 0x02, 0x00, 0x3C,
+                             0x00, 0x00, 0x02, 'a', 0xFF};
+    frame_init(&frame, connect, sizeof(connect));
+    ASSERT_EQ(MQTT_DECODE_INVALID, mqtt_connect_read(&trie_ctx, client, &frame));
+
+    // The same client id well-formed is accepted
+    const uint8 connect_ok[] = {0x00, 0x04, 'M', 'Q', 'T', 'T', 0x05, 0x02, 0x00, 0x3C,
+                                0x00, 0x00, 0x02, 'a', 'b'};
+    frame_init(&frame, connect_ok, sizeof(connect_ok));
+    ASSERT_EQ(MQTT_DECODE_SUCCESS, mqtt_connect_read(&trie_ctx, client, &frame));
+
+    // SUBSCRIBE v5 with "a/b" then a filter with an overlong encoding of '/'
+    Subscribe_Result result = {0};
+    const uint8 subscribe[] = {0x00, 0x01, 0x00, 0x00, 0x03, 'a', '/',  'b',
+                               0x00, 0x00, 0x03, 'x', 0xC0, 0xAF, 0x00};
+    frame_init(&frame, subscribe, sizeof(subscribe));
+    ASSERT_EQ(MQTT_DECODE_INVALID, mqtt_subscribe_read(&trie_ctx, client, &frame, &result));
+
+    // Only the filter accepted before is left, for the disconnect to free
+    ASSERT_EQ(0, client->subscriptions);
+    ASSERT_EQ(-1, trie_ctx.subscription_filters[0].client_next);
+    ASSERT_TRUE(!bitmap_test(trie_ctx.subscription_bitmap, 1), " FAIL: slot released\n");
+
+    mqtt_subscription_free(&trie_ctx, 0);
+    ASSERT_EQ(-1, client->subscriptions);
+
+    TEST_FOOTER;
+    return 0;
+}
+
+#define SHARD_STRESS_MESSAGES 20000
+
+typedef struct shard_stress {
+    Shard_Router *router;
+    atomic_uint consumed;
+    atomic_bool lost;
+} Shard_Stress;
+
+/*
+ * Destination shard 1 as the event loop runs it: wait for the wakeup, ack it
+ * and drain. A message still in the ring once nothing wakes the shard anymore
+ * is a lost wakeup.
+ */
+static void *shard_stress_consumer(void *arg)
+{
+    Shard_Stress *stress = arg;
+    struct pollfd pfd    = {.fd = shard_wakeup_fd(stress->router, 1), .events = POLLIN};
+
+    while (atomic_load(&stress->consumed) < SHARD_STRESS_MESSAGES) {
+        if (poll(&pfd, 1, 1000) == 0) {
+            if (shard_ring_peek(stress->router, 0, 1) && poll(&pfd, 1, 100) == 0) {
+                atomic_store(&stress->lost, true);
+                break;
+            }
+            continue;
+        }
+
+        shard_wakeup_ack(stress->router, 1);
+        while (shard_ring_peek(stress->router, 0, 1)) {
+            shard_ring_release(stress->router, 0, 1);
+            atomic_fetch_add(&stress->consumed, 1);
+        }
+    }
+
+    return NULL;
+}
+
+static int test_shard_wakeup(void)
+{
+    TEST_HEADER;
+
+    Shard_Stress stress = {.router = shard_router_create(2)};
+    ASSERT_TRUE(stress.router, " FAIL: router create\n");
+    atomic_init(&stress.consumed, 0);
+    atomic_init(&stress.lost, false);
+
+    pthread_t consumer;
+    ASSERT_EQ(0, pthread_create(&consumer, NULL, shard_stress_consumer, &stress));
+
+    // One message at a time, each one committed while the consumer is around
+    // the end of its drain, where the flag is cleared and the tail read
+    for (uint32 i = 0; i < SHARD_STRESS_MESSAGES && !atomic_load(&stress.lost); ++i) {
+        while (!shard_ring_reserve(stress.router, 0, 1))
+            sched_yield();
+        shard_ring_commit(stress.router, 0, 1);
+
+        while (atomic_load(&stress.consumed) <= i && !atomic_load(&stress.lost))
+            sched_yield();
+    }
+
+    pthread_join(consumer, NULL);
+
+    ASSERT_TRUE(!atomic_load(&stress.lost), " FAIL: wakeup lost, ring left undrained\n");
+    ASSERT_EQ(SHARD_STRESS_MESSAGES, atomic_load(&stress.consumed));
+    ASSERT_TRUE(!shard_ring_peek(stress.router, 0, 1), " FAIL: ring not empty\n");
+
+    shard_router_free(stress.router);
+
     TEST_FOOTER;
     return 0;
 }
@@ -79,11 +945,31 @@ int mqtt_tests(void)
 {
     printf("* %s\n\n", __FUNCTION__);
 
-    int cases   = 2;
+    int cases   = 19;
     int success = cases;
 
+    topic_scan_init();
+    utf8_init();
+
     success += test_variable_length_read();
     success += test_variable_length_write();
+    success += test_frame_next();
+    success += test_fixed_packet_encode();
+    success += test_topic_trie_match();
+    success += test_client_subscriptions();
+    success += test_subscription_remove();
+    success += test_topic_scan();
+    success += test_match_cache();
+    success += test_utf8_copy();
+    success += test_topic_filter_compact();
+    success += test_send_queue_iovecs();
+    success += test_timer_wheel();
+    success += test_connection_slots();
+    success += test_delivery_index();
+    success += test_slab_reuse();
+    success += test_bitmap();
+    success += test_shard_wakeup();
+    success += test_malformed_utf8();
 
     printf("\n Test suite summary: %d passed, %d failed\n", success, cases - success);
 